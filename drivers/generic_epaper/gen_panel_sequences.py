@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+"""
+Compile the panel command sequences in panels.yaml into C arrays for generic_epaper.c.
+
+Each sequence becomes a static const uint8_t array named <panel>_<sequence>, encoded as:
+  EPD_SEQ_RESET                    hardware reset
+  EPD_SEQ_WAIT_BUSY                wait for BUSY to de-assert
+  EPD_SEQ_DELAY, lo, hi            sleep for (hi << 8 | lo) milliseconds
+  n, cmd, data[n-1]                send cmd followed by n-1 data bytes (1 <= n <= MAX_CMD_LEN)
+  EPD_SEQ_DONE                     end of sequence
+
+Anything malformed (bad byte values, over-long commands, unknown steps) fails the build,
+rather than turning up as a panel that silently doesn't initialize.
+
+Usage: gen_panel_sequences.py <panels.yaml> <output.h>
+"""
+
+import sys
+
+import yaml
+
+SEQUENCES = ("init_full", "refresh", "partial_refresh", "power_down")
+# Lengths from 0xF0 upwards are reserved for EPD_SEQ_* opcodes.
+MAX_CMD_LEN = 0xEF
+MAX_DELAY_MS = 0xFFFF
+
+
+class SequenceError(Exception):
+    pass
+
+
+def check_byte(value, what):
+    if not isinstance(value, int) or isinstance(value, bool) or not 0 <= value <= 0xFF:
+        raise SequenceError(f"{what} must be a byte (0-255), got {value!r}")
+    return value
+
+
+def compile_step(step):
+    if step == "reset":
+        return ["EPD_SEQ_RESET"]
+    if step == "busy":
+        return ["EPD_SEQ_WAIT_BUSY"]
+    if not isinstance(step, dict):
+        raise SequenceError(f"unknown step {step!r}")
+
+    if "delay" in step:
+        if set(step) != {"delay"}:
+            raise SequenceError(f"unexpected keys in delay step: {sorted(set(step) - {'delay'})}")
+        ms = step["delay"]
+        if not isinstance(ms, int) or isinstance(ms, bool) or not 1 <= ms <= MAX_DELAY_MS:
+            raise SequenceError(f"delay must be 1-{MAX_DELAY_MS} ms, got {ms!r}")
+        return ["EPD_SEQ_DELAY", f"0x{ms & 0xFF:02X}", f"0x{ms >> 8:02X}"]
+
+    if "cmd" in step:
+        extra = set(step) - {"cmd", "data"}
+        if extra:
+            raise SequenceError(f"unexpected keys in cmd step: {sorted(extra)}")
+        cmd = check_byte(step["cmd"], "cmd")
+        data = step.get("data", [])
+        if not isinstance(data, list):
+            raise SequenceError(f"data for cmd 0x{cmd:02X} must be a list")
+        data = [check_byte(b, f"data byte {i} of cmd 0x{cmd:02X}") for i, b in enumerate(data)]
+        length = len(data) + 1
+        if length > MAX_CMD_LEN:
+            raise SequenceError(f"cmd 0x{cmd:02X} has {len(data)} data bytes, max is {MAX_CMD_LEN - 1}")
+        return [f"0x{length:02X}", f"0x{cmd:02X}"] + [f"0x{b:02X}" for b in data]
+
+    raise SequenceError(f"unknown step {step!r}")
+
+
+def compile_panels(panels):
+    out = []
+    if not isinstance(panels, dict) or not panels:
+        raise SequenceError("expected a mapping of panel name to sequences")
+
+    for panel, sequences in panels.items():
+        if not str(panel).isidentifier():
+            raise SequenceError(f"panel name {panel!r} is not a valid C identifier")
+        if not isinstance(sequences, dict):
+            raise SequenceError(f"{panel}: expected a mapping of sequence name to steps")
+        for name, steps in sequences.items():
+            if name not in SEQUENCES:
+                raise SequenceError(f"{panel}: unknown sequence {name!r} (expected one of {', '.join(SEQUENCES)})")
+            if not isinstance(steps, list):
+                raise SequenceError(f"{panel}.{name}: expected a list of steps")
+            encoded = []
+            for i, step in enumerate(steps):
+                try:
+                    encoded.extend(compile_step(step))
+                except SequenceError as e:
+                    raise SequenceError(f"{panel}.{name}, step {i}: {e}") from None
+            encoded.append("EPD_SEQ_DONE")
+
+            out.append(f"static const uint8_t {panel}_{name}[] = {{")
+            for i in range(0, len(encoded), 12):
+                out.append("    " + ", ".join(encoded[i:i + 12]) + ",")
+            out.append("};")
+            out.append("")
+    return out
+
+
+def main():
+    if len(sys.argv) != 3:
+        print(__doc__, file=sys.stderr)
+        return 2
+
+    with open(sys.argv[1]) as f:
+        panels = yaml.safe_load(f)
+
+    try:
+        body = compile_panels(panels)
+    except SequenceError as e:
+        print(f"{sys.argv[1]}: {e}", file=sys.stderr)
+        return 1
+
+    with open(sys.argv[2], "w") as f:
+        f.write("/* Generated by gen_panel_sequences.py from panels.yaml - do not edit. */\n")
+        f.write("#pragma once\n\n")
+        f.write("\n".join(body))
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -1,5 +1,7 @@
 #define DT_DRV_COMPAT ar_generic_epaper
 
+#include <string.h>
+
 #include <zephyr/kernel.h>
 
 #include <zephyr/device.h>
@@ -12,351 +14,194 @@
 
 LOG_MODULE_REGISTER(generic_epaper, LOG_LEVEL_DBG);
 
-// "special" length values that will trigger particular behaviour.
-// DO_RESET -> Triggers a hardware reset of the panel.
-// WAIT_FOR_BUSY -> Wait until the BUSY line goes inactive.
-#define DO_RESET 0xF0
-#define WAIT_FOR_BUSY 0xF1
-#define WAIT_100ms 0xF2
-#define DONE 0x0
+// Command sequences are compiled from panels.yaml at build time (see gen_panel_sequences.py).
+// Format: a length byte n (1 <= n < 0xF0) followed by the command and n-1 data bytes,
+// or one of these "special" length values that will trigger particular behaviour:
+// EPD_SEQ_RESET -> Triggers a hardware reset of the panel.
+// EPD_SEQ_WAIT_BUSY -> Wait until the BUSY line goes inactive.
+// EPD_SEQ_DELAY -> Sleep for the number of ms in the next two bytes (little endian).
+#define EPD_SEQ_RESET 0xF0
+#define EPD_SEQ_WAIT_BUSY 0xF1
+#define EPD_SEQ_DELAY 0xF2
+#define EPD_SEQ_DONE 0x0
+
+#include "generic_epaper_panels.h"
 
+// Sets up the controller's RAM window so the next data write lands in (x, y, w, h).
+// x/w are in pixels along a data row and are already validated against the controller's RAM and byte alignment.
+typedef int (*epd_window_fn)(const struct device *dev, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+
+static int ssd1680_set_window(const struct device *dev, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+static int uc8179_set_window(const struct device *dev, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
+static int ssd1680_clear_window(const struct device *dev);
+static int uc8179_clear_window(const struct device *dev);
 
 struct epd_metadata {
     uint16_t height;
     uint16_t width;
+    uint8_t bits_per_pixel;
 
-    size_t expected_data_size;
+    // The controller's RAM as the data stream fills it: ram_width pixels along a row, ram_height rows. Window
+    // writes are in these coordinates. 0 when it's the same as width x height.
+    uint16_t ram_width;
+    uint16_t ram_height;
 
-    uint8_t *init_command_list;
-    uint8_t num_planes;
-    uint8_t *powerdown_command_list;
-    uint8_t *refresh_command_list;
+    size_t expected_data_size; // total across all planes. Planes are sent back-to-back, each the same size.
 
-    uint8_t data_transmission_command[];
-};
+    const uint8_t *init_command_list;
+    uint8_t num_planes;
+    const uint8_t *powerdown_command_list;
+    const uint8_t *refresh_command_list;
 
+    // Some controllers latch data on CS de-assertion and need it toggled after every byte.
+    // Everything else gets data handed over in bulk chunks with DC held high.
+    bool per_byte_cs;
 
+    // Fastest SPI clock the controller is rated for when writing. 0 keeps spi-max-frequency from devicetree.
+    // The SPI driver still rounds this down to what the bus instance can do.
+    uint32_t max_write_hz;
 
-// 0x21 to set size of display???
-// 0x00, 0x40??
-// 0x44, 0x40 to blank screen??
-
-/*static const uint8_t GDEY029T71H_init_full[] = {
-    DO_RESET,
-    0x01, 0x12, // SWRESET
-    WAIT_FOR_BUSY,
-    0x02, 0x3C, 0x01, // Border waveform
-    //0x03, 0x21, 0x00, 0x80,
-    0x4, 0x01, (uint8_t)((GDEY029T71H_height-1) % 256), (uint8_t)((GDEY029T71H_height-1) / 256), 0x00,
-    0x2, 0x11, 0x01,
-    0x3, 0x44, 0x00, (uint8_t)(GDEY029T71H_width / 8 - 1),
-    0x5, 0x45, (uint8_t)((GDEY029T71H_height-1) % 256), (uint8_t)((GDEY029T71H_height-1) / 256), 0x00, 0x00,
-    0x2, 0x3C, 0x05,
-    0x2, 0x18, 0x80,
-    0x2, 0x4E, 0x00,
-    0x3, 0x4F, (uint8_t)((GDEY029T71H_height-1) % 256), (uint8_t)((GDEY029T71H_height-1) / 256),
-    WAIT_FOR_BUSY,
-    DONE
-};*/
-
-#define GDEY029T71H_height 384
-#define GDEY029T71H_width 168
-static const uint8_t GDEY029T71H_init_full[] = {
-    DO_RESET,
-    0x01, 0x12, // SWRESET
-    WAIT_FOR_BUSY,
-    0x02, 0x3C, 0x01, // Border waveform
-    //0x03, 0x21, 0x00, 0x80,
-    0x4, 0x01, (uint8_t)((GDEY029T71H_height-1) % 256), (uint8_t)((GDEY029T71H_height-1) / 256), 0x00,
-    0x2, 0x3C, 0x05,
-    0x2, 0x18, 0x80,
-    0x2, 0x21, 0x00,0x00,
-    //0x2, 0x11, 0x03,
-    //0x3, 0x44, 0x01, 21,
-    //0x5, 0x45, 0, 0, 127, 1,
-    //0x2, 0x4e, 1,
-    //0x3, 0x4f, 0, 0,
-    WAIT_FOR_BUSY,
-    DONE
-};
-/**
-
-x = 8
-y = 0
-w = 168
-h = 384
-
-#if 1 // normal, top opposite connection
-  _writeCommand(0x11); // set ram entry mode
-  _writeData(0x03);    // x increase, y increase : normal mode
-  _writeCommand(0x44);
-  _writeData(x / 8);
-  _writeData((x + w - 1) / 8);
-  _writeCommand(0x45);
-  _writeData(y % 256);
-  _writeData(y / 256);
-  _writeData((y + h - 1) % 256);
-  _writeData((y + h - 1) / 256);
-  _writeCommand(0x4e);
-  _writeData(x / 8);
-  _writeCommand(0x4f);
-  _writeData(y % 256);
-  _writeData(y / 256);
-*/
-
-/*static const uint8_t GDEY029T71H_init_full[] = {
-    DO_RESET,
-    0x01, 0x12, // SWRESET
-    WAIT_FOR_BUSY,
-    0x2, 0x18, 0x80,
-    0x2, 0x22, 0xB1,
-    0x1, 0x20,
-    WAIT_FOR_BUSY,
-    0x3, 0x1A, 0x6E, 0x00,
-    0x2, 0x22, 0x91,
-    0x1, 0x20,
-    WAIT_FOR_BUSY,
-    DONE
-};*/
-
-
-
-static const uint8_t GDEY029T71H_refresh[] = {
-    0x03, 0x21, 0x00, 0x00, // setting this to 0x44 instead of 0x40 gives black - overriding B/W ram reads with all zeros. Now it's just a puzzle of writing to RAM properly.
-    0x02, 0x22, 0xF7,
-    0x01, 0x20,
-    WAIT_100ms,
-    WAIT_FOR_BUSY,
-    DONE
-};
+    // How long a single busy wait in a command sequence may take before we give up. 0 uses busy-timeout-ms from devicetree.
+    uint32_t busy_timeout_ms;
 
+    // EPD_CAP_* flags. Window writes need set_window, partial refreshes need partial_refresh_command_list.
+    uint32_t capabilities;
+    epd_window_fn set_window;
+    // Undoes set_window, so the next write covers the whole frame again.
+    epd_cmd_t clear_window;
+    const uint8_t *partial_refresh_command_list;
 
-static const uint8_t GDEY029T71H_power_down[] = {
-    0x02, 0x10, 0x01, // Deep sleep
-    DONE
+    uint8_t data_transmission_command[];
 };
 
 static const struct epd_metadata GDEY029T71H_meta = {
     .height = 168,
     .width = 384,
-    .expected_data_size = 8064,
+    .bits_per_pixel = 1,
+    // RAM X is the 168 px source axis (21 bytes), RAM Y the 384 gates.
+    .ram_width = 168,
+    .ram_height = 384,
+    .expected_data_size = 16128, // both planes (0x24 and 0x26), 8064 bytes each
 
     .init_command_list = GDEY029T71H_init_full,
     .num_planes = 2,
     .powerdown_command_list = GDEY029T71H_power_down,
     .refresh_command_list = GDEY029T71H_refresh,
+    .per_byte_cs = false,
+    .max_write_hz = 20000000, // SSD1680: 50 ns write clock cycle
+    .busy_timeout_ms = 10000,
+    .capabilities = EPD_CAP_PARTIAL_WINDOW | EPD_CAP_PARTIAL_REFRESH,
+    .set_window = ssd1680_set_window,
+    .clear_window = ssd1680_clear_window,
+    .partial_refresh_command_list = GDEY029T71H_partial_refresh,
     .data_transmission_command = {0x24, 0x26}
 };
 
-#define GDEM035F51_Source_BITS 184
-#define GDEM035F51_Gate_BITS 384
-
-static const uint8_t GDEM035F51_init_full[] = {
-    DO_RESET,
-    WAIT_FOR_BUSY,
-
-    0x7, 0x66, 0x49, 0x55, 0x13, 0x5D, 0x05, 0x10,
-    0x2, 0x4D, 0x78,
-    0x3, 0x00, 0x0F, 0x29,
-    0x3, 0x01, 0x07, 0x00,
-    0x4,  0x03, 0x10, 0x54, 0x44,
-    0x8, 0x06, 0x0F, 0x0A, 0x2F, 0x25, 0x22, 0x2E, 0x21,
-    0x2, 0x50, 0x37,
-    0x3, 0x60, 0x02, 0x02,
-    0x5, 0x61, GDEM035F51_Source_BITS/256, GDEM035F51_Source_BITS%256, GDEM035F51_Gate_BITS/256, GDEM035F51_Gate_BITS%256,
-    0x2, 0xE7, 0x1C,
-    0x2, 0xE3, 0x22,
-    0x2, 0xB6, 0x6F,
-    0x2, 0xB4, 0xD0,
-    0x2, 0xE9, 0x01,
-    0x2, 0x30, 0x08,
-    0x1, 0x04,
-    WAIT_FOR_BUSY,
-    DONE
-};
-static const uint8_t GDEM035F51_refresh[] = {
-    0x02, 0x12, 0x00,
-    WAIT_FOR_BUSY,
-    DONE
-};
-static const uint8_t GDEM035F51_power_down[] = {
-    0x2, 0x02, 0x00,
-    WAIT_FOR_BUSY,
-    0x2, 0x07, 0xA5,
-    DONE
-};
-
 static const struct epd_metadata GDEM035F51_meta = {
     .height = 184,
     .width = 384,
+    .bits_per_pixel = 2,
     .expected_data_size = 17664,
 
     .init_command_list = GDEM035F51_init_full,
     .num_planes = 1,
     .powerdown_command_list = GDEM035F51_power_down,
     .refresh_command_list = GDEM035F51_refresh,
+    .per_byte_cs = false,
+    .max_write_hz = 10000000,
+    .busy_timeout_ms = 30000,
     .data_transmission_command = {0x10}
 };
 
-
-
-#define GDEY029F51_Source_BITS 168
-#define GDEY029F51_Gate_BITS 384
-
-static const uint8_t GDEY029F51_init_full[] = {
-    DO_RESET,
-    WAIT_100ms,
-    WAIT_FOR_BUSY,
-    0x2, 0x4D, 0x78,
-    0x3, 0x00, 0x0F, 0x29,
-    0x3, 0x01, 0x07, 0x00,
-    0x4, 0x03, 0x10, 0x54, 0x44,
-    0x8, 0x06, 0x05, 0x00, 0x3F, 0x0A, 0x25, 0x12, 0x1A,
-
-    0x2, 0x50, 0x37,
-    0x3, 0x60, 0x02, 0x02,
-    0x5, 0x61, GDEY029F51_Source_BITS/256, GDEY029F51_Source_BITS%256, GDEY029F51_Gate_BITS/256, GDEY029F51_Gate_BITS%256,
-    0x2, 0xE7, 0x1C,
-    0x2, 0xE3, 0x22,
-    0x2, 0xB4, 0xD0,
-    0x2, 0xB5, 0x03,
-    0x2, 0xE9, 0x01,
-    0x2, 0x30, 0x08,
-    0x1, 0x04,
-    WAIT_FOR_BUSY,
-    DONE
-};
-static const uint8_t GDEY029F51_refresh[] = {
-    0x2, 0x12, 0x00,
-    WAIT_100ms,
-    WAIT_FOR_BUSY,
-    DONE
-};
-static const uint8_t GDEY029F51_power_down[] = {
-    0x1, 0x02,
-    WAIT_FOR_BUSY,
-    WAIT_100ms,
-    0x2, 0x07, 0xA5,
-    DONE
-};
-
 static const struct epd_metadata GDEY029F51_meta = {
     .height = 168,
     .width = 384,
+    .bits_per_pixel = 2,
     .expected_data_size = 16128,
 
     .init_command_list = GDEY029F51_init_full,
     .num_planes = 1,
     .powerdown_command_list = GDEY029F51_power_down,
     .refresh_command_list = GDEY029F51_refresh,
+    .per_byte_cs = false,
+    .max_write_hz = 10000000,
+    .busy_timeout_ms = 30000,
     .data_transmission_command = {0x10}
 };
 
-#define GDEM075F52_Source_BITS 800
-#define GDEM075F52_Gate_BITS 480
-
-static const uint8_t GDEM075F52_init_full[] = {
-    DO_RESET,
-    WAIT_100ms,
-    WAIT_FOR_BUSY,
-
-    0x3, 0x00, 0x0F, 0x29,
-    0x5, 0x06, 0x0F, 0x8B, 0x93, 0xA1,
-    0x2, 0x41, 0x00,
-    0x2, 0x50, 0x37,
-    0x3, 0x60, 0x02, 0x02,
-    0x5, 0x61, GDEM075F52_Source_BITS/256, GDEM075F52_Source_BITS%256, GDEM075F52_Gate_BITS/256, GDEM075F52_Gate_BITS%256,
-    0x9, 0x62, 0x98, 0x98, 0x98, 0x75, 0xCA, 0xB2, 0x98, 0x7E,
-    0x5, 0x65, 0x00, 0x00, 0x00, 0x00,
-    0x2, 0xE7, 0x1C,
-    0x2, 0xE3, 0x00,
-    0x2, 0xE9, 0x01,
-    0x2, 0x30, 0x08,
-    0x1, 0x04,
-    WAIT_FOR_BUSY,
-    0x2, 0xE0, 0x02,
-    0x2, 0xE6, 0x5A,
-    0x2, 0xA5, 0x00,
-    WAIT_FOR_BUSY,
-    DONE
-};
-static const uint8_t GDEM075F52_refresh[] = {
-    0x2, 0x12, 0x00,
-    WAIT_100ms,
-    WAIT_FOR_BUSY,
-    DONE
-};
-static const uint8_t GDEM075F52_power_down[] = {
-    0x2, 0x02, 0x00,
-    WAIT_FOR_BUSY,
-    WAIT_100ms,
-    0x2, 0x07, 0xA5,
-    DONE
-};
-
 static const struct epd_metadata GDEM075F52_meta = {
     .height = 480,
     .width = 800,
+    .bits_per_pixel = 2,
     .expected_data_size = 96000,
 
     .init_command_list = GDEM075F52_init_full,
     .num_planes = 1,
     .powerdown_command_list = GDEM075F52_power_down,
     .refresh_command_list = GDEM075F52_refresh,
+    .per_byte_cs = false,
+    .max_write_hz = 10000000,
+    .busy_timeout_ms = 45000,
     .data_transmission_command = {0x10}
 };
 
-
-static const uint8_t WS_75_V2B_init_full[] = {
-    DO_RESET,
-    WAIT_100ms,
-    DO_RESET,
-    WAIT_100ms,
-    // from waveshare b/w?
-    0x6, 0x01, 0x17,0x17, 0x3F, 0x3F, 0x11,
-    0x2, 0x82, 0x24,
-    0x5, 0x06, 0x27, 0x27, 0x2F, 0x17,
-    0x2, 0x30, 0x06,
-    0x1, 0x04,
-    0x1, 0x71,
-    WAIT_FOR_BUSY,
-    0x2, 0x00, 0x1F,
-    0x5, 0x61, 0x03, 0x20, 0x01, 0xE0,
-    0x2, 0x15, 0x00,
-    0x3, 0x50, 0x10, 0x00,
-    0x2, 0x60, 0x22,
-    0x5, 0x65, 0x00, 0x00, 0x00, 0x00,
-    DONE
-};
-static const uint8_t WS_75_V2B_refresh[] = {
-    0x1, 0x12,
-    WAIT_100ms,
-    WAIT_FOR_BUSY,
-    DONE
-};
-static const uint8_t WS_75_V2B_power_down[] = {
-    0x1, 0x02,
-    WAIT_FOR_BUSY,
-    WAIT_100ms,
-    0x2, 0x07, 0xA5,
-    DONE
-};
-
 static const struct epd_metadata WS_75_V2B_meta = {
     .height = 480,
     .width = 800,
+    .bits_per_pixel = 1,
     .expected_data_size = 48000,
 
     .init_command_list = WS_75_V2B_init_full,
     .num_planes = 1,
     .powerdown_command_list = WS_75_V2B_power_down,
     .refresh_command_list = WS_75_V2B_refresh,
+    .per_byte_cs = false,
+    .max_write_hz = 10000000, // UC8179: 100 ns write clock cycle
+    .busy_timeout_ms = 30000,
+    .capabilities = EPD_CAP_PARTIAL_WINDOW | EPD_CAP_PARTIAL_REFRESH,
+    .set_window = uc8179_set_window,
+    .clear_window = uc8179_clear_window,
+    .partial_refresh_command_list = WS_75_V2B_partial_refresh,
     .data_transmission_command = {/*0x10,*/ 0x13}
 };
 
 
 struct epd_data {
 	struct epd_metadata *meta;
+    epd_type_t type;
+    // A window write left the controller windowed, so a full-frame write has to undo it first.
+    bool window_set;
+
+    // SPI settings for the selected panel. SPI drivers only re-apply a configuration when they're handed a
+    // different spi_config pointer, so a change of clock goes into the other slot and spi_cfg is pointed at it.
+    struct spi_config spi_cfgs[2];
+    const struct spi_config *spi_cfg;
+
+    // Timing for the update in progress, and a ring of the last few completed ones.
+    struct epd_update_timing timing;
+    enum epd_phase phase;
+    uint32_t phase_start;
+    bool timing_active;
+    struct epd_update_timing timing_history[CONFIG_GENERIC_EPAPER_TIMING_HISTORY];
+    uint8_t timing_next;
+    uint8_t timing_count;
+
+    // Throughput counters for frame data, reset on every epd_power_on.
+    uint32_t bytes_written;
+    uint64_t transfer_cycles;
+
+    // Given from the BUSY edge interrupt when the panel stops being busy.
+    struct k_sem busy_sem;
+    struct gpio_callback busy_cb;
+
+    // State for the (single) outstanding asynchronous data write.
+    // The SPI driver keeps pointers to the buffer set until the transfer completes, so it has to live here.
+    struct spi_buf async_buf;
+    struct spi_buf_set async_buf_set;
+    struct k_sem async_sem;
+    bool async_pending;
+    int async_result;
+    uint32_t async_start;
 };
 
 struct epd_config {
@@ -366,15 +211,92 @@ struct epd_config {
     struct gpio_dt_spec rst;
     struct gpio_dt_spec busy;
     struct gpio_dt_spec en;
+
+    uint32_t busy_timeout_ms;
 };
 
+static inline uint16_t epd_ram_width(const struct epd_metadata *meta) {
+    return meta->ram_width != 0 ? meta->ram_width : meta->width;
+}
+
+static inline uint16_t epd_ram_height(const struct epd_metadata *meta) {
+    return meta->ram_height != 0 ? meta->ram_height : meta->height;
+}
+
 static inline bool epd_has_pin(const struct gpio_dt_spec *spec)
 {
 	return spec->port != NULL;
 }
 
+// Close out the current phase and start timing the next one.
+static void epd_timing_phase(struct epd_data *data, enum epd_phase next) {
+    uint32_t now = k_cycle_get_32();
+
+    if (data->timing_active) {
+        data->timing.phases[data->phase].time_us += k_cyc_to_us_floor32(now - data->phase_start);
+    }
+    data->phase = next;
+    data->phase_start = now;
+}
+
+static inline void epd_timing_count_bytes(struct epd_data *data, size_t len) {
+    if (data->timing_active) {
+        data->timing.phases[data->phase].bytes += len;
+    }
+}
+
+static void epd_timing_finish(struct epd_data *data) {
+    if (!data->timing_active) {
+        return;
+    }
+    epd_timing_phase(data, EPD_PHASE_POWER_OFF);
+    data->timing.spi_time_us = (uint32_t) k_cyc_to_us_floor64(data->transfer_cycles);
+    data->timing_active = false;
+
+    data->timing_history[data->timing_next] = data->timing;
+    data->timing_next = (data->timing_next + 1) % CONFIG_GENERIC_EPAPER_TIMING_HISTORY;
+    if (data->timing_count < CONFIG_GENERIC_EPAPER_TIMING_HISTORY) {
+        data->timing_count++;
+    }
+}
+
+#ifdef CONFIG_SPI_ASYNC
+static void epd_async_write_done(const struct device *spi_dev, int result, void *user_data) {
+    struct epd_data *data = user_data;
+
+    data->transfer_cycles += k_cycle_get_32() - data->async_start;
+    if (result >= 0) {
+        data->bytes_written += data->async_buf.len;
+    }
+    data->async_result = result;
+    k_sem_give(&data->async_sem);
+}
+#endif
+
+int epd_wait_write_data(const struct device *dev) {
+    struct epd_data *ep_data = dev->data;
+
+    if (!ep_data->async_pending) {
+        return 0;
+    }
+
+    ep_data->async_pending = false;
+    if (k_sem_take(&ep_data->async_sem, K_SECONDS(1)) != 0) {
+        LOG_ERR("async data write never completed");
+        return -ETIMEDOUT;
+    }
+    return ep_data->async_result;
+}
+
 static int epd_write_helper(const struct device *dev, bool cmd_present, uint8_t cmd, const uint8_t* data_buf, size_t data_len) {
     const struct epd_config *config = dev->config;
+    struct epd_data *ep_data = dev->data;
+
+    // Never touch DC while an async data write is still clocking out.
+    int ret = epd_wait_write_data(dev);
+    if (ret < 0) {
+        return ret;
+    }
 
     struct spi_buf buffer;
 	struct spi_buf_set buf_set = {
@@ -382,95 +304,163 @@ static int epd_write_helper(const struct device *dev, bool cmd_present, uint8_t
 		.count = 1,
 	};
 
-    int ret = 0;
-
 	buffer.buf = &cmd;
 	buffer.len = sizeof(cmd);
 
+    epd_timing_count_bytes(ep_data, (cmd_present ? 1 : 0) + data_len);
+
 	if (cmd_present) {
-        LOG_ERR("Sending command: %02x", cmd);
 		/* Set CD pin low for command */
 		gpio_pin_set_dt(&config->dc, 0);
-		ret = spi_write_dt(&config->bus, &buf_set);
+		ret = spi_write(config->bus.bus, ep_data->spi_cfg, &buf_set);
 		if (ret < 0) {
 			goto out;
 		}
 	}
 
 	if (data_len > 0) {
-        //LOG_DBG("Sending data len %zu", data_len);
-        for (size_t i = 0; i < data_len; i++) {
-            buffer.buf = (void*)(data_buf + i);
-            buffer.len = 1;
+        // Panels that need CS toggled per byte get single-byte transactions,
+        // everyone else gets the data in chunks as large as the controller (and DMA) will take.
+        size_t max_chunk = (ep_data->meta != NULL && ep_data->meta->per_byte_cs) ? 1 : CONFIG_GENERIC_EPAPER_SPI_CHUNK_SIZE;
 
-            //LOG_ERR("Sending data len %zu", buffer.len);
+		// Set CD pin high for data. It stays high for the whole run.
+		gpio_pin_set_dt(&config->dc, 1);
+        while (data_len > 0) {
+            size_t chunk = MIN(data_len, max_chunk);
+            buffer.buf = (void *)data_buf;
+            buffer.len = chunk;
 
-            // Set CD pin high for data 
-            gpio_pin_set_dt(&config->dc, 1);
-            ret = spi_write_dt(&config->bus, &buf_set);
+            ret = spi_write(config->bus.bus, ep_data->spi_cfg, &buf_set);
             if (ret < 0) {
                 goto out;
             }
+            data_buf += chunk;
+            data_len -= chunk;
         }
-        /*
-		buffer.buf = (void *)data_buf;
-		buffer.len = data_len;
-
-        LOG_ERR("Sending data len %zu", buffer.len);
-
-		// Set CD pin high for data 
-		gpio_pin_set_dt(&config->dc, 1);
-		ret = spi_write_dt(&config->bus, &buf_set);
-		if (ret < 0) {
-			goto out;
-		}*/
 	}
 out:
 	return ret;
 }
 
+// SSD1680-style controllers: RAM X/Y ranges (0x44/0x45) and address counters (0x4E/0x4F), X addressed in bytes.
+static int ssd1680_set_window(const struct device *dev, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+    uint16_t x_end = x + w - 1;
+    uint16_t y_end = y + h - 1;
+
+    const uint8_t entry_mode[] = {0x03}; // X increment, Y increment
+    const uint8_t x_range[] = {x / 8, x_end / 8};
+    const uint8_t y_range[] = {y % 256, y / 256, y_end % 256, y_end / 256};
+    const uint8_t x_counter[] = {x / 8};
+    const uint8_t y_counter[] = {y % 256, y / 256};
+
+    int ret;
+    if ((ret = epd_write_helper(dev, true, 0x11, entry_mode, sizeof(entry_mode))) < 0) {
+        return ret;
+    }
+    if ((ret = epd_write_helper(dev, true, 0x44, x_range, sizeof(x_range))) < 0) {
+        return ret;
+    }
+    if ((ret = epd_write_helper(dev, true, 0x45, y_range, sizeof(y_range))) < 0) {
+        return ret;
+    }
+    if ((ret = epd_write_helper(dev, true, 0x4E, x_counter, sizeof(x_counter))) < 0) {
+        return ret;
+    }
+    return epd_write_helper(dev, true, 0x4F, y_counter, sizeof(y_counter));
+}
+
+static int ssd1680_clear_window(const struct device *dev) {
+    struct epd_data *data = dev->data;
+
+    return ssd1680_set_window(dev, 0, 0, epd_ram_width(data->meta), epd_ram_height(data->meta));
+}
+
+// UC8179-style controllers: enter partial mode (0x91) and set the partial window (0x90).
+// Horizontal start/end are in pixels but the low 3 bits are ignored by the controller.
+static int uc8179_set_window(const struct device *dev, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+    uint16_t x_end = x + w - 1;
+    uint16_t y_end = y + h - 1;
+
+    const uint8_t window[] = {
+        x / 256, x % 256,
+        x_end / 256, x_end % 256,
+        y / 256, y % 256,
+        y_end / 256, y_end % 256,
+        0x01, // only scan gates inside the window
+    };
+
+    int ret;
+    if ((ret = epd_write_helper(dev, true, 0x91, NULL, 0)) < 0) {
+        return ret;
+    }
+    return epd_write_helper(dev, true, 0x90, window, sizeof(window));
+}
+
+// Partial out.
+static int uc8179_clear_window(const struct device *dev) {
+    return epd_write_helper(dev, true, 0x92, NULL, 0);
+}
+
+static void epd_busy_handler(const struct device *port, struct gpio_callback *cb, gpio_port_pins_t pins) {
+    struct epd_data *data = CONTAINER_OF(cb, struct epd_data, busy_cb);
+
+    k_sem_give(&data->busy_sem);
+}
+
+// Sleep until the BUSY line de-asserts (or the panel's timeout expires).
+// The edge interrupt is only armed while we're waiting, so the line bouncing around
+// during data writes doesn't keep waking us up.
+static int epd_wait_for_busy(const struct device *dev) {
+    const struct epd_config *config = dev->config;
+    struct epd_data *data = dev->data;
+    uint32_t timeout_ms = data->meta->busy_timeout_ms != 0 ? data->meta->busy_timeout_ms : config->busy_timeout_ms;
+
+    k_sem_reset(&data->busy_sem);
+    int ret = gpio_pin_interrupt_configure_dt(&config->busy, GPIO_INT_EDGE_TO_INACTIVE);
+    if (ret < 0) {
+        LOG_ERR("failed to enable busy interrupt: %d", ret);
+        return ret;
+    }
+
+    // Check the level only after arming the interrupt, so an edge between the two can't be missed.
+    ret = gpio_pin_get_dt(&config->busy);
+    if (ret < 0) {
+        LOG_ERR("failed to get busy pin");
+    } else if (ret == 1) {
+        if (k_sem_take(&data->busy_sem, K_MSEC(timeout_ms)) == 0) {
+            ret = 0;
+        } else {
+            LOG_ERR("BUSY never de-asserted after %u ms.", timeout_ms);
+            ret = -ETIMEDOUT;
+        }
+    }
+
+    gpio_pin_interrupt_configure_dt(&config->busy, GPIO_INT_DISABLE);
+    return ret;
+}
+
+// Runs a sequence compiled from panels.yaml. The sequences are validated at build time,
+// so nothing is logged here except failures - this runs on every power on and refresh.
 static int epd_do_command_list(const struct device *dev, const uint8_t* cmd_list) {
     const struct epd_config *config = dev->config;
 
-    // Command list format:
-    // 1 byte = length or special case
-    // 2nd byte - command ID
-    // 3rd+ byte (optional) data for the command
     int ret = 0;
     while(true) {
-        LOG_INF("cmd is: %u", cmd_list[0]);
-        if (cmd_list[0] == DONE) {
-            LOG_INF("Command list completed");
+        switch (cmd_list[0]) {
+        case EPD_SEQ_DONE:
+            return 0;
+        case EPD_SEQ_DELAY:
+            k_msleep(cmd_list[1] | (cmd_list[2] << 8));
+            cmd_list += 3;
             break;
-        } else if (cmd_list[0] == WAIT_100ms) {
-            LOG_INF("waiting 100ms");
-            k_msleep(100);
-            cmd_list++;
-        }else if (cmd_list[0] == WAIT_FOR_BUSY) {
-            uint32_t busy_count = 0;
-            LOG_INF("Busy waiting.");
-            while(true) {
-                ret = gpio_pin_get_dt(&config->busy);
-                if (ret < 0) {
-                    LOG_ERR("failed to get busy pin");
-                    return ret;
-                }
-                if (ret == 1) {
-                    // busy is asserted, wait a little longer...
-                    if (busy_count < 2000) { // TODO: make this configurable in config.
-                        k_msleep(10);
-                    } else {
-                        LOG_ERR("BUSY never de-asserted.");
-                        return -1;
-                    }
-                } else {
-                    LOG_INF("display not busy");
-                    break;
-                }
+        case EPD_SEQ_WAIT_BUSY:
+            ret = epd_wait_for_busy(dev);
+            if (ret < 0) {
+                return ret;
             }
             cmd_list++;
-        } else if (cmd_list[0] == DO_RESET) {
-            LOG_INF("Resetting");
+            break;
+        case EPD_SEQ_RESET:
             if((ret = gpio_pin_set_dt(&config->rst, 1)) < 0) {
                 LOG_ERR("failed to set rst pin");
                 return ret;
@@ -481,46 +471,71 @@ static int epd_do_command_list(const struct device *dev, const uint8_t* cmd_list
                 return ret;
             }
             k_msleep(10);
-
             cmd_list++;
-        } else {
-            LOG_INF("Sending command string of total length %u, cmd %02x", cmd_list[0], cmd_list[1]);
-            //LOG_HEXDUMP_INF(&cmd_list[1], cmd_list[0]);
+            break;
+        default:
             ret = epd_write_helper(dev, true, cmd_list[1], &cmd_list[2], cmd_list[0]-1);
             if (ret < 0) {
-                LOG_ERR("failed to write command: %d", ret);
+                LOG_ERR("failed to write command %02x: %d", cmd_list[1], ret);
                 return ret;
             }
-            cmd_list+=cmd_list[0]+1;
+            cmd_list += cmd_list[0]+1;
+            break;
         }
     }
-    return 0;
 }
 
 
 
+// Run the bus as fast as the selected panel allows.
+static void epd_apply_spi_clock(const struct device *dev) {
+    const struct epd_config *config = dev->config;
+    struct epd_data *data = dev->data;
+    uint32_t frequency = data->meta->max_write_hz != 0 ? data->meta->max_write_hz : config->bus.config.frequency;
+
+    if (frequency == data->spi_cfg->frequency) {
+        return;
+    }
+
+    // Never change a configuration that may be in use by an outstanding async write.
+    struct spi_config *next = (data->spi_cfg == &data->spi_cfgs[0]) ? &data->spi_cfgs[1] : &data->spi_cfgs[0];
+    *next = config->bus.config;
+    next->frequency = frequency;
+    data->spi_cfg = next;
+    LOG_INF("SPI clock set to %u Hz", frequency);
+}
+
 int epd_set_type(const struct device *dev, epd_type_t typ) {
     struct epd_data *data = dev->data;
+
+    if (epd_wait_write_data(dev) < 0) {
+        LOG_ERR("Outstanding write failed while changing type");
+    }
+
     switch (typ) {
         case EPD_TYPE_GDEY029T71H:
             data->meta = &GDEY029T71H_meta;
-            return 0;
+            break;
         case EPD_TYPE_GDEM035F51:
             data->meta = &GDEM035F51_meta;
-            return 0;
+            break;
         case EPD_TYPE_GDEY029F51:
             data->meta = &GDEY029F51_meta;
-            return 0;
+            break;
         case EPD_TYPE_GDEM075F52:
             data->meta = &GDEM075F52_meta;
-            return 0;
+            break;
         case EPD_TYPE_WS_75_V2B:
             data->meta = &WS_75_V2B_meta;
-            return 0;
+            break;
         default:
             LOG_ERR("Unknown type specified");
             return -1;
     }
+    data->type = typ;
+    data->window_set = false; // Whatever the last panel was left with, this one starts from its init sequence.
+    epd_apply_spi_clock(dev);
+    return 0;
 }
 
 int epd_get_dimensions(const struct device *dev, struct epd_dimensions *dims) {
@@ -534,8 +549,10 @@ int epd_get_dimensions(const struct device *dev, struct epd_dimensions *dims) {
     dims->width = data->meta->width;
     dims->height = data->meta->height;
     dims->expected_data_size = data->meta->expected_data_size;
-    dims->expected_data_size = data->meta->expected_data_size;
     dims->planes = data->meta->num_planes;
+    dims->plane_data_size = data->meta->expected_data_size / data->meta->num_planes;
+    dims->bits_per_pixel = data->meta->bits_per_pixel;
+    dims->capabilities = data->meta->capabilities;
 
     return 0;
 }
@@ -548,6 +565,12 @@ int epd_power_on(const struct device *dev) {
         return -1;
     }
     LOG_INF("powering on...");
+
+    memset(&data->timing, 0, sizeof(data->timing));
+    data->timing.epd_type = data->type;
+    data->timing_active = true;
+    epd_timing_phase(data, EPD_PHASE_POWER_ON);
+
     int ret = -1;
     if (epd_has_pin(&config->en)) {
         if((ret = gpio_pin_set_dt(&config->en, 1)) < 0) {
@@ -568,7 +591,12 @@ int epd_power_on(const struct device *dev) {
     }
     k_msleep(20);*/
 
-    return epd_do_command_list(dev, data->meta->init_command_list);
+    data->bytes_written = 0;
+    data->transfer_cycles = 0;
+
+    ret = epd_do_command_list(dev, data->meta->init_command_list);
+    epd_timing_phase(data, EPD_PHASE_TRANSFER);
+    return ret;
 }
 int epd_start_write_data(const struct device *dev, int plane) {
     struct epd_data *data = dev->data;
@@ -582,8 +610,52 @@ int epd_start_write_data(const struct device *dev, int plane) {
         return -1;
     }
 
+    if (data->window_set) {
+        int ret = data->meta->clear_window(dev);
+        if (ret < 0) {
+            LOG_ERR("failed to clear window: %d", ret);
+            return ret;
+        }
+        data->window_set = false;
+    }
+
+    return epd_write_helper(dev, true, data->meta->data_transmission_command[plane], NULL, 0);
+}
+int epd_start_write_window(const struct device *dev, int plane, uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+    struct epd_data *data = dev->data;
+    if (data->meta == NULL) {
+        LOG_ERR("Tried to write window with no type set");
+        return -1;
+    }
+    if (plane >= data->meta->num_planes) {
+        LOG_ERR("Tried to write data beyond last plane");
+        return -1;
+    }
+    if (!(data->meta->capabilities & EPD_CAP_PARTIAL_WINDOW) || data->meta->set_window == NULL ||
+        data->meta->clear_window == NULL) {
+        LOG_ERR("Display does not support window writes");
+        return -ENOTSUP;
+    }
+
+    // Windows have to start and end on a byte boundary, since that's how the controllers address RAM.
+    uint8_t pixels_per_byte = 8 / data->meta->bits_per_pixel;
+    if (w == 0 || h == 0 || (x % pixels_per_byte) != 0 || (w % pixels_per_byte) != 0 ||
+        (x + w) > epd_ram_width(data->meta) || (y + h) > epd_ram_height(data->meta)) {
+        LOG_ERR("Invalid window %u,%u %ux%u", x, y, w, h);
+        return -EINVAL;
+    }
+
+    // Set before trying, since a failure can leave the controller part way there.
+    data->window_set = true;
+    int ret = data->meta->set_window(dev, x, y, w, h);
+    if (ret < 0) {
+        LOG_ERR("failed to set window: %d", ret);
+        return ret;
+    }
+
     return epd_write_helper(dev, true, data->meta->data_transmission_command[plane], NULL, 0);
 }
+
 int epd_continue_write_data(const struct device *dev, uint8_t *data, size_t data_len) {
     struct epd_data *ep_data = dev->data;
     const struct epd_config *config = dev->config;
@@ -592,7 +664,61 @@ int epd_continue_write_data(const struct device *dev, uint8_t *data, size_t data
         return -1;
     }
 
-    return epd_write_helper(dev, false, 0x00, data, data_len);
+    uint32_t start = k_cycle_get_32();
+    int ret = epd_write_helper(dev, false, 0x00, data, data_len);
+    ep_data->transfer_cycles += k_cycle_get_32() - start;
+    if (ret >= 0) {
+        ep_data->bytes_written += data_len;
+    }
+
+    return ret;
+}
+
+int epd_continue_write_data_async(const struct device *dev, const uint8_t *data, size_t data_len) {
+    struct epd_data *ep_data = dev->data;
+    if (ep_data->meta == NULL) {
+        LOG_ERR("Tried to write continued data with no type set");
+        return -1;
+    }
+
+#ifdef CONFIG_SPI_ASYNC
+    const struct epd_config *config = dev->config;
+
+    // Per-byte CS panels and oversized buffers can't go out as one transaction - fall back to the blocking path.
+    if (!ep_data->meta->per_byte_cs && data_len <= CONFIG_GENERIC_EPAPER_SPI_CHUNK_SIZE) {
+        int ret = epd_wait_write_data(dev);
+        if (ret < 0) {
+            return ret;
+        }
+
+        gpio_pin_set_dt(&config->dc, 1);
+        ep_data->async_buf.buf = (void *)data;
+        ep_data->async_buf.len = data_len;
+        ep_data->async_buf_set.buffers = &ep_data->async_buf;
+        ep_data->async_buf_set.count = 1;
+        ep_data->async_start = k_cycle_get_32();
+        ep_data->async_pending = true;
+        epd_timing_count_bytes(ep_data, data_len);
+
+        ret = spi_transceive_cb(config->bus.bus, ep_data->spi_cfg, &ep_data->async_buf_set, NULL, epd_async_write_done, ep_data);
+        if (ret < 0) {
+            LOG_ERR("failed to start async write: %d", ret);
+            ep_data->async_pending = false;
+        }
+        return ret;
+    }
+#endif
+
+    return epd_continue_write_data(dev, (uint8_t *)data, data_len);
+}
+
+int epd_get_transfer_stats(const struct device *dev, struct epd_transfer_stats *stats) {
+    struct epd_data *data = dev->data;
+
+    stats->bytes_written = data->bytes_written;
+    stats->transfer_time_us = (uint32_t) k_cyc_to_us_floor64(data->transfer_cycles);
+
+    return 0;
 }
 int epd_do_refresh(const struct device *dev) {
     struct epd_data *data = dev->data;
@@ -600,8 +726,26 @@ int epd_do_refresh(const struct device *dev) {
         LOG_ERR("Tried to refresh with no type set");
         return -1;
     }
+    LOG_INF("Wrote %u bytes in %u us", data->bytes_written, (uint32_t) k_cyc_to_us_floor64(data->transfer_cycles));
+    epd_timing_phase(data, EPD_PHASE_REFRESH);
+    data->timing.partial = false;
     return epd_do_command_list(dev, data->meta->refresh_command_list);
 }
+int epd_do_partial_refresh(const struct device *dev) {
+    struct epd_data *data = dev->data;
+    if (data->meta == NULL) {
+        LOG_ERR("Tried to refresh with no type set");
+        return -1;
+    }
+    if (!(data->meta->capabilities & EPD_CAP_PARTIAL_REFRESH) || data->meta->partial_refresh_command_list == NULL) {
+        LOG_ERR("Display does not support partial refresh");
+        return -ENOTSUP;
+    }
+    LOG_INF("Wrote %u bytes in %u us", data->bytes_written, (uint32_t) k_cyc_to_us_floor64(data->transfer_cycles));
+    epd_timing_phase(data, EPD_PHASE_REFRESH);
+    data->timing.partial = true;
+    return epd_do_command_list(dev, data->meta->partial_refresh_command_list);
+}
 int epd_power_off(const struct device *dev) {
     const struct epd_config *config = dev->config;
     struct epd_data *data = dev->data;
@@ -609,7 +753,9 @@ int epd_power_off(const struct device *dev) {
         LOG_ERR("Tried to power off with no type set");
         return -1;
     }
+    epd_timing_phase(data, EPD_PHASE_POWER_OFF);
     int ret = epd_do_command_list(dev, data->meta->powerdown_command_list);
+    epd_timing_finish(data);
 
     if (epd_has_pin(&config->en)) {
         gpio_pin_set_dt(&config->en, 0);
@@ -623,6 +769,17 @@ int epd_power_off(const struct device *dev) {
     return ret;
 }
 
+int epd_get_update_timing(const struct device *dev, size_t index, struct epd_update_timing *timing) {
+    struct epd_data *data = dev->data;
+
+    if (index >= data->timing_count) {
+        return -ENOENT;
+    }
+    size_t slot = (data->timing_next + CONFIG_GENERIC_EPAPER_TIMING_HISTORY - 1 - index) % CONFIG_GENERIC_EPAPER_TIMING_HISTORY;
+    *timing = data->timing_history[slot];
+    return 0;
+}
+
 static int epd_early_init(const struct device *dev)
 {
 	const struct epd_config *config = dev->config;
@@ -630,6 +787,13 @@ static int epd_early_init(const struct device *dev)
 	int ret;
 
     data->meta = NULL;
+    data->spi_cfgs[0] = config->bus.config;
+    data->spi_cfg = &data->spi_cfgs[0];
+    data->bytes_written = 0;
+    data->transfer_cycles = 0;
+    data->timing_active = false;
+    data->timing_next = 0;
+    data->timing_count = 0;
 
 	if (!device_is_ready(config->bus.bus)) {
 		LOG_ERR("SPI device is not ready");
@@ -674,6 +838,15 @@ static int epd_early_init(const struct device *dev)
         LOG_ERR("Could not configure busy GPIO (%d)", ret);
         return ret;
     }
+    k_sem_init(&data->busy_sem, 0, 1);
+    k_sem_init(&data->async_sem, 0, 1);
+    data->async_pending = false;
+    gpio_init_callback(&data->busy_cb, epd_busy_handler, BIT(config->busy.pin));
+    ret = gpio_add_callback(config->busy.port, &data->busy_cb);
+    if (ret < 0) {
+        LOG_ERR("Could not add busy GPIO callback (%d)", ret);
+        return ret;
+    }
 
     if (epd_has_pin(&config->en)) {
         if (!gpio_is_ready_dt(&config->en)) {
@@ -700,6 +873,7 @@ static int epd_early_init(const struct device *dev)
 	    .rst = GPIO_DT_SPEC_INST_GET(inst, reset_gpios),           \
 	    .busy = GPIO_DT_SPEC_INST_GET(inst, busy_gpios),           \
 	    .en = GPIO_DT_SPEC_INST_GET_OR(inst, en_gpios, {}),           \
+	    .busy_timeout_ms = DT_INST_PROP(inst, busy_timeout_ms),           \
 	};                                                                     \
                                                                                \
 	DEVICE_DT_INST_DEFINE(inst, epd_early_init, NULL, &data##inst,    \
@@ -0,0 +1,238 @@
+#define DT_DRV_COMPAT ar_generic_epaper
+
+#include <string.h>
+
+#include <zephyr/kernel.h>
+
+#include <zephyr/device.h>
+#include <zephyr/devicetree.h>
+#include <zephyr/drivers/emul.h>
+#include <zephyr/drivers/gpio.h>
+#include <zephyr/drivers/gpio/gpio_emul.h>
+#include <zephyr/drivers/spi.h>
+#include <zephyr/drivers/spi_emul.h>
+#include <zephyr/logging/log.h>
+
+#include <drivers/generic_epaper_emul.h>
+
+LOG_MODULE_REGISTER(generic_epaper_emul, CONFIG_GENERIC_EPAPER_LOG_LEVEL);
+
+struct epd_emul_config {
+    struct gpio_dt_spec dc;
+    struct gpio_dt_spec rst;
+    struct gpio_dt_spec busy;
+};
+
+struct epd_emul_data {
+    const struct emul *target;
+    struct epd_emul_profile profile;
+
+    // Last command byte seen, and which plane (if any) its data goes to.
+    uint8_t cmd;
+    int ram_plane;
+
+    uint8_t ram[EPD_EMUL_MAX_PLANES][CONFIG_GENERIC_EPAPER_EMUL_PLANE_SIZE];
+    size_t ram_len[EPD_EMUL_MAX_PLANES];
+
+    // Each command's last parameters, and its position in the command stream then.
+    uint8_t params[256][EPD_EMUL_MAX_PARAMS];
+    uint8_t params_len[256];
+    uint32_t params_seq[256];
+
+    struct epd_emul_stats stats;
+    struct k_work_delayable busy_work;
+};
+
+// The emulator drives/reads physical levels, the driver thinks in logical ones.
+static int epd_emul_pin_get(const struct gpio_dt_spec *spec) {
+    int ret = gpio_emul_output_get(spec->port, spec->pin);
+    if (ret < 0) {
+        return ret;
+    }
+    return (spec->dt_flags & GPIO_ACTIVE_LOW) ? !ret : ret;
+}
+
+static int epd_emul_pin_set(const struct gpio_dt_spec *spec, int value) {
+    return gpio_emul_input_set(spec->port, spec->pin, (spec->dt_flags & GPIO_ACTIVE_LOW) ? !value : value);
+}
+
+static void epd_emul_busy_release(struct k_work *work) {
+    struct k_work_delayable *dwork = k_work_delayable_from_work(work);
+    struct epd_emul_data *data = CONTAINER_OF(dwork, struct epd_emul_data, busy_work);
+    const struct epd_emul_config *config = data->target->cfg;
+
+    epd_emul_pin_set(&config->busy, 0);
+}
+
+static void epd_emul_handle_cmd(const struct emul *target, uint8_t cmd) {
+    struct epd_emul_data *data = target->data;
+    const struct epd_emul_config *config = target->cfg;
+
+    data->cmd = cmd;
+    data->ram_plane = -1;
+    data->stats.commands++;
+    data->params_len[cmd] = 0;
+    data->params_seq[cmd] = data->stats.commands;
+
+    for (int i = 0; i < data->profile.num_planes; i++) {
+        if (data->profile.ram_cmds[i] == cmd) {
+            data->ram_plane = i;
+            data->ram_len[i] = 0;
+            break;
+        }
+    }
+
+    for (size_t i = 0; i < data->profile.num_busy_cmds; i++) {
+        if (data->profile.busy_cmds[i].cmd == cmd) {
+            data->stats.busy_periods++;
+            epd_emul_pin_set(&config->busy, 1);
+            k_work_reschedule(&data->busy_work, K_MSEC(data->profile.busy_cmds[i].busy_ms));
+            break;
+        }
+    }
+}
+
+static void epd_emul_handle_data(const struct emul *target, const uint8_t *buf, size_t len) {
+    struct epd_emul_data *data = target->data;
+
+    data->stats.data_bytes += len;
+    if (data->ram_plane < 0) {
+        // Command parameters.
+        size_t keep = MIN(len, EPD_EMUL_MAX_PARAMS - data->params_len[data->cmd]);
+
+        memcpy(&data->params[data->cmd][data->params_len[data->cmd]], buf, keep);
+        data->params_len[data->cmd] += keep;
+        return;
+    }
+
+    size_t *ram_len = &data->ram_len[data->ram_plane];
+    size_t space = CONFIG_GENERIC_EPAPER_EMUL_PLANE_SIZE - *ram_len;
+    size_t copy = MIN(len, space);
+
+    memcpy(&data->ram[data->ram_plane][*ram_len], buf, copy);
+    *ram_len += copy;
+    data->stats.ram_overflow_bytes += len - copy;
+}
+
+static int epd_emul_io(const struct emul *target, const struct spi_config *spi_cfg,
+                       const struct spi_buf_set *tx_bufs, const struct spi_buf_set *rx_bufs) {
+    struct epd_emul_data *data = target->data;
+    const struct epd_emul_config *config = target->cfg;
+    size_t total = 0;
+
+    ARG_UNUSED(rx_bufs);
+
+    if (tx_bufs == NULL) {
+        return 0;
+    }
+
+    // A controller held in reset ignores the bus entirely.
+    if (epd_emul_pin_get(&config->rst) == 1) {
+        LOG_ERR("SPI transfer while the panel is held in reset");
+        return -EIO;
+    }
+
+    int dc = epd_emul_pin_get(&config->dc);
+    if (dc < 0) {
+        return dc;
+    }
+
+    data->stats.transactions++;
+    for (size_t i = 0; i < tx_bufs->count; i++) {
+        const uint8_t *buf = tx_bufs->buffers[i].buf;
+        size_t len = tx_bufs->buffers[i].len;
+
+        total += len;
+        if (buf == NULL || len == 0) {
+            continue;
+        }
+        if (dc == 0) {
+            // Anything after the command byte in the same transaction is still clocked in as a parameter.
+            epd_emul_handle_cmd(target, buf[0]);
+            buf++;
+            len--;
+            dc = 1;
+        }
+        epd_emul_handle_data(target, buf, len);
+    }
+
+    // Charge simulated time for the transfer, so throughput numbers mean something on native_sim.
+    uint32_t wait_us = CONFIG_GENERIC_EPAPER_EMUL_XFER_OVERHEAD_US;
+    if (spi_cfg->frequency != 0) {
+        wait_us += (uint32_t)(((uint64_t)total * 8U * USEC_PER_SEC) / spi_cfg->frequency);
+    }
+    k_busy_wait(wait_us);
+
+    return 0;
+}
+
+void epd_emul_set_profile(const struct emul *target, const struct epd_emul_profile *profile) {
+    struct epd_emul_data *data = target->data;
+    const struct epd_emul_config *config = target->cfg;
+
+    k_work_cancel_delayable(&data->busy_work);
+    epd_emul_pin_set(&config->busy, 0);
+
+    data->profile = *profile;
+    data->profile.num_planes = MIN(profile->num_planes, EPD_EMUL_MAX_PLANES);
+    data->ram_plane = -1;
+    memset(data->ram_len, 0, sizeof(data->ram_len));
+    memset(&data->stats, 0, sizeof(data->stats));
+    memset(data->params_len, 0, sizeof(data->params_len));
+    memset(data->params_seq, 0, sizeof(data->params_seq));
+}
+
+int epd_emul_get_plane(const struct emul *target, int plane, const uint8_t **buf, size_t *len) {
+    struct epd_emul_data *data = target->data;
+
+    if (plane < 0 || plane >= data->profile.num_planes) {
+        return -EINVAL;
+    }
+    *buf = data->ram[plane];
+    *len = data->ram_len[plane];
+    return 0;
+}
+
+uint32_t epd_emul_get_params(const struct emul *target, uint8_t cmd, const uint8_t **params, size_t *len) {
+    struct epd_emul_data *data = target->data;
+
+    *params = data->params[cmd];
+    *len = data->params_len[cmd];
+    return data->params_seq[cmd];
+}
+
+void epd_emul_get_stats(const struct emul *target, struct epd_emul_stats *stats) {
+    struct epd_emul_data *data = target->data;
+
+    *stats = data->stats;
+}
+
+static int epd_emul_init(const struct emul *target, const struct device *parent) {
+    struct epd_emul_data *data = target->data;
+
+    ARG_UNUSED(parent);
+
+    data->target = target;
+    data->ram_plane = -1;
+    k_work_init_delayable(&data->busy_work, epd_emul_busy_release);
+
+    return 0;
+}
+
+static struct spi_emul_api epd_emul_api = {
+    .io = epd_emul_io,
+};
+
+#define GENERIC_EPAPER_EMUL_DEFINE(inst)                                       \
+	static struct epd_emul_data epd_emul_data##inst;                       \
+                                                                               \
+	static const struct epd_emul_config epd_emul_config##inst = {          \
+	    .dc = GPIO_DT_SPEC_INST_GET(inst, dc_gpios),                       \
+	    .rst = GPIO_DT_SPEC_INST_GET(inst, reset_gpios),                   \
+	    .busy = GPIO_DT_SPEC_INST_GET(inst, busy_gpios),                   \
+	};                                                                     \
+                                                                               \
+	EMUL_DT_INST_DEFINE(inst, epd_emul_init, &epd_emul_data##inst,         \
+			    &epd_emul_config##inst, &epd_emul_api, NULL);
+
+DT_INST_FOREACH_STATUS_OKAY(GENERIC_EPAPER_EMUL_DEFINE)
@@ -0,0 +1 @@
+ALTER TABLE device_states DROP COLUMN "last_refresh_ms"
\ No newline at end of file
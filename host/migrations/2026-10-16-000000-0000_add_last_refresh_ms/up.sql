@@ -0,0 +1,2 @@
+-- track how long the panel took to refresh last time, to spot panels slowing down with age or temperature.
+ALTER TABLE device_states ADD COLUMN "last_refresh_ms" INTEGER NOT NULL DEFAULT 0;
\ No newline at end of file
@@ -0,0 +1,6 @@
+ALTER TABLE device_states DROP COLUMN "attach_ms";
+ALTER TABLE device_states DROP COLUMN "parent_rloc16";
+ALTER TABLE device_states DROP COLUMN "parent_rssi";
+ALTER TABLE device_states DROP COLUMN "net_ms";
+ALTER TABLE device_states DROP COLUMN "net_retransmits";
+ALTER TABLE device_states DROP COLUMN "net_bytes_per_sec";
\ No newline at end of file
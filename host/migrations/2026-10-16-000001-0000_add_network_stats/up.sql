@@ -0,0 +1,7 @@
+-- the network cost of each device's last wake, to rank devices and their Thread parents by it.
+ALTER TABLE device_states ADD COLUMN "attach_ms" INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE device_states ADD COLUMN "parent_rloc16" INTEGER;
+ALTER TABLE device_states ADD COLUMN "parent_rssi" INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE device_states ADD COLUMN "net_ms" INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE device_states ADD COLUMN "net_retransmits" INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE device_states ADD COLUMN "net_bytes_per_sec" INTEGER NOT NULL DEFAULT 0;
\ No newline at end of file
@@ -0,0 +1,9 @@
+ALTER TABLE device_states DROP COLUMN "min_checkin_interval";
+ALTER TABLE device_states DROP COLUMN "max_checkin_interval";
+ALTER TABLE device_states DROP COLUMN "image_hash";
+ALTER TABLE device_states DROP COLUMN "image_changed_at";
+ALTER TABLE device_states DROP COLUMN "image_change_interval";
+ALTER TABLE device_states DROP COLUMN "vbat_ref_mv";
+ALTER TABLE device_states DROP COLUMN "vbat_ref_at";
+ALTER TABLE device_states DROP COLUMN "vbat_trend_mv_per_day";
+ALTER TABLE device_states DROP COLUMN "next_checkin_interval";
\ No newline at end of file
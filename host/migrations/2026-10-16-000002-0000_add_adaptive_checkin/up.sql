@@ -0,0 +1,10 @@
+-- adaptive check-in: admin bounds, and what the host has learned about how often each device's image changes and how fast its battery drains.
+ALTER TABLE device_states ADD COLUMN "min_checkin_interval" INTEGER;
+ALTER TABLE device_states ADD COLUMN "max_checkin_interval" INTEGER;
+ALTER TABLE device_states ADD COLUMN "image_hash" BIGINT;
+ALTER TABLE device_states ADD COLUMN "image_changed_at" TIMESTAMPTZ;
+ALTER TABLE device_states ADD COLUMN "image_change_interval" INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE device_states ADD COLUMN "vbat_ref_mv" INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE device_states ADD COLUMN "vbat_ref_at" TIMESTAMPTZ;
+ALTER TABLE device_states ADD COLUMN "vbat_trend_mv_per_day" INTEGER NOT NULL DEFAULT 0;
+ALTER TABLE device_states ADD COLUMN "next_checkin_interval" INTEGER NOT NULL DEFAULT 0;
\ No newline at end of file
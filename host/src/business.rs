@@ -7,6 +7,7 @@ use serde::{Deserialize, Serialize};
 use thiserror::Error;
 use chrono::{Utc, Duration};
 
+use crate::checkin;
 use crate::database::{Database, DatabaseError};
 use crate::types::FirmwareState;
 
@@ -15,7 +16,86 @@ pub struct DeviceHeartbeatRequest {
     pub device_id: u64, // The device will insert it's identifier here. This matches the device_id in DeviceState. Authentication is not required (or supported).
     pub current_firmware: u32, // The device will report it's current firmware. This is equivalent to the "reported firmware" elsewhere in the code.
     pub vbat_mv: i32, // measured battery voltage
-    pub protocol_version: u8 // The version of the protocol this device supports. This may be used to determine how to shape the response so the device can understand it. For now, this should always be 1.
+    pub protocol_version: u8, // The version of the protocol this device supports. This may be used to determine how to shape the response so the device can understand it. 1, or 2 for devices that take compressed firmware (see image_codec.rs).
+    #[serde(default)]
+    pub display_timing: Option<DisplayTiming>, // Timing of the device's previous display update, if it has one to report.
+    #[serde(default, rename = "net")]
+    pub net_stats: Option<NetStats>, // How the network behaved on the device's previous wake, if it has one to report.
+}
+
+// Per-phase timing of a display update, measured by the e-paper driver. Times are in microseconds.
+#[derive(Debug, PartialEq, Eq, Deserialize, Default)]
+pub struct DisplayTiming {
+    pub epd_type: u8,
+    pub partial: bool,
+    pub power_on_us: u32,
+    pub transfer_us: u32, // From the end of power on to the start of the refresh - includes downloading the image.
+    pub refresh_us: u32, // Almost entirely the panel holding BUSY. This is the one that drifts with age and temperature.
+    pub power_off_us: u32,
+    pub spi_us: u32, // Time spent clocking out frame data.
+    pub init_bytes: u32,
+    pub transfer_bytes: u32,
+}
+
+// Network cost of a device's wake, measured by the firmware (struct net_stats in its cbor.h). It's sent as nested
+// arrays rather than maps to keep the heartbeat small, so the order of the fields matters.
+#[derive(Debug, PartialEq, Eq, Deserialize, Default)]
+#[serde(from = "NetStatsFields")]
+pub struct NetStats {
+    pub attach_ms: u32, // From starting Thread to attaching to a parent. 0 if it never attached.
+    pub parent_rloc16: u16,
+    pub parent_rssi: i8, // Average, in dBm.
+    pub parent_lq_in: u8, // Link quality (0-3) from and to the parent.
+    pub parent_lq_out: u8,
+    pub srtt_ms: u32, // CoAP round trip estimate at the end of the wake. 0 if there wasn't one.
+    pub transfers: Vec<NetTransfer>,
+}
+
+type NetStatsFields = (u32, u16, i8, u8, u8, u32, Vec<NetTransfer>);
+
+impl From<NetStatsFields> for NetStats {
+    fn from((attach_ms, parent_rloc16, parent_rssi, parent_lq_in, parent_lq_out, srtt_ms, transfers): NetStatsFields) -> Self {
+        NetStats { attach_ms, parent_rloc16, parent_rssi, parent_lq_in, parent_lq_out, srtt_ms, transfers }
+    }
+}
+
+// One CoAP request of the wake: the heartbeat, a firmware or an image download.
+#[derive(Debug, PartialEq, Eq, Deserialize, Default, Clone)]
+#[serde(from = "NetTransferFields")]
+pub struct NetTransfer {
+    pub kind: u8, // 0 heartbeat, 1 firmware, 2 image.
+    pub result: i8, // The firmware's coap_request_result_t, 0 for success.
+    pub bytes: u32, // Payload received.
+    pub elapsed_ms: u32,
+    pub replies: u16, // One per block, for a blockwise download.
+    pub retransmits: u16, // Estimated from replies slower than the retransmission timeout.
+}
+
+type NetTransferFields = (u8, i8, u32, u32, u16, u16);
+
+impl From<NetTransferFields> for NetTransfer {
+    fn from((kind, result, bytes, elapsed_ms, replies, retransmits): NetTransferFields) -> Self {
+        NetTransfer { kind, result, bytes, elapsed_ms, replies, retransmits }
+    }
+}
+
+impl NetStats {
+    // Time the wake spent waiting on CoAP requests.
+    pub fn elapsed_ms(&self) -> u32 {
+        self.transfers.iter().map(|t| t.elapsed_ms).sum()
+    }
+
+    pub fn retransmits(&self) -> u32 {
+        self.transfers.iter().map(|t| t.retransmits as u32).sum()
+    }
+
+    // Throughput over the requests that brought back any data, or 0 if none did.
+    pub fn bytes_per_sec(&self) -> u32 {
+        let (bytes, ms) = self.transfers.iter()
+            .filter(|t| t.bytes > 0)
+            .fold((0u64, 0u64), |(b, m), t| (b + t.bytes as u64, m + t.elapsed_ms as u64));
+        if ms == 0 { 0 } else { (bytes * 1000 / ms).min(i32::MAX as u64) as u32 }
+    }
 }
 
 #[derive(Debug, PartialEq, Eq, Deserialize)]
@@ -23,6 +103,14 @@ pub struct DeviceImageRequest {
     pub device_id: u64,
     pub data_size: u32, 
     pub epd_typ: u8,
+    #[serde(default)]
+    pub codecs: Option<u32>, // Image codecs the device can decode, as a bitmask of 1 << codec id. See image_codec.rs.
+    #[serde(default)]
+    pub hs_window: Option<u8>, // Largest heatshrink window and lookahead (in bits) the device can decode.
+    #[serde(default)]
+    pub hs_lookahead: Option<u8>,
+    #[serde(default)]
+    pub frame_crc: bool, // The device wants frame_crc32 of the decoded frame appended to the image, little-endian.
 }
 
 #[derive(Debug, PartialEq, Eq, Serialize)]
@@ -31,6 +119,69 @@ pub struct DeviceHeartbeatResponse {
     pub checkin_interval: u32 // Number of seconds until the device should wake up again to heartbeat.
 }
 
+// ETag for an image served to a device: 64-bit FNV-1a over the compressed image, big-endian.
+// The device computes the same hash over the payload as it streams in, since it can't read response options,
+// so this has to stay in sync with image_etag_update in the firmware's main.c.
+pub fn content_etag(data: &[u8]) -> [u8; 8] {
+    let mut hash: u64 = 0xcbf29ce484222325;
+    for b in data {
+        hash ^= *b as u64;
+        hash = hash.wrapping_mul(0x100000001b3);
+    }
+    hash.to_be_bytes()
+}
+
+// CRC-32 (IEEE) of a decoded frame, which devices check before refreshing. Matches Zephyr's crc32_ieee.
+pub fn frame_crc32(data: &[u8]) -> u32 {
+    let mut crc = !0u32;
+    for b in data {
+        crc ^= *b as u32;
+        for _ in 0..8 {
+            crc = (crc >> 1) ^ (0xEDB88320 & (crc & 1).wrapping_neg());
+        }
+    }
+    !crc
+}
+
+// Block size asked for by a Block2 option: NUM, M and SZX packed into one big-endian uint (RFC 7959).
+// Devices ask on the first request of a download, and the coap crate's block handler sends the rest at that size.
+pub fn block2_size(option: &[u8]) -> Option<usize> {
+    if option.len() > 3 {
+        return None;
+    }
+    let value = option.iter().fold(0u32, |v, b| (v << 8) | *b as u32);
+    match value & 0x7 {
+        7 => None, // Reserved.
+        szx => Some(16 << szx),
+    }
+}
+
+// Where to resume a firmware download from: the device sends "o=<offset>" as a Uri-Query once it already has part
+// of the image. Anything else (or no query at all) starts from the beginning.
+pub fn firmware_offset<'a>(queries: impl IntoIterator<Item = &'a Vec<u8>>) -> Result<usize, BusinessError> {
+    for query in queries {
+        if let Some(offset) = query.strip_prefix(b"o=") {
+            return std::str::from_utf8(offset).ok()
+                .and_then(|o| o.parse().ok())
+                .ok_or_else(|| BusinessError::BadRequest(anyhow!("bad firmware offset {:?}", String::from_utf8_lossy(query))));
+        }
+    }
+    Ok(0)
+}
+
+// The firmware a device is running, if it can take the new image as a delta against it: "d=<version in hex>".
+pub fn firmware_delta_base<'a>(queries: impl IntoIterator<Item = &'a Vec<u8>>) -> Result<Option<u32>, BusinessError> {
+    for query in queries {
+        if let Some(version) = query.strip_prefix(b"d=") {
+            return std::str::from_utf8(version).ok()
+                .and_then(|v| u32::from_str_radix(v, 16).ok())
+                .map(Some)
+                .ok_or_else(|| BusinessError::BadRequest(anyhow!("bad firmware delta base {:?}", String::from_utf8_lossy(query))));
+        }
+    }
+    Ok(None)
+}
+
 // BusinessError is a wrapper type representing errors sourced by the business logic layer.
 #[derive(Error, Debug)]
 pub enum BusinessError {
@@ -55,7 +206,7 @@ impl BusinessImpl {
     ///   2c. If current_firmware != desired firmware, and firmware_state is STARTED, set firmware_state to FAILED and set desired_firmware in the response to match the current firmware so the device does not upgrade.
     ///   2d. If current_firmware != desired firmware, and firmware_state is FAILED, set desired_firmware in the response to match the current firmware so the device does not upgrade.
     /// 3. Set the last_heartbeat of the device state to the current time.
-    /// 4. Set the expected_heartbeat to 600 seconds + the checkin_interval inside of the config.
+    /// 4. Work out when the device should check in next (checkin.rs), and set the expected_heartbeat to 600 seconds after that.
     pub async fn handle_heartbeat(&self, req: DeviceHeartbeatRequest) -> Result<DeviceHeartbeatResponse, BusinessError> {
         // 1. Load the DeviceState object for the device_id included in the request
         let mut device_state = self.db.get_device_state(req.device_id).await
@@ -112,10 +263,26 @@ impl BusinessImpl {
         // 3. Set the last_heartbeat to the current time
         device_state.last_heartbeat = now;
         device_state.vbat_mv = req.vbat_mv;
+        checkin::note_vbat(&mut device_state, req.vbat_mv, now);
+        // Partial refreshes are much quicker and would hide any drift in the full refresh time.
+        if let Some(timing) = req.display_timing.as_ref().filter(|t| !t.partial) {
+            device_state.last_refresh_ms = (timing.refresh_us / 1000) as i32;
+        }
+        if let Some(net) = req.net_stats.as_ref() {
+            device_state.attach_ms = net.attach_ms.min(i32::MAX as u32) as i32;
+            // Only meaningful if it attached - otherwise it's whatever parent the device had before.
+            device_state.parent_rloc16 = (net.attach_ms > 0).then_some(net.parent_rloc16 as i32);
+            device_state.parent_rssi = net.parent_rssi as i32;
+            device_state.net_ms = net.elapsed_ms().min(i32::MAX as u32) as i32;
+            device_state.net_retransmits = net.retransmits() as i32;
+            device_state.net_bytes_per_sec = net.bytes_per_sec() as i32;
+        }
 
-        // 4. Set the expected_heartbeat to 600 seconds + checkin_interval (if not already set above)
+        // 4. Set the expected_heartbeat to 600 seconds + the interval we give the device (if not already set above)
+        let checkin_interval = checkin::checkin_interval(&device_state, now);
+        device_state.next_checkin_interval = checkin_interval;
         if device_state.firmware_state != FirmwareState::STARTED {
-            device_state.expected_heartbeat = now + Duration::seconds(600 + device_state.checkin_interval as i64);
+            device_state.expected_heartbeat = now + Duration::seconds(600 + checkin_interval as i64);
         }
 
         // Save the updated device state
@@ -125,9 +292,22 @@ impl BusinessImpl {
         // Return the response
         Ok(DeviceHeartbeatResponse {
             desired_firmware: desired_firmware_for_response as u32,
-            checkin_interval: device_state.checkin_interval as u32,
+            checkin_interval: checkin_interval as u32,
         })
     }
+
+    /// Note the frame the image pipeline just made for a device, so its check-in interval can follow how often the
+    /// content changes.
+    pub async fn handle_new_frame(&self, device_id: u64, frame: &[u8]) -> Result<(), BusinessError> {
+        let mut device_state = self.db.get_device_state(device_id).await
+            .map_err(|e| BusinessError::InternalError(anyhow!("Database error: {}", e)))?;
+        // Most fetches bring back the same frame. Only write when it changed, so we don't race heartbeats for nothing.
+        if checkin::note_image(&mut device_state, content_etag(frame), Utc::now()) {
+            self.db.update_device_state(&device_state).await
+                .map_err(|e| BusinessError::InternalError(anyhow!("Failed to update device state: {}", e)))?;
+        }
+        Ok(())
+    }
 }
 
 
@@ -152,6 +332,22 @@ mod tests {
             image_url: None,
             display_type: None,
             rotation: crate::types::Rotation::ROTATE_0,
+            last_refresh_ms: 0,
+            attach_ms: 0,
+            parent_rloc16: None,
+            parent_rssi: 0,
+            net_ms: 0,
+            net_retransmits: 0,
+            net_bytes_per_sec: 0,
+            min_checkin_interval: None,
+            max_checkin_interval: None,
+            image_hash: None,
+            image_changed_at: None,
+            image_change_interval: 0,
+            vbat_ref_mv: 0,
+            vbat_ref_at: None,
+            vbat_trend_mv_per_day: 0,
+            next_checkin_interval: 0,
         }
     }
 
@@ -175,6 +371,8 @@ mod tests {
             current_firmware: 100, // Matches desired firmware
             protocol_version: 1,
             vbat_mv: 900,
+            display_timing: None,
+            net_stats: None,
         };
 
         let response = business.handle_heartbeat(request).await.unwrap();
@@ -203,6 +401,8 @@ mod tests {
             current_firmware: 100, // Different from desired (200)
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let response = business.handle_heartbeat(request).await.unwrap();
@@ -234,6 +434,8 @@ mod tests {
             current_firmware: 200, // Different from desired (300)
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let response = business.handle_heartbeat(request).await.unwrap();
@@ -262,6 +464,8 @@ mod tests {
             current_firmware: 300, // Different from desired (400)
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let response = business.handle_heartbeat(request).await.unwrap();
@@ -290,6 +494,8 @@ mod tests {
             current_firmware: 400, // Different from desired (500)
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let response = business.handle_heartbeat(request).await.unwrap();
@@ -324,6 +530,8 @@ mod tests {
             current_firmware: 100,
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let before_request = Utc::now();
@@ -354,6 +562,8 @@ mod tests {
             current_firmware: 100,
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let result = business.handle_heartbeat(request).await;
@@ -382,6 +592,8 @@ mod tests {
             current_firmware: 100,
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let response1 = business.handle_heartbeat(request1).await.unwrap();
@@ -396,6 +608,8 @@ mod tests {
             current_firmware: 200, // Now matches desired
             protocol_version: 1,
             vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
         };
 
         let response2 = business.handle_heartbeat(request2).await.unwrap();
@@ -405,4 +619,243 @@ mod tests {
         assert_eq!(device_after_step2.firmware_state, FirmwareState::OK);
         assert_eq!(device_after_step2.reported_firmware, 200);
     }
-}
\ No newline at end of file
+
+    #[tokio::test]
+    async fn test_heartbeat_records_refresh_time() {
+        let mock_db = MockDatabase::new();
+        let mut device = create_test_device(8, 100, 100, FirmwareState::OK);
+        device.last_refresh_ms = 15000;
+        mock_db.insert_device(device);
+
+        let business = create_business_impl(mock_db);
+
+        // No timing reported (e.g. the first wake after flashing) - keep what we had.
+        let request = DeviceHeartbeatRequest {
+            device_id: 8,
+            current_firmware: 100,
+            protocol_version: 1,
+            vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
+        };
+        business.handle_heartbeat(request).await.unwrap();
+        assert_eq!(business.db.get_device_state(8).await.unwrap().last_refresh_ms, 15000);
+
+        let request = DeviceHeartbeatRequest {
+            device_id: 8,
+            current_firmware: 100,
+            protocol_version: 1,
+            vbat_mv: 1500,
+            display_timing: Some(DisplayTiming {
+                refresh_us: 16_250_000,
+                ..Default::default()
+            }),
+            net_stats: None,
+        };
+        business.handle_heartbeat(request).await.unwrap();
+        assert_eq!(business.db.get_device_state(8).await.unwrap().last_refresh_ms, 16250);
+    }
+
+    #[test]
+    fn test_heartbeat_request_decodes_without_display_timing() {
+        // Devices running older firmware don't send display_timing at all.
+        #[derive(Serialize)]
+        struct OldHeartbeat {
+            device_id: u64,
+            current_firmware: u32,
+            protocol_version: u8,
+            vbat_mv: i32,
+        }
+        let mut encoded = Vec::new();
+        ciborium::into_writer(&OldHeartbeat { device_id: 1, current_firmware: 2, protocol_version: 1, vbat_mv: 3000 }, &mut encoded).unwrap();
+
+        let decoded: DeviceHeartbeatRequest = ciborium::from_reader(&encoded[..]).unwrap();
+        assert_eq!(decoded.display_timing, None);
+        assert_eq!(decoded.net_stats, None);
+        assert_eq!(decoded.vbat_mv, 3000);
+    }
+
+    #[tokio::test]
+    async fn test_heartbeat_records_network_stats() {
+        let mock_db = MockDatabase::new();
+        mock_db.insert_device(create_test_device(9, 100, 100, FirmwareState::OK));
+        let business = create_business_impl(mock_db);
+
+        let request = DeviceHeartbeatRequest {
+            device_id: 9,
+            current_firmware: 100,
+            protocol_version: 2,
+            vbat_mv: 1500,
+            display_timing: None,
+            net_stats: Some(NetStats {
+                attach_ms: 4350,
+                parent_rloc16: 0x4c00,
+                parent_rssi: -71,
+                srtt_ms: 180,
+                transfers: vec![
+                    NetTransfer { kind: 0, bytes: 2, elapsed_ms: 200, replies: 1, ..Default::default() },
+                    NetTransfer { kind: 2, bytes: 19998, elapsed_ms: 9800, replies: 20, retransmits: 2, ..Default::default() },
+                ],
+                ..Default::default()
+            }),
+        };
+        business.handle_heartbeat(request).await.unwrap();
+        let device = business.db.get_device_state(9).await.unwrap();
+        assert_eq!(device.attach_ms, 4350);
+        assert_eq!(device.parent_rloc16, Some(0x4c00));
+        assert_eq!(device.parent_rssi, -71);
+        assert_eq!(device.net_ms, 10000);
+        assert_eq!(device.net_retransmits, 2);
+        assert_eq!(device.net_bytes_per_sec, 2000);
+
+        // A wake that never attached has no parent to blame.
+        let request = DeviceHeartbeatRequest {
+            device_id: 9,
+            current_firmware: 100,
+            protocol_version: 2,
+            vbat_mv: 1500,
+            display_timing: None,
+            net_stats: Some(NetStats { parent_rloc16: 0x4c00, ..Default::default() }),
+        };
+        business.handle_heartbeat(request).await.unwrap();
+        let device = business.db.get_device_state(9).await.unwrap();
+        assert_eq!(device.attach_ms, 0);
+        assert_eq!(device.parent_rloc16, None);
+        assert_eq!(device.net_bytes_per_sec, 0);
+    }
+
+    #[tokio::test]
+    async fn test_heartbeat_adapts_checkin_interval() {
+        let mock_db = MockDatabase::new();
+        let mut device = create_test_device(10, 100, 100, FirmwareState::OK);
+        device.min_checkin_interval = Some(300);
+        device.max_checkin_interval = Some(3600);
+        mock_db.insert_device(device);
+        let business = create_business_impl(mock_db);
+
+        // Same frame twice: only the first one counts.
+        business.handle_new_frame(10, b"weekly menu").await.unwrap();
+        let first_seen = business.db.get_device_state(10).await.unwrap().image_changed_at;
+        assert!(first_seen.is_some());
+        business.handle_new_frame(10, b"weekly menu").await.unwrap();
+        assert_eq!(business.db.get_device_state(10).await.unwrap().image_changed_at, first_seen);
+
+        // It changed a day ago and not since, so the device can sleep as long as it's allowed to.
+        let mut device = business.db.get_device_state(10).await.unwrap();
+        device.image_changed_at = Some(Utc::now() - Duration::days(1));
+        business.db.update_device_state(&device).await.unwrap();
+
+        let request = DeviceHeartbeatRequest {
+            device_id: 10,
+            current_firmware: 100,
+            protocol_version: 2,
+            vbat_mv: 1500,
+            display_timing: None,
+            net_stats: None,
+        };
+        let response = business.handle_heartbeat(request).await.unwrap();
+        assert_eq!(response.checkin_interval, 3600);
+
+        let device = business.db.get_device_state(10).await.unwrap();
+        assert_eq!(device.next_checkin_interval, 3600);
+        assert!(device.expected_heartbeat > Utc::now() + Duration::seconds(4000));
+    }
+
+    #[test]
+    fn test_content_etag_matches_fnv1a() {
+        // Reference values for 64-bit FNV-1a.
+        assert_eq!(content_etag(b""), 0xcbf29ce484222325u64.to_be_bytes());
+        assert_eq!(content_etag(b"a"), 0xaf63dc4c8601ec8cu64.to_be_bytes());
+        assert_ne!(content_etag(b"image one"), content_etag(b"image two"));
+    }
+
+    #[test]
+    fn test_frame_crc32_matches_ieee() {
+        assert_eq!(frame_crc32(b""), 0);
+        assert_eq!(frame_crc32(b"123456789"), 0xCBF43926);
+    }
+
+    #[test]
+    fn test_block2_size() {
+        assert_eq!(block2_size(&[]), Some(16));
+        assert_eq!(block2_size(&[0x06]), Some(1024));
+        assert_eq!(block2_size(&[0x14]), Some(256)); // Block 1.
+        assert_eq!(block2_size(&[0x01, 0x2e]), Some(1024)); // Block 18, more to come.
+        assert_eq!(block2_size(&[0x07]), None);
+        assert_eq!(block2_size(&[0, 0, 0, 0]), None);
+    }
+
+    #[test]
+    fn test_firmware_offset() {
+        assert_eq!(firmware_offset(&Vec::<Vec<u8>>::new()).unwrap(), 0);
+        assert_eq!(firmware_offset(&vec![b"o=0".to_vec()]).unwrap(), 0);
+        assert_eq!(firmware_offset(&vec![b"x=1".to_vec(), b"o=131072".to_vec()]).unwrap(), 131072);
+        assert!(firmware_offset(&vec![b"o=-1".to_vec()]).is_err());
+        assert!(firmware_offset(&vec![b"o=".to_vec()]).is_err());
+    }
+
+    #[test]
+    fn test_firmware_delta_base() {
+        assert_eq!(firmware_delta_base(&Vec::<Vec<u8>>::new()).unwrap(), None);
+        assert_eq!(firmware_delta_base(&vec![b"o=0".to_vec()]).unwrap(), None);
+        assert_eq!(firmware_delta_base(&vec![b"d=00010203".to_vec()]).unwrap(), Some(0x00010203));
+        assert!(firmware_delta_base(&vec![b"d=xyz".to_vec()]).is_err());
+    }
+
+    // The same files the firmware's tests (tests/protocol) check its encoder and decoder against.
+    #[test]
+    fn test_golden_protocol_messages() {
+        let hb: DeviceHeartbeatRequest = ciborium::from_reader(&include_bytes!("../../tests/protocol/golden/heartbeat_request.cbor")[..]).unwrap();
+        assert_eq!(hb.device_id, 0x12345678);
+        assert_eq!(hb.current_firmware, 0x00010203);
+        assert_eq!(hb.protocol_version, 1);
+        assert_eq!(hb.vbat_mv, 2980);
+        assert_eq!(hb.display_timing, Some(DisplayTiming {
+            epd_type: 4,
+            partial: false,
+            power_on_us: 120000,
+            transfer_us: 2500000,
+            refresh_us: 3900000,
+            power_off_us: 100000,
+            spi_us: 180000,
+            init_bytes: 64,
+            transfer_bytes: 48000,
+        }));
+
+        let hb: DeviceHeartbeatRequest = ciborium::from_reader(&include_bytes!("../../tests/protocol/golden/heartbeat_request_no_timing.cbor")[..]).unwrap();
+        assert_eq!(hb.vbat_mv, -1);
+        assert_eq!(hb.display_timing, None);
+        assert_eq!(hb.net_stats, None);
+
+        let hb: DeviceHeartbeatRequest = ciborium::from_reader(&include_bytes!("../../tests/protocol/golden/heartbeat_request_net.cbor")[..]).unwrap();
+        assert_eq!(hb.protocol_version, 2);
+        assert_eq!(hb.display_timing, None);
+        assert_eq!(hb.net_stats, Some(NetStats {
+            attach_ms: 4350,
+            parent_rloc16: 0x4c00,
+            parent_rssi: -71,
+            parent_lq_in: 3,
+            parent_lq_out: 2,
+            srtt_ms: 180,
+            transfers: vec![
+                NetTransfer { kind: 0, result: 0, bytes: 2, elapsed_ms: 210, replies: 1, retransmits: 0 },
+                NetTransfer { kind: 2, result: 0, bytes: 21440, elapsed_ms: 9800, replies: 21, retransmits: 2 },
+            ],
+        }));
+
+        let img: DeviceImageRequest = ciborium::from_reader(&include_bytes!("../../tests/protocol/golden/image_request.cbor")[..]).unwrap();
+        assert_eq!(img, DeviceImageRequest {
+            device_id: 0x12345678,
+            data_size: 48000,
+            epd_typ: 4,
+            codecs: Some(7),
+            hs_window: Some(11),
+            hs_lookahead: Some(8),
+            frame_crc: true,
+        });
+
+        let mut encoded = Vec::new();
+        ciborium::into_writer(&DeviceHeartbeatResponse { desired_firmware: 0x00010203, checkin_interval: 600 }, &mut encoded).unwrap();
+        assert_eq!(encoded, include_bytes!("../../tests/protocol/golden/heartbeat_response.cbor"));
+    }
+}
@@ -0,0 +1,207 @@
+// Per-device check-in intervals that follow what the device is showing.
+//
+// A device shows one image between wakes, so waking more often than its image changes only spends battery. The
+// image pipeline hashes each frame it makes (content_etag over the unencoded frame), and every change it sees updates
+// a smoothed interval between changes. A device showing a weekly menu ends up waking rarely, and a transit board
+// as often as it's allowed to.
+//
+// The interval is chosen between bounds an admin sets per device (min_checkin_interval and max_checkin_interval).
+// If either one is unset, the device keeps its fixed checkin_interval. Within the bounds, devices wake twice per
+// change interval, so on average what they show is at most a quarter of a change interval out of date. Content that
+// has gone unchanged for longer than its usual interval counts as having slowed down. A battery that's draining fast
+// doubles the interval.
+//
+// Images are only fetched every 30 minutes (see main.rs), so that's the fastest change we can see.
+
+use chrono::{DateTime, Utc};
+
+use crate::types::DeviceState;
+
+// Wakes per change interval.
+const WAKES_PER_CHANGE: i64 = 2;
+
+// Weight of the previous change interval against a new sample, out of 4.
+const CHANGE_SMOOTHING: i64 = 3;
+
+// One wake's battery reading is within ADC noise of the next, so the trend is measured over at least this long.
+pub const VBAT_TREND_SPAN_SECS: i64 = 24 * 60 * 60;
+
+// Batteries losing at least this much a day get their devices' intervals doubled.
+pub const FAST_DRAIN_MV_PER_DAY: i32 = 10;
+
+// Record the frame the image pipeline made for a device. Returns whether it changed, and so whether the device
+// state needs saving.
+pub fn note_image(device: &mut DeviceState, etag: [u8; 8], now: DateTime<Utc>) -> bool {
+    let hash = i64::from_be_bytes(etag);
+    if device.image_hash == Some(hash) {
+        return false;
+    }
+    // The first frame we see has nothing to measure from.
+    if let (Some(_), Some(changed_at)) = (device.image_hash, device.image_changed_at) {
+        let sample = (now - changed_at).num_seconds().clamp(0, i32::MAX as i64);
+        device.image_change_interval = if device.image_change_interval == 0 {
+            sample as i32
+        } else {
+            ((CHANGE_SMOOTHING * device.image_change_interval as i64 + (4 - CHANGE_SMOOTHING) * sample) / 4) as i32
+        };
+    }
+    device.image_hash = Some(hash);
+    device.image_changed_at = Some(now);
+    true
+}
+
+// Record a heartbeat's battery voltage. -1 (the fuel gauge couldn't be read) is ignored.
+pub fn note_vbat(device: &mut DeviceState, vbat_mv: i32, now: DateTime<Utc>) {
+    if vbat_mv <= 0 {
+        return;
+    }
+    if let Some(ref_at) = device.vbat_ref_at.filter(|_| device.vbat_ref_mv > 0) {
+        let span = (now - ref_at).num_seconds();
+        if span < VBAT_TREND_SPAN_SECS {
+            return;
+        }
+        device.vbat_trend_mv_per_day = ((vbat_mv - device.vbat_ref_mv) as i64 * 24 * 60 * 60 / span) as i32;
+    }
+    device.vbat_ref_mv = vbat_mv;
+    device.vbat_ref_at = Some(now);
+}
+
+// Seconds until the device should next check in.
+pub fn checkin_interval(device: &DeviceState, now: DateTime<Utc>) -> i32 {
+    let (min, max) = match (device.min_checkin_interval, device.max_checkin_interval) {
+        (Some(min), Some(max)) if 0 < min && min <= max => (min as i64, max as i64),
+        _ => return device.checkin_interval,
+    };
+
+    let unchanged_for = device.image_changed_at.map_or(0, |t| (now - t).num_seconds().max(0));
+    let change_interval = (device.image_change_interval as i64).max(unchanged_for);
+    let mut interval = if change_interval > 0 {
+        change_interval / WAKES_PER_CHANGE
+    } else {
+        device.checkin_interval as i64
+    };
+    if device.vbat_trend_mv_per_day <= -FAST_DRAIN_MV_PER_DAY {
+        interval *= 2;
+    }
+    interval.clamp(min, max) as i32
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+    use chrono::Duration;
+    use crate::types::{FirmwareState, Rotation};
+
+    fn device() -> DeviceState {
+        DeviceState {
+            device_id: 1,
+            device_friendly_name: "Test Device".to_string(),
+            desired_firmware: 100,
+            reported_firmware: 100,
+            firmware_state: FirmwareState::OK,
+            last_heartbeat: Utc::now(),
+            expected_heartbeat: Utc::now(),
+            checkin_interval: 600,
+            vbat_mv: 3000,
+            image_url: None,
+            display_type: None,
+            rotation: Rotation::ROTATE_0,
+            last_refresh_ms: 0,
+            attach_ms: 0,
+            parent_rloc16: None,
+            parent_rssi: 0,
+            net_ms: 0,
+            net_retransmits: 0,
+            net_bytes_per_sec: 0,
+            min_checkin_interval: Some(300),
+            max_checkin_interval: Some(6 * 60 * 60),
+            image_hash: None,
+            image_changed_at: None,
+            image_change_interval: 0,
+            vbat_ref_mv: 0,
+            vbat_ref_at: None,
+            vbat_trend_mv_per_day: 0,
+            next_checkin_interval: 0,
+        }
+    }
+
+    #[test]
+    fn test_fixed_without_bounds() {
+        let mut d = device();
+        d.max_checkin_interval = None;
+        d.image_change_interval = 7 * 24 * 60 * 60;
+        assert_eq!(checkin_interval(&d, Utc::now()), 600);
+
+        // Bounds the wrong way round are ignored too.
+        d.max_checkin_interval = Some(200);
+        assert_eq!(checkin_interval(&d, Utc::now()), 600);
+    }
+
+    #[test]
+    fn test_learns_change_interval() {
+        let mut d = device();
+        let start = Utc::now();
+
+        // Nothing seen yet.
+        assert_eq!(checkin_interval(&d, start), 600);
+
+        assert!(note_image(&mut d, [1; 8], start));
+        assert!(!note_image(&mut d, [1; 8], start + Duration::minutes(30)));
+        assert_eq!(d.image_change_interval, 0);
+
+        // Changing every hour: wake every half hour.
+        for i in 1..=4 {
+            assert!(note_image(&mut d, [1 + i as u8; 8], start + Duration::hours(i)));
+        }
+        assert_eq!(d.image_change_interval, 3600);
+        assert_eq!(checkin_interval(&d, start + Duration::hours(4)), 1800);
+
+        // A change after a day pulls the average towards it, but not all the way.
+        assert!(note_image(&mut d, [9; 8], start + Duration::hours(28)));
+        assert_eq!(d.image_change_interval, (3 * 3600 + 24 * 3600) / 4);
+    }
+
+    #[test]
+    fn test_static_content_sleeps_longer() {
+        let mut d = device();
+        let start = Utc::now();
+        note_image(&mut d, [1; 8], start);
+        note_image(&mut d, [2; 8], start + Duration::minutes(30));
+        assert_eq!(checkin_interval(&d, start + Duration::minutes(30)), 900);
+
+        // Not changed for two hours, where it used to change every half hour.
+        assert_eq!(checkin_interval(&d, start + Duration::minutes(150)), 3600);
+        // And never past the admin's limit.
+        assert_eq!(checkin_interval(&d, start + Duration::days(7)), 6 * 60 * 60);
+    }
+
+    #[test]
+    fn test_fast_changing_content_stays_at_min() {
+        let mut d = device();
+        d.image_change_interval = 60;
+        assert_eq!(checkin_interval(&d, Utc::now()), 300);
+    }
+
+    #[test]
+    fn test_battery_trend() {
+        let mut d = device();
+        let start = Utc::now();
+
+        note_vbat(&mut d, -1, start);
+        assert_eq!(d.vbat_ref_at, None);
+
+        note_vbat(&mut d, 3000, start);
+        // Too soon to tell.
+        note_vbat(&mut d, 2900, start + Duration::hours(1));
+        assert_eq!(d.vbat_trend_mv_per_day, 0);
+        assert_eq!(d.vbat_ref_mv, 3000);
+
+        note_vbat(&mut d, 2970, start + Duration::hours(48));
+        assert_eq!(d.vbat_trend_mv_per_day, -15);
+        assert_eq!(d.vbat_ref_mv, 2970);
+
+        d.image_change_interval = 3600;
+        d.image_changed_at = Some(start + Duration::hours(48));
+        assert_eq!(checkin_interval(&d, start + Duration::hours(48)), 3600);
+    }
+}
@@ -0,0 +1,362 @@
+// Binary deltas between firmware images, so a device upgrading from a version we still have under fw/ downloads
+// what changed instead of the whole image. The device applies them as they stream in (the firmware's
+// src/fw_delta.c), reading the image it's running from its primary slot and writing the new one to the secondary.
+//
+// All integers are little-endian:
+//
+//   "WPD1", u32 source_size, u32 source_crc, u32 target_size, u32 target_crc
+//   then ops until target_size bytes have been produced:
+//     0  COPY    seek, length                  source bytes as they are
+//     1  ADD     seek, length, length bytes    source bytes plus these, wrapping
+//     2  INSERT  length, length bytes          new bytes
+//
+// Lengths are LEB128 varints, like row RLE's in image_codec.rs. Seeks are zigzag-encoded varints that move the
+// source cursor before a COPY or ADD, which then advance it by their length. The CRCs are frame_crc32's, so a
+// device can refuse a delta made against some other image before it writes anything.
+//
+// ADD is what makes this work on firmware: a point release moves code around, so most of the image is the old image
+// with different addresses in it. Those bytes come out as mostly zeros, which compress well.
+
+use std::{fs, path::{Path, PathBuf}};
+
+use anyhow::anyhow;
+
+use crate::business::frame_crc32;
+
+pub const DELTA_MAGIC: &[u8; 4] = b"WPD1";
+const HEADER_LEN: usize = 20;
+
+const OP_COPY: u8 = 0;
+const OP_ADD: u8 = 1;
+const OP_INSERT: u8 = 2;
+
+// Matches are found by looking up this many bytes in an index of the source.
+const KEY_LEN: usize = 8;
+// Source positions kept per key. Firmware has plenty of repeated 8 byte sequences (padding, tables), and the first
+// few are as good as any.
+const MAX_CANDIDATES: usize = 16;
+// A COPY costs up to 8 bytes of op, so shorter matches are left to ADD or INSERT.
+const MIN_COPY: usize = 12;
+
+// Cached deltas live in fw/delta/, named <from>-<to>.delta after the firmware files they join.
+const DELTA_DIR: &str = "delta";
+
+pub fn make_delta(source: &[u8], target: &[u8]) -> Vec<u8> {
+    let mut out = Vec::with_capacity(target.len() / 4);
+    out.extend_from_slice(DELTA_MAGIC);
+    out.extend_from_slice(&(source.len() as u32).to_le_bytes());
+    out.extend_from_slice(&frame_crc32(source).to_le_bytes());
+    out.extend_from_slice(&(target.len() as u32).to_le_bytes());
+    out.extend_from_slice(&frame_crc32(target).to_le_bytes());
+
+    let index = index_source(source);
+    let mut cursor = 0; // Where the device's source cursor is.
+    let mut pending = 0; // Start of target bytes not yet covered by an op.
+    let mut i = 0;
+
+    while i + KEY_LEN <= target.len() {
+        // Where the source would be if the bytes since the last op lined up with it, as they do in an ADD.
+        let in_step = cursor + (i - pending);
+        let (src, len) = best_match(source, &index, target, i, in_step);
+        if len < MIN_COPY {
+            i += 1;
+            continue;
+        }
+
+        cursor = flush_pending(&mut out, source, cursor, &target[pending..i]);
+        out.push(OP_COPY);
+        put_seek(&mut out, cursor, src);
+        put_varint(&mut out, len);
+        cursor = src + len;
+        i += len;
+        pending = i;
+    }
+    flush_pending(&mut out, source, cursor, &target[pending..]);
+    out
+}
+
+fn index_source(source: &[u8]) -> std::collections::HashMap<u64, Vec<u32>> {
+    let mut index: std::collections::HashMap<u64, Vec<u32>> = std::collections::HashMap::new();
+    for (pos, window) in source.windows(KEY_LEN).enumerate() {
+        let positions = index.entry(key(window)).or_default();
+        if positions.len() < MAX_CANDIDATES {
+            positions.push(pos as u32);
+        }
+    }
+    index
+}
+
+fn key(bytes: &[u8]) -> u64 {
+    u64::from_le_bytes(bytes[..KEY_LEN].try_into().unwrap())
+}
+
+fn match_len(source: &[u8], src: usize, target: &[u8], at: usize) -> usize {
+    source[src..].iter().zip(&target[at..]).take_while(|(a, b)| a == b).count()
+}
+
+// The longest exact match for target[at..] in the source, preferring the one in step with the last op on ties.
+fn best_match(source: &[u8], index: &std::collections::HashMap<u64, Vec<u32>>, target: &[u8], at: usize,
+              in_step: usize) -> (usize, usize) {
+    let mut best = (in_step, if in_step < source.len() { match_len(source, in_step, target, at) } else { 0 });
+    if let Some(positions) = index.get(&key(&target[at..])) {
+        for &src in positions {
+            let len = match_len(source, src as usize, target, at);
+            if len > best.1 {
+                best = (src as usize, len);
+            }
+        }
+    }
+    best
+}
+
+// Cover BYTES, which follow the last op, with an ADD against the source in step with it if that shares enough bytes
+// to be worth it, and an INSERT otherwise. A short gap between two matches is nearly always a changed address, so
+// that's an ADD too: the differences repeat across the image where the new bytes wouldn't. Returns the new source
+// cursor.
+fn flush_pending(out: &mut Vec<u8>, source: &[u8], cursor: usize, bytes: &[u8]) -> usize {
+    if bytes.is_empty() {
+        return cursor;
+    }
+    if cursor + bytes.len() <= source.len() {
+        let old = &source[cursor..cursor + bytes.len()];
+        let same = old.iter().zip(bytes).filter(|(a, b)| a == b).count();
+        if same * 4 >= bytes.len() || bytes.len() < MIN_COPY {
+            out.push(OP_ADD);
+            put_seek(out, cursor, cursor);
+            put_varint(out, bytes.len());
+            out.extend(old.iter().zip(bytes).map(|(o, n)| n.wrapping_sub(*o)));
+            return cursor + bytes.len();
+        }
+    }
+    out.push(OP_INSERT);
+    put_varint(out, bytes.len());
+    out.extend_from_slice(bytes);
+    cursor
+}
+
+fn put_seek(out: &mut Vec<u8>, from: usize, to: usize) {
+    let seek = to as i64 - from as i64;
+    put_varint(out, ((seek << 1) ^ (seek >> 63)) as usize);
+}
+
+fn put_varint(out: &mut Vec<u8>, mut value: usize) {
+    loop {
+        let b = (value & 0x7F) as u8;
+        value >>= 7;
+        if value == 0 {
+            out.push(b);
+            return;
+        }
+        out.push(b | 0x80);
+    }
+}
+
+fn get_varint(delta: &[u8], pos: &mut usize) -> Result<usize, anyhow::Error> {
+    let mut value = 0usize;
+    let mut shift = 0;
+    loop {
+        let b = *delta.get(*pos).ok_or_else(|| anyhow!("delta ends inside a varint"))?;
+        *pos += 1;
+        if shift > 28 {
+            return Err(anyhow!("varint too long"));
+        }
+        value |= ((b & 0x7F) as usize) << shift;
+        shift += 7;
+        if b & 0x80 == 0 {
+            return Ok(value);
+        }
+    }
+}
+
+fn get_bytes<'a>(delta: &'a [u8], pos: &mut usize, len: usize) -> Result<&'a [u8], anyhow::Error> {
+    let bytes = delta.get(*pos..*pos + len).ok_or_else(|| anyhow!("delta ends inside an op"))?;
+    *pos += len;
+    Ok(bytes)
+}
+
+// Apply a delta the way the device does. We check every delta with this before serving it.
+pub fn apply_delta(source: &[u8], delta: &[u8]) -> Result<Vec<u8>, anyhow::Error> {
+    if delta.len() < HEADER_LEN || &delta[..4] != DELTA_MAGIC {
+        return Err(anyhow!("not a delta"));
+    }
+    let u32_at = |at: usize| u32::from_le_bytes(delta[at..at + 4].try_into().unwrap());
+    if u32_at(4) as usize != source.len() || u32_at(8) != frame_crc32(source) {
+        return Err(anyhow!("delta is against a different source image"));
+    }
+    let target_size = u32_at(12) as usize;
+
+    let mut out = Vec::with_capacity(target_size);
+    let mut pos = HEADER_LEN;
+    let mut cursor: i64 = 0;
+    while out.len() < target_size {
+        let op = get_bytes(delta, &mut pos, 1)?[0];
+        match op {
+            OP_COPY | OP_ADD => {
+                let seek = get_varint(delta, &mut pos)? as i64;
+                cursor += (seek >> 1) ^ -(seek & 1);
+                let len = get_varint(delta, &mut pos)?;
+                if cursor < 0 || cursor as usize + len > source.len() {
+                    return Err(anyhow!("op reads outside the source"));
+                }
+                let old = &source[cursor as usize..cursor as usize + len];
+                if op == OP_COPY {
+                    out.extend_from_slice(old);
+                } else {
+                    let diff = get_bytes(delta, &mut pos, len)?;
+                    out.extend(old.iter().zip(diff).map(|(o, d)| o.wrapping_add(*d)));
+                }
+                cursor += len as i64;
+            }
+            OP_INSERT => {
+                let len = get_varint(delta, &mut pos)?;
+                out.extend_from_slice(get_bytes(delta, &mut pos, len)?);
+            }
+            _ => return Err(anyhow!("unknown op {}", op)),
+        }
+    }
+    if out.len() != target_size || pos != delta.len() {
+        return Err(anyhow!("delta doesn't end with the target"));
+    }
+    if frame_crc32(&out) != u32_at(16) {
+        return Err(anyhow!("target CRC mismatch"));
+    }
+    Ok(out)
+}
+
+// The delta from firmware file FROM to TO (names like "00010203.bin") in FW_DIR, from the cache if it's newer than
+// both of them. Made, checked and cached otherwise. None if we don't have FROM.
+pub fn cached_delta(fw_dir: &Path, from: &str, to: &str) -> Result<Option<Vec<u8>>, anyhow::Error> {
+    let from_path = fw_dir.join(from);
+    let to_path = fw_dir.join(to);
+    if !from_path.exists() {
+        return Ok(None);
+    }
+    let cache_path = delta_path(fw_dir, from, to);
+
+    let modified = |p: &Path| fs::metadata(p).and_then(|m| m.modified());
+    if let (Ok(cached), Ok(from_time), Ok(to_time)) = (modified(&cache_path), modified(&from_path), modified(&to_path)) {
+        if cached >= from_time && cached >= to_time {
+            return Ok(Some(fs::read(&cache_path)?));
+        }
+    }
+
+    let source = fs::read(&from_path)?;
+    let target = fs::read(&to_path)?;
+    let delta = make_delta(&source, &target);
+    if apply_delta(&source, &delta)? != target {
+        return Err(anyhow!("delta {} -> {} doesn't reproduce the target", from, to));
+    }
+    fs::create_dir_all(fw_dir.join(DELTA_DIR))?;
+    fs::write(&cache_path, &delta)?;
+    println!("Made firmware delta {} -> {}: {} bytes for {}", from, to, delta.len(), target.len());
+    Ok(Some(delta))
+}
+
+fn delta_path(fw_dir: &Path, from: &str, to: &str) -> PathBuf {
+    let stem = |name: &str| name.strip_suffix(".bin").unwrap_or(name).to_string();
+    fw_dir.join(DELTA_DIR).join(format!("{}-{}.delta", stem(from), stem(to)))
+}
+
+// Make (or refresh) the deltas between every pair of firmware images in FW_DIR, so devices don't wait on them.
+pub fn cache_all_deltas(fw_dir: &Path) -> Result<(), anyhow::Error> {
+    let mut images: Vec<String> = fs::read_dir(fw_dir)?
+        .filter_map(|e| e.ok())
+        .map(|e| e.file_name().to_string_lossy().into_owned())
+        .filter(|name| name.ends_with(".bin"))
+        .collect();
+    images.sort();
+
+    for from in &images {
+        for to in &images {
+            if from != to {
+                if let Err(e) = cached_delta(fw_dir, from, to) {
+                    println!("Failed to make firmware delta {} -> {}: {:?}", from, to, e);
+                }
+            }
+        }
+    }
+    Ok(())
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Something like firmware: code that refers to addresses, and a table of strings.
+    fn test_image(functions: usize, shift: u32, seed: u32) -> Vec<u8> {
+        let mut image = Vec::new();
+        let mut x = seed;
+        for f in 0..functions {
+            for _ in 0..16 {
+                x = x.wrapping_mul(1103515245).wrapping_add(12345);
+                image.extend_from_slice(&[0x4f, 0xf0, (x >> 16) as u8, 0x0b]);
+            }
+            // A call to the next function, whose address moves with SHIFT.
+            image.extend_from_slice(&(0x1000 + (f as u32 + 1) * 68 + shift).to_le_bytes());
+        }
+        for i in 0..100 {
+            image.extend_from_slice(format!("log message number {}\0", i).as_bytes());
+        }
+        image
+    }
+
+    #[test]
+    fn test_round_trip() {
+        let old = test_image(500, 0, 1);
+        let new = test_image(500, 0, 1);
+        let delta = make_delta(&old, &new);
+        assert_eq!(apply_delta(&old, &delta).unwrap(), new);
+        assert!(delta.len() < 64, "identical images took {} bytes", delta.len());
+    }
+
+    #[test]
+    fn test_point_release_is_small() {
+        // A few new functions in front, which moves everything after them.
+        let old = test_image(1000, 0, 1);
+        let mut new = test_image(10, 0, 7);
+        new.extend_from_slice(&test_image(1000, 680, 1));
+
+        let delta = make_delta(&old, &new);
+        assert_eq!(apply_delta(&old, &delta).unwrap(), new);
+        assert!(delta.len() < new.len() / 4, "{} byte delta for a {} byte image", delta.len(), new.len());
+    }
+
+    #[test]
+    fn test_unrelated_images() {
+        let old = test_image(100, 0, 1);
+        let new = test_image(200, 0, 2);
+        let delta = make_delta(&old, &new);
+        assert_eq!(apply_delta(&old, &delta).unwrap(), new);
+        assert!(delta.len() < new.len() + new.len() / 8);
+    }
+
+    #[test]
+    fn test_edge_sizes() {
+        let image = test_image(10, 0, 1);
+        for (old, new) in [(&[][..], &image[..]), (&image[..], &[][..]), (&image[..5], &image[..3]), (&[][..], &[][..])] {
+            let delta = make_delta(old, new);
+            assert_eq!(apply_delta(old, &delta).unwrap(), new);
+        }
+    }
+
+    #[test]
+    fn test_rejects_wrong_source() {
+        let old = test_image(100, 0, 1);
+        let new = test_image(100, 4, 1);
+        let delta = make_delta(&old, &new);
+        let mut other = old.clone();
+        other[10] ^= 1;
+        assert!(apply_delta(&other, &delta).is_err());
+        assert!(apply_delta(&old, &delta[..delta.len() - 1]).is_err());
+    }
+
+    // The same files the firmware's tests (tests/protocol) apply the delta with.
+    #[test]
+    fn test_golden_delta() {
+        let old = include_bytes!("../../tests/protocol/golden/fw_delta_source.bin");
+        let new = include_bytes!("../../tests/protocol/golden/fw_delta_target.bin");
+        let delta = include_bytes!("../../tests/protocol/golden/fw_delta.delta");
+        assert_eq!(make_delta(old, new), delta.to_vec());
+        assert_eq!(apply_delta(old, delta).unwrap(), new.to_vec());
+    }
+}
@@ -0,0 +1,437 @@
+// Image codecs the firmware can decode, and the "row RLE" codec, which is tuned to e-paper frames.
+//
+// Devices list the codecs they support in their image request as a bitmask of (1 << codec id). When a device sends
+// that list, the image payload starts with one byte naming the codec the rest of it is compressed with. Devices that
+// don't send it get a bare heatshrink stream, like before codecs existed.
+//
+// Plain heatshrink (codec 0) is always window 11, lookahead 8. Devices also send the largest window and lookahead
+// their decoder is built for, and codec 2 is heatshrink with whatever parameters within those limits compress the
+// frame best, named by one more byte of (window << 4 | lookahead) ahead of the stream.
+//
+// Row RLE works on the packed frame as the panel takes it. Frames are mostly long runs of white, and rows that repeat
+// the row above them (borders, boxes, blank space between lines of text), which heatshrink's 2K window with
+// 256 byte matches handles poorly. The stream is:
+//
+//   u16 row_bytes, u32 plane_bytes          (little-endian)
+//   per plane: u8 mode, then ops until plane_bytes bytes have been produced
+//
+// Mode 0 codes the plane's bytes as-is. Mode 1 codes each byte XORed with the byte above it (the first row against
+// zeros), so a row that repeats the one above is all zeros. The encoder tries both and keeps the smaller one.
+//
+// Ops, by control byte:
+//   0x00-0x3F  literal: the next (c + 1) bytes
+//   0x40-0x7E  (c - 0x40 + 1) zero bytes
+//   0x7F       (64 + n) zero bytes, n follows as a LEB128 varint
+//   0x80-0xFE  (c - 0x80 + 1) copies of the next byte
+//   0xFF       (128 + n) copies of the next byte, n follows the byte as a LEB128 varint
+//
+// This has to stay in sync with the decoder in the firmware's src/image_codec.c.
+//
+// Firmware downloads use the same decoder. Devices at protocol_version 2 or later can decode plain heatshrink, and
+// get their firmware (or delta, see fw_delta.rs) compressed when that makes it smaller: COMPRESSED_FIRMWARE_MAGIC,
+// then a codec byte and the stream, as for images. Neither an MCUboot image nor a delta starts with the magic, so
+// devices tell the two apart by the first four bytes.
+
+pub const CODEC_HEATSHRINK: u8 = 0;
+pub const CODEC_ROW_RLE: u8 = 1;
+pub const CODEC_HEATSHRINK_PARAMS: u8 = 2;
+
+pub const HEATSHRINK_WINDOW_BITS: u8 = 11; // What CODEC_HEATSHRINK streams use.
+pub const HEATSHRINK_LOOKAHEAD_BITS: u8 = 8;
+pub const COMPRESSED_FIRMWARE_MAGIC: &[u8; 4] = b"WPZ1";
+pub const COMPRESSED_FIRMWARE_PROTOCOL: u8 = 2;
+// Smaller windows never win on a whole frame, and every size searched costs an encode per lookahead.
+const MIN_SEARCH_WINDOW_BITS: u8 = 8;
+const MIN_SEARCH_LOOKAHEAD_BITS: u8 = 4;
+const MAX_WINDOW_BITS: u8 = 15; // Has to fit in the parameter byte's top nibble.
+
+const MODE_RAW: u8 = 0;
+const MODE_ROW_DELTA: u8 = 1;
+
+const MAX_LITERAL: usize = 64;
+const MAX_SHORT_ZERO_RUN: usize = 63;
+const MAX_SHORT_RUN: usize = 127;
+const MAX_ROW_BYTES: usize = 256; // ROW_RLE_MAX_ROW_BYTES in the firmware.
+
+pub fn codec_supported(codecs: u32, codec: u8) -> bool {
+    codecs & (1 << codec) != 0
+}
+
+// Build the image payload for a device from the encodings we have of its frame, picking the smallest one it supports.
+// codecs is None for devices that predate codec negotiation, which only take bare heatshrink.
+// others holds (codec, encoding) pairs; the ones the device doesn't support are ignored.
+pub fn select_payload(codecs: Option<u32>, heatshrink: Vec<u8>, others: Vec<(u8, Vec<u8>)>) -> Vec<u8> {
+    let codecs = match codecs {
+        Some(c) => c,
+        None => return heatshrink,
+    };
+
+    let mut candidates = vec![(CODEC_HEATSHRINK, heatshrink)];
+    candidates.extend(others);
+    // Ties go to the earliest, so plain heatshrink. If the device can't decode any of them, send heatshrink anyway
+    // and let it report the error.
+    let best = candidates.iter().enumerate()
+        .filter(|(_, (codec, _))| codec_supported(codecs, *codec))
+        .min_by_key(|(_, (_, data))| data.len())
+        .map_or(0, |(i, _)| i);
+    let (codec, data) = candidates.swap_remove(best);
+
+    let mut payload = Vec::with_capacity(data.len() + 1);
+    payload.push(codec);
+    payload.extend_from_slice(&data);
+    payload
+}
+
+pub fn encode_heatshrink(raw: &[u8], window: u8, lookahead: u8) -> Result<Vec<u8>, anyhow::Error> {
+    let cfg = heatshrink::Config::new(window, lookahead)
+        .map_err(|e| anyhow::anyhow!("Failed to create heatshrink config {}/{}: {}", window, lookahead, e))?;
+    let mut outvec = vec![0u8; raw.len() * 2];
+    let compressed = heatshrink::encode(raw, &mut outvec, &cfg)
+        .map_err(|e| anyhow::anyhow!("Failed to compress with heatshrink {}/{}: {:?}", window, lookahead, e))?;
+    Ok(compressed.to_vec())
+}
+
+// Compress a frame for CODEC_HEATSHRINK_PARAMS: try every window and lookahead a device with the given limits can
+// decode, and keep the smallest, with its parameter byte in front.
+pub fn encode_heatshrink_best(raw: &[u8], max_window: u8, max_lookahead: u8) -> Result<Vec<u8>, anyhow::Error> {
+    search_heatshrink_params(max_window, max_lookahead, |w, l| encode_heatshrink(raw, w, l))
+}
+
+fn search_heatshrink_params<F>(max_window: u8, max_lookahead: u8, encode: F) -> Result<Vec<u8>, anyhow::Error>
+where
+    F: Fn(u8, u8) -> Result<Vec<u8>, anyhow::Error>,
+{
+    let mut best: Option<(u8, u8, Vec<u8>)> = None;
+    for window in MIN_SEARCH_WINDOW_BITS..=max_window.min(MAX_WINDOW_BITS) {
+        // heatshrink needs the lookahead to be smaller than the window.
+        for lookahead in MIN_SEARCH_LOOKAHEAD_BITS..=max_lookahead.min(window - 1) {
+            let data = encode(window, lookahead)?;
+            if best.as_ref().map_or(true, |(_, _, b)| data.len() < b.len()) {
+                best = Some((window, lookahead, data));
+            }
+        }
+    }
+
+    let (window, lookahead, data) = best.ok_or_else(|| {
+        anyhow::anyhow!("no heatshrink parameters fit a {}/{} decoder", max_window, max_lookahead)
+    })?;
+    let mut out = Vec::with_capacity(data.len() + 1);
+    out.push(window << 4 | lookahead);
+    out.extend_from_slice(&data);
+    Ok(out)
+}
+
+// Compress firmware for a device at COMPRESSED_FIRMWARE_PROTOCOL or later. Plain heatshrink, because an image is
+// too big to search parameters for on every request, and its 256 byte matches suit the runs of zeros in deltas.
+pub fn compress_firmware(data: &[u8]) -> Result<Vec<u8>, anyhow::Error> {
+    let encoded = encode_heatshrink(data, HEATSHRINK_WINDOW_BITS, HEATSHRINK_LOOKAHEAD_BITS)?;
+    let mut out = Vec::with_capacity(encoded.len() + COMPRESSED_FIRMWARE_MAGIC.len() + 1);
+    out.extend_from_slice(COMPRESSED_FIRMWARE_MAGIC);
+    out.push(CODEC_HEATSHRINK);
+    out.extend_from_slice(&encoded);
+    Ok(out)
+}
+
+// Compress a frame of num_planes planes, back-to-back, each made of rows of row_bytes bytes.
+pub fn encode_row_rle(raw: &[u8], row_bytes: usize, num_planes: usize) -> Result<Vec<u8>, anyhow::Error> {
+    if row_bytes == 0 || row_bytes > MAX_ROW_BYTES {
+        return Err(anyhow::anyhow!("row of {} bytes is not supported", row_bytes));
+    }
+    if num_planes == 0 || raw.len() % num_planes != 0 || (raw.len() / num_planes) % row_bytes != 0 {
+        return Err(anyhow::anyhow!("{} bytes is not {} planes of whole {} byte rows", raw.len(), num_planes, row_bytes));
+    }
+    let plane_bytes = raw.len() / num_planes;
+
+    let mut out = Vec::with_capacity(raw.len() / 4);
+    out.extend_from_slice(&(row_bytes as u16).to_le_bytes());
+    out.extend_from_slice(&(plane_bytes as u32).to_le_bytes());
+
+    for plane in raw.chunks(plane_bytes) {
+        let as_is = encode_ops(plane);
+        let delta = encode_ops(&row_delta(plane, row_bytes));
+        if delta.len() < as_is.len() {
+            out.push(MODE_ROW_DELTA);
+            out.extend_from_slice(&delta);
+        } else {
+            out.push(MODE_RAW);
+            out.extend_from_slice(&as_is);
+        }
+    }
+    Ok(out)
+}
+
+fn row_delta(plane: &[u8], row_bytes: usize) -> Vec<u8> {
+    plane.iter().enumerate()
+        .map(|(i, b)| if i < row_bytes { *b } else { b ^ plane[i - row_bytes] })
+        .collect()
+}
+
+fn run_length(data: &[u8], start: usize) -> usize {
+    data[start..].iter().take_while(|b| **b == data[start]).count()
+}
+
+fn encode_ops(data: &[u8]) -> Vec<u8> {
+    let mut out = Vec::new();
+    let mut literal_start = 0;
+    let mut i = 0;
+
+    while i < data.len() {
+        let run = run_length(data, i);
+        // A zero run costs one byte and any other run two, so shorter ones are cheaper left in a literal.
+        let worth_it = if data[i] == 0 { run >= 2 } else { run >= 3 };
+        if !worth_it {
+            i += 1;
+            continue;
+        }
+
+        flush_literal(&mut out, &data[literal_start..i]);
+        if data[i] == 0 {
+            if run <= MAX_SHORT_ZERO_RUN {
+                out.push(0x40 + (run - 1) as u8);
+            } else {
+                out.push(0x7F);
+                put_varint(&mut out, run - (MAX_SHORT_ZERO_RUN + 1));
+            }
+        } else if run <= MAX_SHORT_RUN {
+            out.push(0x80 + (run - 1) as u8);
+            out.push(data[i]);
+        } else {
+            out.push(0xFF);
+            out.push(data[i]);
+            put_varint(&mut out, run - (MAX_SHORT_RUN + 1));
+        }
+        i += run;
+        literal_start = i;
+    }
+    flush_literal(&mut out, &data[literal_start..]);
+    out
+}
+
+fn flush_literal(out: &mut Vec<u8>, literal: &[u8]) {
+    for chunk in literal.chunks(MAX_LITERAL) {
+        out.push((chunk.len() - 1) as u8);
+        out.extend_from_slice(chunk);
+    }
+}
+
+fn put_varint(out: &mut Vec<u8>, mut value: usize) {
+    loop {
+        let b = (value & 0x7F) as u8;
+        value >>= 7;
+        if value == 0 {
+            out.push(b);
+            return;
+        }
+        out.push(b | 0x80);
+    }
+}
+
+#[cfg(test)]
+mod tests {
+    use super::*;
+
+    // Reference decoder, mirroring the firmware's.
+    fn decode_row_rle(data: &[u8]) -> Vec<u8> {
+        let row_bytes = u16::from_le_bytes([data[0], data[1]]) as usize;
+        let plane_bytes = u32::from_le_bytes([data[2], data[3], data[4], data[5]]) as usize;
+        let mut pos = 6;
+        let mut out = Vec::new();
+
+        let varint = |pos: &mut usize| {
+            let mut value = 0usize;
+            let mut shift = 0;
+            loop {
+                let b = data[*pos];
+                *pos += 1;
+                value |= ((b & 0x7F) as usize) << shift;
+                shift += 7;
+                if b & 0x80 == 0 {
+                    return value;
+                }
+            }
+        };
+
+        while pos < data.len() {
+            let mode = data[pos];
+            pos += 1;
+            let mut plane = Vec::new();
+            while plane.len() < plane_bytes {
+                let c = data[pos];
+                pos += 1;
+                match c {
+                    0x00..=0x3F => {
+                        plane.extend_from_slice(&data[pos..pos + c as usize + 1]);
+                        pos += c as usize + 1;
+                    }
+                    0x40..=0x7E => plane.extend(std::iter::repeat(0).take((c - 0x40) as usize + 1)),
+                    0x7F => {
+                        let n = 64 + varint(&mut pos);
+                        plane.extend(std::iter::repeat(0).take(n));
+                    }
+                    0x80..=0xFE => {
+                        plane.extend(std::iter::repeat(data[pos]).take((c - 0x80) as usize + 1));
+                        pos += 1;
+                    }
+                    0xFF => {
+                        let b = data[pos];
+                        pos += 1;
+                        let n = 128 + varint(&mut pos);
+                        plane.extend(std::iter::repeat(b).take(n));
+                    }
+                }
+            }
+            assert_eq!(plane.len(), plane_bytes, "ops ran past the end of the plane");
+            if mode == MODE_ROW_DELTA {
+                for i in row_bytes..plane.len() {
+                    plane[i] ^= plane[i - row_bytes];
+                }
+            }
+            out.extend_from_slice(&plane);
+        }
+        out
+    }
+
+    fn test_frame(row_bytes: usize, rows: usize) -> Vec<u8> {
+        let mut frame = vec![0x55u8; row_bytes * rows]; // 2bpp white
+        // A box, which repeats row to row.
+        for row in 10..40 {
+            for col in 5..20 {
+                frame[row * row_bytes + col] = 0x00;
+            }
+        }
+        // Something noisy, which doesn't.
+        let mut x: u32 = 1;
+        for b in frame[row_bytes * 50..row_bytes * 60].iter_mut() {
+            x = x.wrapping_mul(1103515245).wrapping_add(12345);
+            *b = (x >> 16) as u8;
+        }
+        frame
+    }
+
+    #[test]
+    fn test_round_trip() {
+        let frame = test_frame(46, 384);
+        let encoded = encode_row_rle(&frame, 46, 1).unwrap();
+        assert_eq!(decode_row_rle(&encoded), frame);
+        assert!(encoded.len() < frame.len() / 4, "only compressed to {} bytes", encoded.len());
+    }
+
+    #[test]
+    fn test_round_trip_two_planes() {
+        let plane = test_frame(21, 384);
+        let frame = plane.repeat(2);
+        let encoded = encode_row_rle(&frame, 21, 2).unwrap();
+        assert_eq!(decode_row_rle(&encoded), frame);
+    }
+
+    #[test]
+    fn test_long_runs() {
+        // Blank frame: a single run per plane, which needs the varint forms.
+        let frame = vec![0u8; 96000];
+        let encoded = encode_row_rle(&frame, 200, 1).unwrap();
+        assert_eq!(decode_row_rle(&encoded), frame);
+        assert!(encoded.len() < 16, "blank frame took {} bytes", encoded.len());
+
+        let frame = vec![0x55u8; 96000];
+        let encoded = encode_row_rle(&frame, 200, 1).unwrap();
+        assert_eq!(decode_row_rle(&encoded), frame);
+        assert!(encoded.len() < 16, "white frame took {} bytes", encoded.len());
+    }
+
+    #[test]
+    fn test_rejects_bad_geometry() {
+        assert!(encode_row_rle(&[0u8; 100], 0, 1).is_err());
+        assert!(encode_row_rle(&[0u8; 100], 300, 1).is_err());
+        assert!(encode_row_rle(&[0u8; 100], 30, 1).is_err());
+        assert!(encode_row_rle(&[0u8; 100], 10, 3).is_err());
+    }
+
+    #[test]
+    fn test_select_payload() {
+        let hs = vec![1u8; 100];
+        let small = vec![2u8; 10];
+        let smaller = vec![3u8; 5];
+
+        // Legacy devices get bare heatshrink, whatever else is available.
+        assert_eq!(select_payload(None, hs.clone(), vec![(CODEC_ROW_RLE, small.clone())]), hs);
+
+        let payload = select_payload(Some(0b11), hs.clone(), vec![(CODEC_ROW_RLE, small.clone())]);
+        assert_eq!(payload[0], CODEC_ROW_RLE);
+        assert_eq!(&payload[1..], &small[..]);
+
+        // Not advertised, or not smaller: stick with heatshrink.
+        let payload = select_payload(Some(0b01), hs.clone(), vec![(CODEC_ROW_RLE, small.clone())]);
+        assert_eq!(payload[0], CODEC_HEATSHRINK);
+        assert_eq!(&payload[1..], &hs[..]);
+        let payload = select_payload(Some(0b11), small.clone(), vec![(CODEC_ROW_RLE, hs.clone())]);
+        assert_eq!(payload[0], CODEC_HEATSHRINK);
+        assert_eq!(&payload[1..], &small[..]);
+
+        // Smallest of several.
+        let others = vec![(CODEC_ROW_RLE, small.clone()), (CODEC_HEATSHRINK_PARAMS, smaller.clone())];
+        let payload = select_payload(Some(0b111), hs.clone(), others.clone());
+        assert_eq!(payload[0], CODEC_HEATSHRINK_PARAMS);
+        assert_eq!(&payload[1..], &smaller[..]);
+
+        // A device too small for plain heatshrink gets something else, even if it's bigger.
+        let payload = select_payload(Some(0b110), small.clone(), vec![(CODEC_HEATSHRINK_PARAMS, hs.clone())]);
+        assert_eq!(payload[0], CODEC_HEATSHRINK_PARAMS);
+        assert_eq!(&payload[1..], &hs[..]);
+    }
+
+    #[test]
+    fn test_heatshrink_param_search() {
+        // Fake encoder that does best at 10/5, so the search has something to find.
+        let fake = |w: u8, l: u8| -> Result<Vec<u8>, anyhow::Error> {
+            let cost = (w as i32 - 10).abs() * 3 + (l as i32 - 5).abs();
+            Ok(vec![w << 4 | l; 10 + cost as usize])
+        };
+
+        let out = search_heatshrink_params(11, 8, fake).unwrap();
+        assert_eq!(out[0], 10 << 4 | 5);
+        assert_eq!(out.len(), 11);
+
+        // Limited by the device, the best it can take is the largest window allowed.
+        let out = search_heatshrink_params(9, 8, fake).unwrap();
+        assert_eq!(out[0], 9 << 4 | 5);
+        let out = search_heatshrink_params(11, 4, fake).unwrap();
+        assert_eq!(out[0], 10 << 4 | 4);
+
+        // Every combination tried stays decodable: lookahead below the window, both within the limits.
+        let tried = std::cell::RefCell::new(Vec::new());
+        search_heatshrink_params(9, 12, |w, l| { tried.borrow_mut().push((w, l)); fake(w, l) }).unwrap();
+        let tried = tried.into_inner();
+        assert!(tried.iter().all(|&(w, l)| w >= 8 && w <= 9 && l >= 4 && l < w));
+        assert_eq!(tried.len(), 4 + 5);
+
+        assert!(search_heatshrink_params(7, 8, fake).is_err());
+        assert!(search_heatshrink_params(11, 3, fake).is_err());
+    }
+
+    #[test]
+    fn test_compress_firmware() {
+        // Code, then erased flash padding, like the end of an image.
+        let mut fw: Vec<u8> = (0..4096u32).map(|i| (i.wrapping_mul(2654435761) >> 24) as u8).collect();
+        fw.extend_from_slice(&[0xFF; 8192]);
+
+        let compressed = compress_firmware(&fw).unwrap();
+        assert_eq!(&compressed[..4], COMPRESSED_FIRMWARE_MAGIC);
+        assert_eq!(compressed[4], CODEC_HEATSHRINK);
+        assert!(compressed.len() < fw.len() / 2, "{} bytes from {}", compressed.len(), fw.len());
+
+        let cfg = heatshrink::Config::new(HEATSHRINK_WINDOW_BITS, HEATSHRINK_LOOKAHEAD_BITS).unwrap();
+        let mut decoded = vec![0u8; fw.len() * 2];
+        assert_eq!(heatshrink::decode(&compressed[5..], &mut decoded, &cfg).unwrap(), &fw[..]);
+
+        // Neither a delta nor an MCUboot image (which starts with its header magic) looks compressed.
+        assert_ne!(&crate::fw_delta::DELTA_MAGIC[..], &COMPRESSED_FIRMWARE_MAGIC[..]);
+        assert_ne!(&0x96f3b83du32.to_le_bytes()[..], &COMPRESSED_FIRMWARE_MAGIC[..]);
+    }
+
+    #[test]
+    fn test_codec_supported() {
+        assert!(codec_supported(0b11, CODEC_ROW_RLE));
+        assert!(codec_supported(0b01, CODEC_HEATSHRINK));
+        assert!(!codec_supported(0b01, CODEC_ROW_RLE));
+    }
+}
@@ -185,14 +185,19 @@ impl ImageFetcher {
         let pixfmt = display_type.get_pixel_format();
         let png_data = self.fetch_png(url).await?;
         println!("Display: {:?}, {:?}, {:?}", width, height, pixfmt);
-        match pixfmt {
+        let plane = match pixfmt {
             PixelFormat::Kw1Bit => {
-                self.png_to_1bit(&png_data, width, height, rotation)
+                self.png_to_1bit(&png_data, width, height, rotation)?
             },
             PixelFormat::Rykw2Bit => {
-                self.png_to_2bpp_wryk(&png_data, width, height, rotation)
+                self.png_to_2bpp_wryk(&png_data, width, height, rotation)?
             }
-        }
+        };
+
+        // Multi-plane displays get every plane back-to-back in a single stream; the device
+        // switches planes at each plane_size boundary. For now all planes carry the same frame,
+        // which is what the SSD1680's "previous" RAM wants after a full refresh.
+        Ok(plane.repeat(display_type.get_num_planes()))
     }
 }
 
@@ -1,13 +1,12 @@
 use async_trait::async_trait;
-use coap_lite::{RequestType as Method, CoapRequest, ResponseType};
+use coap_lite::{RequestType as Method, CoapOption, CoapRequest, ResponseType};
 use coap::{server::RequestHandler, Server};
 use tokio::runtime::Runtime;
-use std::{fs, net::SocketAddr, path::PathBuf, sync::Arc, time::{self}};
-use heatshrink::Config;
+use std::{collections::HashMap, fs, net::SocketAddr, path::{Path, PathBuf}, sync::{Arc, Mutex}, time::{self}};
 use anyhow::anyhow;
 
 use crate::{
-    business::{BusinessError, BusinessImpl, DeviceHeartbeatRequest, DeviceImageRequest}, database::{DBImpl, Database}, image_fetcher::ImageFetcher, rest_api::{create_router, AppState}
+    business::{block2_size, content_etag, firmware_delta_base, firmware_offset, frame_crc32, BusinessError, BusinessImpl, DeviceHeartbeatRequest, DeviceImageRequest}, database::{DBImpl, Database}, image_codec::{codec_supported, compress_firmware, encode_heatshrink, encode_heatshrink_best, encode_row_rle, select_payload, CODEC_HEATSHRINK_PARAMS, CODEC_ROW_RLE, COMPRESSED_FIRMWARE_PROTOCOL, HEATSHRINK_LOOKAHEAD_BITS, HEATSHRINK_WINDOW_BITS}, image_fetcher::ImageFetcher, rest_api::{create_router, AppState}
 };
 
 mod business;
@@ -16,6 +15,9 @@ mod database;
 mod schema;
 mod rest_api;
 mod image_fetcher;
+mod image_codec;
+mod fw_delta;
+mod checkin;
 
 #[cfg(test)]
 mod mock_database;
@@ -29,6 +31,7 @@ fn ensure_image_directory() -> Result<(), anyhow::Error> {
 async fn fetch_and_compress_images_for_all_devices(db: Arc<dyn Database + Send + Sync>) -> Result<(), anyhow::Error> {
     println!("Fetching images for all devices...");
     let fetcher = ImageFetcher::new();
+    let business = BusinessImpl { db: db.clone() };
 
     let devices = db.list_all_devices().await
         .map_err(|e| anyhow!("Failed to list devices: {}", e))?;
@@ -61,23 +64,47 @@ async fn fetch_and_compress_images_for_all_devices(db: Arc<dyn Database + Send +
 
         println!("Fetched and converted image for device {}: {} bytes", device.device_id, raw_img.len());
 
-        // Compress the image
-        let cfg = Config::new(11, 8)
-            .map_err(|e| anyhow!("Failed to create heatshrink config: {}", e))?;
+        // How often the frame changes sets how often the device needs to wake.
+        if let Err(e) = business.handle_new_frame(device.device_id as u64, &raw_img).await {
+            eprintln!("Failed to record new frame for device {}: {}", device.device_id, e);
+        }
 
-        let mut outvec = vec![0u8; raw_img.len() * 2];
-        let compressed = match heatshrink::encode(&raw_img, &mut outvec, &cfg) {
+        // Compress the image
+        let compressed = match encode_heatshrink(&raw_img, HEATSHRINK_WINDOW_BITS, HEATSHRINK_LOOKAHEAD_BITS) {
             Ok(c) => c,
             Err(e) => {
-                eprintln!("Failed to compress image for device {}: {:?}", device.device_id, e);
+                eprintln!("Failed to compress image for device {}: {}", device.device_id, e);
                 error_count += 1;
                 continue;
             }
         };
 
+        // Keep the frame itself too: devices that send their decoder limits get heatshrink tuned to the frame, which
+        // we can only pick once we know them.
+        let raw_path = format!("{}/{}.raw", IMAGE_FILES_DIR, device.device_id);
+        if let Err(e) = fs::write(&raw_path, &raw_img) {
+            eprintln!("Failed to write raw image for device {}: {}", device.device_id, e);
+            let _ = fs::remove_file(&raw_path);
+        }
+
+        // Also keep a row RLE encoding, for devices that can take it - the image request picks the smaller one.
+        let rle_path = format!("{}/{}.rle", IMAGE_FILES_DIR, device.device_id);
+        match encode_row_rle(&raw_img, display_type.get_row_bytes(), display_type.get_num_planes()) {
+            Ok(rle) => {
+                println!("Row RLE encoding for device {}: {} bytes (heatshrink: {})", device.device_id, rle.len(), compressed.len());
+                if let Err(e) = fs::write(&rle_path, rle) {
+                    eprintln!("Failed to write row RLE image for device {}: {}", device.device_id, e);
+                }
+            }
+            Err(e) => {
+                eprintln!("Failed to row RLE encode image for device {}: {}", device.device_id, e);
+                let _ = fs::remove_file(&rle_path);
+            }
+        }
+
         // Save to device-specific file
         let file_path = format!("{}/{}.bin", IMAGE_FILES_DIR, device.device_id);
-        match fs::write(&file_path, compressed) {
+        match fs::write(&file_path, &compressed) {
             Ok(_) => {
                 println!("Compressed image saved to: {} ({} bytes)", file_path, compressed.len());
                 success_count += 1;
@@ -96,7 +123,23 @@ async fn fetch_and_compress_images_for_all_devices(db: Arc<dyn Database + Send +
 
 
 struct CoapHandler {
-    business: BusinessImpl
+    business: BusinessImpl,
+    // Per device, the last frame we searched heatshrink parameters for. The search runs a few dozen encodes, so it
+    // only happens again when the frame or the device's limits change.
+    tuned_heatshrink: Mutex<HashMap<u64, TunedHeatshrink>>,
+}
+
+struct TunedHeatshrink {
+    raw_hash: [u8; 8],
+    max_window: u8,
+    max_lookahead: u8,
+    encoded: Arc<Vec<u8>>, // Parameter byte, then the stream.
+}
+
+// What to send back for an image request.
+enum ImageResponse {
+    Content { body: Vec<u8>, etag: [u8; 8] },
+    NotModified { etag: [u8; 8] }, // The device already shows this image - reply 2.03 Valid with no payload.
 }
 
 const FW_DIRECTORY: &str = "fw/";
@@ -120,6 +163,11 @@ impl RequestHandler for CoapHandler {
         for (oid, data) in request.message.options() {
             println!("Got option: {}, data: {:#?}", oid, data);
         }
+        if let Some(size) = request.message.get_option(CoapOption::Block2)
+            .and_then(|opts| opts.front())
+            .and_then(|opt| block2_size(opt)) {
+            println!("Device wants {} byte blocks", size);
+        }
 
         // mux the request based on path, calling out to other methods.
         let path = request.get_path();
@@ -143,7 +191,18 @@ impl RequestHandler for CoapHandler {
                         }
                     }
                 } else if path.starts_with("fw/") {
-                    let resp = self.handle_firmware_request(&path).await;
+                    let query = match request.message.get_option(CoapOption::UriQuery) {
+                        Some(queries) => firmware_offset(queries)
+                            .and_then(|offset| Ok((offset, firmware_delta_base(queries)?))),
+                        None => Ok((0, None)),
+                    };
+                    // Devices send their heartbeat request along, which says what they can decode.
+                    let protocol_version = ciborium::from_reader::<DeviceHeartbeatRequest, _>(&request.message.payload[..])
+                        .map_or(1, |hb| hb.protocol_version);
+                    let resp = match query {
+                        Ok((offset, delta_base)) => self.handle_firmware_request(&path, offset, delta_base, protocol_version).await,
+                        Err(e) => Err(e),
+                    };
                     match resp {
                         Ok(body) => {
                             println!("Responding OK with {} bytes", body.len());
@@ -159,12 +218,20 @@ impl RequestHandler for CoapHandler {
                         }
                     }
                 } else if path == "img" {
-                    let resp = self.handle_image_request(request.message.payload.clone()).await;
+                    let device_etag = request.message.get_option(CoapOption::ETag)
+                        .and_then(|etags| etags.front().cloned());
+                    let resp = self.handle_image_request(request.message.payload.clone(), device_etag).await;
                     match resp {
-                        Ok(body) => {
+                        Ok(ImageResponse::Content { body, etag }) => {
                             println!("Responding OK with {} bytes", body.len());
+                            message.message.add_option(CoapOption::ETag, etag.to_vec());
                             message.message.payload = body;
                         },
+                        Ok(ImageResponse::NotModified { etag }) => {
+                            println!("Image unchanged, responding Valid");
+                            message.set_status(ResponseType::Valid);
+                            message.message.add_option(CoapOption::ETag, etag.to_vec());
+                        },
                         Err(BusinessError::BadRequest(e)) => {
                             println!("Bad request: {:?} ", e);
                             message.set_status(ResponseType::BadRequest);
@@ -188,7 +255,8 @@ impl RequestHandler for CoapHandler {
 }
 
 impl CoapHandler {
-    async fn handle_image_request(&self, req: Vec<u8>) -> Result<Vec<u8>, BusinessError> {
+    // device_etag is the ETag the device sent for the image it currently shows, if any.
+    async fn handle_image_request(&self, req: Vec<u8>, device_etag: Option<Vec<u8>>) -> Result<ImageResponse, BusinessError> {
         let r: DeviceImageRequest = match ciborium::from_reader(&req[..]) {
             Ok(r) => r,
             Err(e) => {
@@ -208,11 +276,104 @@ impl CoapHandler {
             BusinessError::InternalError(anyhow!("Image file not found for device {}: {}", r.device_id, e))
         })?;
 
-        println!("Serving image file {} ({} bytes) to device {}", file_path, compressed_img.len(), r.device_id);
-        Ok(compressed_img)
+        let mut others = Vec::new();
+        // Optional - only written when the frame could be row RLE encoded.
+        if let Ok(rle_img) = fs::read(format!("{}/{}.rle", IMAGE_FILES_DIR, r.device_id)) {
+            others.push((CODEC_ROW_RLE, rle_img));
+        }
+        // The decoded frame - tunes heatshrink and gives the CRC trailer.
+        let raw_img = fs::read(format!("{}/{}.raw", IMAGE_FILES_DIR, r.device_id)).ok();
+        if let Some(tuned) = self.tuned_heatshrink(&r, raw_img.as_deref()).await {
+            others.push((CODEC_HEATSHRINK_PARAMS, tuned.to_vec()));
+        }
+        let mut body = select_payload(r.codecs, compressed_img, others);
+
+        if r.frame_crc {
+            let raw_img = raw_img.ok_or_else(|| {
+                eprintln!("No raw image for device {} to CRC", r.device_id);
+                BusinessError::InternalError(anyhow!("Raw image not found for device {}", r.device_id))
+            })?;
+            body.extend_from_slice(&frame_crc32(&raw_img).to_le_bytes());
+        }
+
+        // The ETag covers the payload as sent, codec byte and CRC included, since that's what the device hashes.
+        let etag = content_etag(&body);
+        if device_etag.as_deref() == Some(&etag[..]) {
+            println!("Device {} already has image file {}", r.device_id, file_path);
+            return Ok(ImageResponse::NotModified { etag });
+        }
+
+        println!("Serving image for {} ({} bytes, codec {:?}) to device {}", file_path, body.len(),
+                 r.codecs.map(|_| body[0]), r.device_id);
+        Ok(ImageResponse::Content { body, etag })
+    }
+
+    // Heatshrink with the parameters that suit this device's frame best, if it can take them.
+    async fn tuned_heatshrink(&self, r: &DeviceImageRequest, raw_img: Option<&[u8]>) -> Option<Arc<Vec<u8>>> {
+        let (max_window, max_lookahead) = match (r.codecs, r.hs_window, r.hs_lookahead) {
+            (Some(codecs), Some(w), Some(l)) if codec_supported(codecs, CODEC_HEATSHRINK_PARAMS) => (w, l),
+            _ => return None,
+        };
+        let raw_hash = content_etag(raw_img?);
+
+        if let Some(t) = self.tuned_heatshrink.lock().unwrap().get(&r.device_id) {
+            if t.raw_hash == raw_hash && t.max_window == max_window && t.max_lookahead == max_lookahead {
+                return Some(t.encoded.clone());
+            }
+        }
+
+        let raw_img = raw_img?.to_vec();
+        let started = time::Instant::now();
+        let encoded = match tokio::task::spawn_blocking(move || encode_heatshrink_best(&raw_img, max_window, max_lookahead)).await {
+            Ok(Ok(e)) => Arc::new(e),
+            Ok(Err(e)) => {
+                eprintln!("Failed to tune heatshrink for device {}: {}", r.device_id, e);
+                return None;
+            }
+            Err(e) => {
+                eprintln!("Heatshrink search for device {} panicked: {}", r.device_id, e);
+                return None;
+            }
+        };
+        println!("Tuned heatshrink for device {}: window {}, lookahead {}, {} bytes in {:?}", r.device_id,
+                 encoded[0] >> 4, encoded[0] & 0x0F, encoded.len() - 1, started.elapsed());
+
+        self.tuned_heatshrink.lock().unwrap().insert(r.device_id, TunedHeatshrink {
+            raw_hash, max_window, max_lookahead, encoded: encoded.clone(),
+        });
+        Some(encoded)
+    }
+
+    // offset is where a device resuming an interrupted download got to - it gets the rest of the image.
+    // delta_base is the firmware a device is running when it can apply a delta (fw_delta.rs) against it instead. It
+    // gets one if we still have that firmware and the delta comes out smaller. Deltas aren't resumed, so a device
+    // only asks for one from the start.
+    // Whichever it gets comes compressed if the device's protocol_version says it can take that and it helps.
+    async fn handle_firmware_request(&self, urlpath: &str, offset: usize, delta_base: Option<u32>, protocol_version: u8) -> Result<Vec<u8>, BusinessError> {
+        let body = self.firmware_body(urlpath, offset, delta_base).await?;
+        if protocol_version < COMPRESSED_FIRMWARE_PROTOCOL {
+            return Ok(body);
+        }
+
+        let (body, compressed) = tokio::task::spawn_blocking(move || {
+            let compressed = compress_firmware(&body);
+            (body, compressed)
+        }).await.map_err(|e| BusinessError::InternalError(anyhow!("firmware compression panicked: {}", e)))?;
+        match compressed {
+            Ok(compressed) if compressed.len() < body.len() => {
+                println!("Compressed firmware to {} bytes from {}", compressed.len(), body.len());
+                Ok(compressed)
+            },
+            Ok(_) => Ok(body),
+            Err(e) => {
+                println!("Failed to compress firmware, sending it as is: {:?}", e);
+                Ok(body)
+            }
+        }
     }
 
-    async fn handle_firmware_request(&self, urlpath: &str) -> Result<Vec<u8>, BusinessError> {
+    // The image (or the rest of it, from offset), or a delta, as handle_firmware_request describes.
+    async fn firmware_body(&self, urlpath: &str, offset: usize, delta_base: Option<u32>) -> Result<Vec<u8>, BusinessError> {
         let binpath = match urlpath.split_once("fw/") {
             Some((_, fwver)) => {
                 if fwver.contains("/") || fwver.contains("..") {
@@ -229,10 +390,30 @@ impl CoapHandler {
             }
         };
 
-        println!("Sending {:?}", binpath);
-
-        match fs::read(binpath) {
-            Ok(b) => Ok(b),
+        println!("Sending {:?} from {}", binpath, offset);
+
+        match fs::read(&binpath) {
+            Ok(mut b) => {
+                if let (Some(base), 0) = (delta_base, offset) {
+                    let to = binpath.file_name().unwrap_or_default().to_string_lossy().into_owned();
+                    let delta = tokio::task::spawn_blocking(move || fw_delta::cached_delta(Path::new(FW_DIRECTORY), &format!("{:08x}.bin", base), &to)).await
+                        .map_err(|e| anyhow!("delta task panicked: {}", e))
+                        .and_then(|r| r);
+                    match delta {
+                        Ok(Some(delta)) if delta.len() < b.len() => {
+                            println!("Sending a {} byte delta from {:08x} instead of {} bytes", delta.len(), base, b.len());
+                            return Ok(delta);
+                        },
+                        Ok(_) => {},
+                        Err(e) => println!("Failed to make firmware delta from {:08x}: {:?}", base, e),
+                    }
+                }
+                if offset > b.len() {
+                    return Err(BusinessError::BadRequest(anyhow!("offset {} is past the end of the image ({} bytes)", offset, b.len())));
+                }
+                b.drain(..offset);
+                Ok(b)
+            },
             Err(e) => {
                 Err(BusinessError::InternalError(e.into()))
             }
@@ -291,6 +472,13 @@ fn main() {
             eprintln!("Failed to fetch initial images: {}", e);
         }
 
+        // Deltas between the firmware we have, so the first device to upgrade doesn't wait on one.
+        tokio::task::spawn_blocking(|| {
+            if let Err(e) = fw_delta::cache_all_deltas(Path::new(FW_DIRECTORY)) {
+                eprintln!("Failed to make firmware deltas: {}", e);
+            }
+        });
+
         // Start periodic image fetching task
         let db_for_task = shared_db.clone();
         tokio::spawn(async move {
@@ -311,7 +499,8 @@ fn main() {
         let coap_handler = CoapHandler {
             business: BusinessImpl {
                 db: shared_db.clone(),
-            }
+            },
+            tuned_heatshrink: Mutex::new(HashMap::new()),
         };
 
         // Create HTTP server
@@ -29,6 +29,8 @@ pub struct CreateDeviceRequest {
     pub image_url: Option<String>,
     pub display_type: Option<DisplayType>,
     pub rotation: Option<Rotation>,
+    pub min_checkin_interval: Option<i32>, // Bounds for adaptive check-in; see checkin.rs.
+    pub max_checkin_interval: Option<i32>,
 }
 
 #[derive(Debug, Serialize, Deserialize)]
@@ -40,6 +42,8 @@ pub struct UpdateDeviceRequest {
     pub image_url: Option<String>,
     pub display_type: Option<DisplayType>,
     pub rotation: Option<Rotation>,
+    pub min_checkin_interval: Option<i32>, // 0 turns adaptive check-in off.
+    pub max_checkin_interval: Option<i32>,
 }
 
 #[derive(Debug, Serialize, Deserialize)]
@@ -122,6 +126,22 @@ async fn create_device(
         image_url: request.image_url,
         display_type: request.display_type,
         rotation: request.rotation.unwrap_or(Rotation::ROTATE_0),
+        last_refresh_ms: 0,
+        attach_ms: 0,
+        parent_rloc16: None,
+        parent_rssi: 0,
+        net_ms: 0,
+        net_retransmits: 0,
+        net_bytes_per_sec: 0,
+        min_checkin_interval: request.min_checkin_interval.filter(|&i| i > 0),
+        max_checkin_interval: request.max_checkin_interval.filter(|&i| i > 0),
+        image_hash: None,
+        image_changed_at: None,
+        image_change_interval: 0,
+        vbat_ref_mv: 0,
+        vbat_ref_at: None,
+        vbat_trend_mv_per_day: 0,
+        next_checkin_interval: 0,
     };
 
     state.db.create_device_state(&device_state).await?;
@@ -151,6 +171,13 @@ async fn update_device(
         device.checkin_interval = interval;
     }
 
+    if let Some(interval) = request.min_checkin_interval {
+        device.min_checkin_interval = Some(interval).filter(|&i| i > 0);
+    }
+    if let Some(interval) = request.max_checkin_interval {
+        device.max_checkin_interval = Some(interval).filter(|&i| i > 0);
+    }
+
     if request.image_url.is_some() {
         device.image_url = request.image_url;
     }
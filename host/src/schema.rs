@@ -33,5 +33,21 @@ diesel::table! {
         image_url -> Nullable<Varchar>,
         display_type -> Nullable<DisplayType>,
         rotation -> Rotation,
+        last_refresh_ms -> Int4,
+        attach_ms -> Int4,
+        parent_rloc16 -> Nullable<Int4>,
+        parent_rssi -> Int4,
+        net_ms -> Int4,
+        net_retransmits -> Int4,
+        net_bytes_per_sec -> Int4,
+        min_checkin_interval -> Nullable<Int4>,
+        max_checkin_interval -> Nullable<Int4>,
+        image_hash -> Nullable<Int8>,
+        image_changed_at -> Nullable<Timestamptz>,
+        image_change_interval -> Int4,
+        vbat_ref_mv -> Int4,
+        vbat_ref_at -> Nullable<Timestamptz>,
+        vbat_trend_mv_per_day -> Int4,
+        next_checkin_interval -> Int4,
     }
 }
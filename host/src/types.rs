@@ -82,6 +82,24 @@ impl DisplayType {
             DisplayType::EPD_TYPE_WS_75_V2B => PixelFormat::Kw1Bit,    // 7.5" 2-color + red
         }
     }
+    // Bytes in one row of a plane, as packed by the image fetcher.
+    pub fn get_row_bytes(&self) -> usize {
+        let (width, _) = self.get_display_dimensions();
+        match self.get_pixel_format() {
+            PixelFormat::Kw1Bit => width.div_ceil(8) as usize,
+            PixelFormat::Rykw2Bit => width.div_ceil(4) as usize,
+        }
+    }
+    // Number of RAM planes the firmware streams into, one after another. Must match num_planes in the firmware driver.
+    pub fn get_num_planes(&self) -> usize {
+        match self {
+            DisplayType::EPD_TYPE_GDEY029T71H => 2,  // "current" (0x24) and "previous" (0x26) RAM
+            DisplayType::EPD_TYPE_GDEM035F51 => 1,
+            DisplayType::EPD_TYPE_GDEY029F51 => 1,
+            DisplayType::EPD_TYPE_GDEM075F52 => 1,
+            DisplayType::EPD_TYPE_WS_75_V2B => 1,
+        }
+    }
 }
 
 impl ToSql<DisplayTypeSqlType, Pg> for DisplayType {
@@ -153,6 +171,8 @@ impl FromSql<RotationSqlType, Pg> for Rotation {
 #[derive(Debug, PartialEq, Eq, Clone, Queryable, Insertable, AsChangeset, Identifiable, Serialize, Deserialize)]
 #[diesel(table_name = device_states)]
 #[diesel(primary_key(device_id))]
+// Updates save the whole row, so a None has to clear its column (e.g. adaptive check-in being turned off).
+#[diesel(treat_none_as_null = true)]
 pub struct DeviceState {
     pub device_id: i64, // A unique identifier for this device. This is a good choice for primary key.
     pub device_friendly_name: String,
@@ -166,4 +186,22 @@ pub struct DeviceState {
     pub image_url: Option<String>, // URL from which to fetch the image for this device
     pub display_type: Option<DisplayType>, // The type of e-paper display attached to this device
     pub rotation: Rotation, // Display rotation in degrees (0, 90, 180, 270)
+    pub last_refresh_ms: i32, // How long the most recent full display refresh took, as reported by the device. 0 until it reports one.
+    // The network cost of the device's most recent reported wake (see NetStats in business.rs). 0 until it reports one.
+    pub attach_ms: i32, // Time to attach to a Thread parent. 0 if it never did.
+    pub parent_rloc16: Option<i32>, // The parent it attached to, so parents can be compared across devices.
+    pub parent_rssi: i32,
+    pub net_ms: i32, // Total time spent waiting on CoAP requests.
+    pub net_retransmits: i32,
+    pub net_bytes_per_sec: i32,
+    // Adaptive check-in (see checkin.rs). Without both bounds, the device always checks in every checkin_interval.
+    pub min_checkin_interval: Option<i32>,
+    pub max_checkin_interval: Option<i32>,
+    pub image_hash: Option<i64>, // content_etag of the last frame the image pipeline made for this device.
+    pub image_changed_at: Option<DateTime<Utc>>, // When that frame first appeared.
+    pub image_change_interval: i32, // Smoothed seconds between frame changes. 0 until we've seen one.
+    pub vbat_ref_mv: i32, // Where the battery trend is being measured from.
+    pub vbat_ref_at: Option<DateTime<Utc>>,
+    pub vbat_trend_mv_per_day: i32,
+    pub next_checkin_interval: i32, // The interval the device was given at its last heartbeat. 0 until it has one.
 }
\ No newline at end of file
@@ -10,7 +10,7 @@
 // This is not integrated into the graphics subsystem (those drivers exist already for many displays).
 // I want to support a very specific use case:
 // - Support for the weird n-bit-per-pixel color spaces (including the really weird ones with 1bpp but across multiple color planes)
-// - I will write all of the data for the display in chunks, but in one linear pass (this can be extended in the future for partial writes or offsets)
+// - I will write all of the data for the display in chunks, in one linear pass - or for panels that support it, one linear pass per rectangular window.
 // - I want to dynamically (i.e. at _runtime_) select which display will be used. This allows me to use the same board and firmware image on lots of different displays.
 // Chances are, you don't want to use this driver - use the perfectly good display drivers already in the zephyr tree.
 // This is really only useful for a project where the whole point is just to "be" an epaper display, and you want to be able to swap them in and out with ease.
@@ -20,11 +20,46 @@ typedef int (*epd_cmd_t)(const struct device *dev);
 // Some epds have multiple display planes (i.e. one for black/white and another for red/white)
 #define EPD_DISPLAY_PLANE_MAIN 1
 
+// Capabilities a display may support, reported in epd_dimensions.capabilities.
+#define EPD_CAP_PARTIAL_WINDOW (1 << 0) // Can write a rectangular window of RAM with epd_start_write_window.
+#define EPD_CAP_PARTIAL_REFRESH (1 << 1) // Can refresh just the written window with epd_do_partial_refresh.
+
 struct epd_dimensions {
     int width;
     int height;
     int planes;
-    size_t expected_data_size;
+    int bits_per_pixel;
+    uint32_t capabilities;
+    size_t expected_data_size; // All planes together.
+    size_t plane_data_size; // Bytes in each plane. Multi-plane images carry plane 0, then plane 1, etc.
+};
+
+// Counters for frame data written since the last epd_power_on.
+struct epd_transfer_stats {
+    uint32_t bytes_written;
+    uint32_t transfer_time_us; // time spent inside SPI writes, not including decode/network time.
+};
+
+// Phases of a display update, from epd_power_on through epd_power_off.
+enum epd_phase {
+    EPD_PHASE_POWER_ON = 0, // epd_power_on, including the panel's init sequence.
+    EPD_PHASE_TRANSFER = 1, // From the end of power on until the refresh starts - frame data, plus whatever the caller does in between.
+    EPD_PHASE_REFRESH = 2, // epd_do_refresh / epd_do_partial_refresh, mostly waiting on BUSY.
+    EPD_PHASE_POWER_OFF = 3, // epd_power_off.
+    EPD_PHASE_COUNT
+};
+
+struct epd_phase_timing {
+    uint32_t time_us;
+    uint32_t bytes; // Everything sent over SPI during the phase, commands included.
+};
+
+// Timing for one complete display update. The driver keeps the last CONFIG_GENERIC_EPAPER_TIMING_HISTORY of these.
+struct epd_update_timing {
+    uint8_t epd_type;
+    bool partial; // Refreshed with epd_do_partial_refresh.
+    uint32_t spi_time_us; // Time spent inside frame data writes, as in epd_transfer_stats.
+    struct epd_phase_timing phases[EPD_PHASE_COUNT];
 };
 
 typedef enum {
@@ -39,7 +74,20 @@ typedef enum {
 int epd_get_dimensions(const struct device *dev, struct epd_dimensions *dims);
 int epd_set_type(const struct device *dev, epd_type_t typ); // Set the type of the e-paper display. This needs to be called before any of the other methods.
 int epd_power_on(const struct device *dev); // Power up the display and get it ready to draw.
-int epd_start_write_data(const struct device *dev, int plane); // Write data to a specific plane.
+int epd_start_write_data(const struct device *dev, int plane); // Write data to a specific plane. Always the full frame, even after a window write.
+// Write data to a rectangular window of a specific plane. x and w are in pixels along a data row and must be byte-aligned;
+// y and h are in rows. These are the controller's RAM coordinates, which for some panels are width and height swapped.
+// The window then takes (w * h * bits_per_pixel / 8) bytes via epd_continue_write_data. Call again for each plane.
+// Only supported if EPD_CAP_PARTIAL_WINDOW is set.
+int epd_start_write_window(const struct device *dev, int plane, uint16_t x, uint16_t y, uint16_t w, uint16_t h);
 int epd_continue_write_data(const struct device *dev, uint8_t *data, size_t data_len);
+// Start writing data without waiting for it to go out. data must stay untouched until the next call to
+// epd_continue_write_data_async or epd_wait_write_data. Falls back to a blocking write without CONFIG_SPI_ASYNC.
+int epd_continue_write_data_async(const struct device *dev, const uint8_t *data, size_t data_len);
+int epd_wait_write_data(const struct device *dev); // Wait for an outstanding async write to finish, returning its result.
+int epd_get_transfer_stats(const struct device *dev, struct epd_transfer_stats *stats); // Read the byte and time counters for data written so far.
 int epd_do_refresh(const struct device *dev); // Complete the write and refresh the display.
-int epd_power_off(const struct device *dev); // Shut down the display, will disable power at the right moment as well.
\ No newline at end of file
+int epd_do_partial_refresh(const struct device *dev); // Refresh only the window written with epd_start_write_window. Needs EPD_CAP_PARTIAL_REFRESH.
+int epd_power_off(const struct device *dev); // Shut down the display, will disable power at the right moment as well.
+// Read back the timing of a completed update. index 0 is the most recent; returns -ENOENT past the oldest one kept.
+int epd_get_update_timing(const struct device *dev, size_t index, struct epd_update_timing *timing);
\ No newline at end of file
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <zephyr/drivers/emul.h>
+
+// Emulated e-paper controller for native_sim, sitting on a zephyr,spi-emul-controller bus with gpio-emul pins.
+// It decodes the command stream (DC low = command byte, DC high = data), records whatever lands in frame RAM,
+// and holds BUSY for a set time after the commands that would keep a real panel busy (refresh, power on, ...).
+// Which commands do what differs between controllers, so tests describe the panel with an epd_emul_profile.
+
+#define EPD_EMUL_MAX_PLANES 2
+// Parameter bytes kept for each command.
+#define EPD_EMUL_MAX_PARAMS 16
+
+struct epd_emul_busy_cmd {
+    uint8_t cmd;
+    uint32_t busy_ms;
+};
+
+struct epd_emul_profile {
+    uint8_t num_planes;
+    uint8_t ram_cmds[EPD_EMUL_MAX_PLANES]; // Command that writes each plane's RAM, in plane order.
+    const struct epd_emul_busy_cmd *busy_cmds; // Must stay valid for as long as the profile is in use.
+    size_t num_busy_cmds;
+};
+
+struct epd_emul_stats {
+    uint32_t transactions; // SPI transactions seen, commands and data together.
+    uint32_t commands;
+    uint32_t data_bytes;
+    uint32_t busy_periods; // Times BUSY was asserted.
+    uint32_t ram_overflow_bytes; // Frame data that didn't fit in the emulated RAM.
+};
+
+// Switch to a new panel profile. Also clears frame RAM and stats, and releases BUSY.
+void epd_emul_set_profile(const struct emul *target, const struct epd_emul_profile *profile);
+// Frame RAM for a plane, and how many bytes were written to it since its RAM command was last sent.
+int epd_emul_get_plane(const struct emul *target, int plane, const uint8_t **buf, size_t *len);
+void epd_emul_get_stats(const struct emul *target, struct epd_emul_stats *stats);
+// Parameters last sent with CMD (at most EPD_EMUL_MAX_PARAMS of them). Returns where in the command stream that
+// was - the value stats.commands had just after it - or 0 if CMD hasn't been sent since the profile was set.
+uint32_t epd_emul_get_params(const struct emul *target, uint8_t cmd, const uint8_t **params, size_t *len);
@@ -17,7 +17,7 @@ int encode_image_request(const struct image_request *req, uint8_t *buffer, size_
 
     ZCBOR_STATE_E(states, 4, buffer, buffer_size, 1);
 
-    success = zcbor_map_start_encode(states, 3);
+    success = zcbor_map_start_encode(states, 7);
     if (!success) {
         return -ENOMEM;
     }
@@ -41,8 +41,28 @@ int encode_image_request(const struct image_request *req, uint8_t *buffer, size_
         return -ENOMEM;
     }
 
+    success = zcbor_tstr_put_lit(states, "codecs") &&
+              zcbor_uint32_put(states, req->codecs);
+    if (!success) {
+        return -ENOMEM;
+    }
+
+    success = zcbor_tstr_put_lit(states, "hs_window") &&
+              zcbor_uint32_put(states, req->hs_window) &&
+              zcbor_tstr_put_lit(states, "hs_lookahead") &&
+              zcbor_uint32_put(states, req->hs_lookahead);
+    if (!success) {
+        return -ENOMEM;
+    }
+
+    success = zcbor_tstr_put_lit(states, "frame_crc") &&
+              zcbor_bool_put(states, req->frame_crc);
+    if (!success) {
+        return -ENOMEM;
+    }
+
     /* End the map */
-    success = zcbor_map_end_encode(states, 4);
+    success = zcbor_map_end_encode(states, 7);
     if (!success) {
         return -ENOMEM;
     }
@@ -70,8 +90,8 @@ int encode_heartbeat_request(const struct device_heartbeat_request *req,
 
     ZCBOR_STATE_E(states, 4, buffer, buffer_size, 1);
 
-    /* Start encoding a map with 3 key-value pairs */
-    success = zcbor_map_start_encode(states, 4);
+    /* Start encoding a map with up to 6 key-value pairs */
+    success = zcbor_map_start_encode(states, 6);
     if (!success) {
         return -ENOMEM;
     }
@@ -104,8 +124,68 @@ int encode_heartbeat_request(const struct device_heartbeat_request *req,
         return -ENOMEM;
     }
 
+    /* Encode the timing of the last display update, as a nested map */
+    if (req->has_display_timing) {
+        const struct epd_update_timing *t = &req->display_timing;
+        success = zcbor_tstr_put_lit(states, "display_timing") &&
+                  zcbor_map_start_encode(states, 9) &&
+                  zcbor_tstr_put_lit(states, "epd_type") &&
+                  zcbor_uint32_put(states, t->epd_type) &&
+                  zcbor_tstr_put_lit(states, "partial") &&
+                  zcbor_bool_put(states, t->partial) &&
+                  zcbor_tstr_put_lit(states, "power_on_us") &&
+                  zcbor_uint32_put(states, t->phases[EPD_PHASE_POWER_ON].time_us) &&
+                  zcbor_tstr_put_lit(states, "transfer_us") &&
+                  zcbor_uint32_put(states, t->phases[EPD_PHASE_TRANSFER].time_us) &&
+                  zcbor_tstr_put_lit(states, "refresh_us") &&
+                  zcbor_uint32_put(states, t->phases[EPD_PHASE_REFRESH].time_us) &&
+                  zcbor_tstr_put_lit(states, "power_off_us") &&
+                  zcbor_uint32_put(states, t->phases[EPD_PHASE_POWER_OFF].time_us) &&
+                  zcbor_tstr_put_lit(states, "spi_us") &&
+                  zcbor_uint32_put(states, t->spi_time_us) &&
+                  zcbor_tstr_put_lit(states, "init_bytes") &&
+                  zcbor_uint32_put(states, t->phases[EPD_PHASE_POWER_ON].bytes) &&
+                  zcbor_tstr_put_lit(states, "transfer_bytes") &&
+                  zcbor_uint32_put(states, t->phases[EPD_PHASE_TRANSFER].bytes) &&
+                  zcbor_map_end_encode(states, 9);
+        if (!success) {
+            return -ENOMEM;
+        }
+    }
+
+    /* Encode the previous wake's network stats, as nested arrays */
+    if (req->has_net_stats) {
+        const struct net_stats *n = &req->net_stats;
+        success = zcbor_tstr_put_lit(states, "net") &&
+                  zcbor_list_start_encode(states, 7) &&
+                  zcbor_uint32_put(states, n->attach_ms) &&
+                  zcbor_uint32_put(states, n->parent_rloc16) &&
+                  zcbor_int32_put(states, n->parent_rssi) &&
+                  zcbor_uint32_put(states, n->parent_lq_in) &&
+                  zcbor_uint32_put(states, n->parent_lq_out) &&
+                  zcbor_uint32_put(states, n->srtt_ms) &&
+                  zcbor_list_start_encode(states, NET_STATS_MAX_TRANSFERS);
+        for (size_t i = 0; success && i < MIN(n->num_transfers, NET_STATS_MAX_TRANSFERS); i++) {
+            const struct net_transfer *t = &n->transfers[i];
+            success = zcbor_list_start_encode(states, 6) &&
+                      zcbor_uint32_put(states, t->kind) &&
+                      zcbor_int32_put(states, t->result) &&
+                      zcbor_uint32_put(states, t->bytes) &&
+                      zcbor_uint32_put(states, t->elapsed_ms) &&
+                      zcbor_uint32_put(states, t->replies) &&
+                      zcbor_uint32_put(states, t->retransmits) &&
+                      zcbor_list_end_encode(states, 6);
+        }
+        success = success &&
+                  zcbor_list_end_encode(states, NET_STATS_MAX_TRANSFERS) &&
+                  zcbor_list_end_encode(states, 7);
+        if (!success) {
+            return -ENOMEM;
+        }
+    }
+
     /* End the map */
-    success = zcbor_map_end_encode(states, 4);
+    success = zcbor_map_end_encode(states, 6);
     if (!success) {
         return -ENOMEM;
     }
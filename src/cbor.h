@@ -1,17 +1,60 @@
 #pragma once
 
+#include <stdbool.h>
+#include <drivers/generic_epaper.h>
+
 /* Structure definitions matching the Rust types */
+
+// What one request of a wake cost on the network.
+enum net_transfer_kind {
+    NET_TRANSFER_HEARTBEAT = 0,
+    NET_TRANSFER_FIRMWARE = 1,
+    NET_TRANSFER_IMAGE = 2,
+};
+
+struct net_transfer {
+    uint8_t kind;
+    int8_t result; // coap_request_result_t
+    uint32_t bytes;
+    uint32_t elapsed_ms;
+    uint16_t replies; // One per block, for a blockwise download.
+    uint16_t retransmits;
+};
+
+#define NET_STATS_MAX_TRANSFERS 4
+
+// How the network behaved on a wake. We hibernate in between, so it's saved and sent in the next wake's heartbeat.
+// It goes as CBOR arrays rather than maps to keep the heartbeat small, so the order of the fields matters.
+struct net_stats {
+    uint32_t attach_ms; // From starting OpenThread to attaching, or 0 if we never did.
+    uint16_t parent_rloc16;
+    int8_t parent_rssi; // Average, in dBm.
+    uint8_t parent_lq_in; // Link quality (0-3) from and to the parent.
+    uint8_t parent_lq_out;
+    uint32_t srtt_ms; // CoAP round trip estimate at the end of the wake, 0 if there wasn't one.
+    uint8_t num_transfers;
+    struct net_transfer transfers[NET_STATS_MAX_TRANSFERS];
+};
+
 struct device_heartbeat_request {
     uint64_t device_id;
     uint32_t current_firmware;
     uint8_t protocol_version;
     int32_t vbat_mv;
+    bool has_display_timing; // Only sent when there's a previous update to report.
+    struct epd_update_timing display_timing;
+    bool has_net_stats; // Only sent when the previous wake saved some.
+    struct net_stats net_stats;
 };
 
 struct image_request {
     uint64_t device_id;
     uint8_t epd_type;
     uint32_t expected_data_size;
+    uint32_t codecs; // Bitmask of the image codecs we can decode, see image_codec.h.
+    uint8_t hs_window; // Largest heatshrink window and lookahead (in bits) we can decode.
+    uint8_t hs_lookahead;
+    bool frame_crc; // Ask the host to end the image with a CRC32 of the decoded frame.
 };
 
 struct device_heartbeat_response {
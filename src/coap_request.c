@@ -2,6 +2,7 @@
 #include <zephyr/net/socket.h>
 #include <zephyr/net/coap_client.h>
 #include <zephyr/logging/log.h>
+#include <zephyr/sys/util.h>
 #include <errno.h>
 #include <string.h>
 
@@ -9,42 +10,186 @@
 
 LOG_MODULE_REGISTER(coap_request, LOG_LEVEL_INF);
 
-struct coap_request_context {
-    struct k_sem completion_sem;
-    coap_stream_callback_t stream_cb;
-    void *user_data;
-    coap_request_result_t result;
-    size_t current_offset;
-    int sockfd;
-    bool callback_aborted;
-    struct coap_client *client;
-};
+// Bounds on the retransmission timeout we derive from the session's round trips. RFC 6298 puts the floor at a
+// second; the ceiling keeps one bad sample from stalling a whole wake.
+#define COAP_SESSION_MIN_ACK_TIMEOUT_MS 1000
+#define COAP_SESSION_MAX_ACK_TIMEOUT_MS 8000
 
-static void internal_coap_callback(int16_t result_code, size_t offset, const uint8_t *payload,
-                                 size_t len, bool last_block, void *user_data)
+// How long coap_request_wait gives a reply already in the stream callback to come out of it.
+#define COAP_REQUEST_CALLBACK_DRAIN_MS 10000
+
+// Guards every request's in_callback count. It lives out here rather than in the request, so that the last one out
+// of internal_coap_callback can still let go of it after the waiter has returned and the request is gone.
+static struct k_spinlock callback_lock;
+
+int coap_session_open(struct coap_session *session, struct coap_client *client, const struct sockaddr *server_addr)
+{
+    if (!session || !client || !server_addr) {
+        return -EINVAL;
+    }
+
+    *session = (struct coap_session){
+        .client = client,
+        .server_addr = *server_addr,
+    };
+    session->sockfd = zsock_socket(server_addr->sa_family, SOCK_DGRAM, 0);
+    if (session->sockfd < 0) {
+        LOG_ERR("Failed to create socket: %d", errno);
+        return -errno;
+    }
+    return 0;
+}
+
+void coap_session_close(struct coap_session *session)
+{
+    if (session->sockfd >= 0) {
+        zsock_close(session->sockfd);
+        session->sockfd = -1;
+    }
+}
+
+uint32_t coap_session_ack_timeout(const struct coap_session *session)
+{
+    if (!session->has_rtt) {
+        return CONFIG_COAP_INIT_ACK_TIMEOUT_MS;
+    }
+    return CLAMP(session->srtt_ms + 4 * session->rttvar_ms, COAP_SESSION_MIN_ACK_TIMEOUT_MS,
+                 COAP_SESSION_MAX_ACK_TIMEOUT_MS);
+}
+
+// RFC 6298's smoothed round trip and its variation.
+static void session_rtt_sample(struct coap_session *session, uint32_t rtt_ms)
+{
+    if (!session->has_rtt) {
+        session->srtt_ms = rtt_ms;
+        session->rttvar_ms = rtt_ms / 2;
+        session->has_rtt = true;
+        return;
+    }
+    uint32_t delta = session->srtt_ms > rtt_ms ? session->srtt_ms - rtt_ms : rtt_ms - session->srtt_ms;
+    session->rttvar_ms = (3 * session->rttvar_ms + delta) / 4;
+    session->srtt_ms = (7 * session->srtt_ms + rtt_ms) / 8;
+}
+
+// Time a reply. Returns true if it took longer than the retransmission timeout, so probably answers a resent
+// request - which (Karn's algorithm) says nothing reliable about the round trip.
+static bool time_reply(struct coap_request *ctx)
+{
+    int64_t now = k_uptime_get();
+    uint32_t elapsed = now - ctx->last_reply_time;
+
+    ctx->last_reply_time = now;
+    ctx->stats.replies++;
+    if (elapsed >= ctx->ack_timeout_ms) {
+        ctx->stats.retransmits++;
+        return true;
+    }
+    session_rtt_sample(ctx->session, elapsed);
+    return false;
+}
+
+// A Block2 option asking for block NUM of size SZX.
+static void set_block2_option(struct coap_client_option *opt, uint32_t num, enum coap_block_size szx)
+{
+    uint32_t value = (num << 4) | szx;
+
+    // Shortest big-endian encoding, zero length for zero.
+    opt->code = COAP_OPTION_BLOCK2;
+    opt->len = 0;
+    for (uint32_t v = value; v > 0; v >>= 8) {
+        opt->len++;
+    }
+    for (int i = 0; i < opt->len; i++) {
+        opt->value[i] = value >> (8 * (opt->len - 1 - i));
+    }
+}
+
+static void track_block(struct coap_request *ctx, size_t offset, size_t len, bool last_block, bool slow)
+{
+    struct coap_blockwise *bw = ctx->blockwise;
+
+    if (!bw) {
+        return;
+    }
+
+    // The first block also waits for the server to prepare the response, so only count the ones after it.
+    bw->blocks++;
+    if (offset > 0 && slow) {
+        bw->slow_blocks++;
+    }
+
+    // Only a block with more after it is sure to be full size.
+    if (!last_block && bw->block_size == 0) {
+        bw->block_size = len;
+    }
+
+    // Our Block2 only asks for the first block's size. coap_client adds its own to the follow-ups, and Block2 is
+    // critical and can't repeat, so ours must not go out again. coap_client resends the request's options as they
+    // are and keeps its own count of them, so the slot can't be dropped - it becomes a Size2 of 0 instead, asking
+    // for the total size, which a server can answer or ignore.
+    //
+    // This leans on the order coap_client builds a follow-up in: the request's options first, Size2 (28) among
+    // them, then its own Block2 (23). That's out of number order, which coap_packet_append_option handles by
+    // inserting the option where it belongs rather than failing. test_block2_follow_up_on_the_wire checks the
+    // bytes that result.
+    if (ctx->block2_opt) {
+        ctx->block2_opt->code = COAP_OPTION_SIZE2;
+        ctx->block2_opt->len = 0;
+        ctx->block2_opt = NULL;
+    }
+}
+
+// Settle the request's result, unless something else got there first: the waiter giving up on it, or an earlier
+// reply. Returns whether this was the one.
+static bool request_finish(struct coap_request *req, coap_request_result_t result)
 {
-    struct coap_request_context *ctx = (struct coap_request_context *)user_data;
+    if (!atomic_cas(&req->finished, 0, 1)) {
+        return false;
+    }
+    req->result = result;
+    k_sem_give(&req->done);
+    return true;
+}
 
+// Stop coap_client following a request it would otherwise carry on with.
+static void request_abandon(struct coap_request *ctx, coap_request_result_t result)
+{
+    if (request_finish(ctx, result)) {
+        // Only this one - others on the session may still be going. coap_client reports the cancel through
+        // internal_coap_callback, which ignores it now the request is finished.
+        coap_client_cancel_request(ctx->session->client, &ctx->client_req);
+    }
+}
+
+static void handle_reply(struct coap_request *ctx, int16_t result_code, size_t offset, const uint8_t *payload,
+                         size_t len, bool last_block)
+{
     LOG_DBG("CoAP callback: code=%d, offset=%zu, len=%zu, last=%s",
             result_code, offset, len, last_block ? "true" : "false");
 
-    if (ctx->callback_aborted) {
-        LOG_DBG("Callback already aborted, ignoring");
+    if (atomic_get(&ctx->finished)) {
+        LOG_DBG("Request already finished, ignoring");
+        return;
+    }
+
+    bool slow = time_reply(ctx);
+
+    if (result_code == COAP_RESPONSE_CODE_VALID) {
+        LOG_INF("Cached copy still valid");
+        request_finish(ctx, COAP_REQUEST_VALID);
         return;
     }
 
     if (result_code != COAP_RESPONSE_CODE_CONTENT) {
         LOG_ERR("CoAP protocol error: %d", result_code);
-        ctx->result = COAP_REQUEST_PROTO_ERROR;
-        k_sem_give(&ctx->completion_sem);
+        request_finish(ctx, COAP_REQUEST_PROTO_ERROR);
         return;
     }
 
     if (offset != ctx->current_offset) {
         LOG_ERR("Out-of-order data: expected offset %zu, got %zu",
                 ctx->current_offset, offset);
-        ctx->result = COAP_REQUEST_PROTO_ERROR;
-        k_sem_give(&ctx->completion_sem);
+        request_abandon(ctx, COAP_REQUEST_PROTO_ERROR);
         return;
     }
 
@@ -52,82 +197,193 @@ static void internal_coap_callback(int16_t result_code, size_t offset, const uin
         int cb_result = ctx->stream_cb(payload, len, offset, last_block, ctx->user_data);
         if (cb_result < 0) {
             LOG_WRN("Stream callback requested abort: %d", cb_result);
-            ctx->callback_aborted = true;
-            ctx->result = COAP_REQUEST_CALLBACK_ABORT;
-            coap_client_cancel_requests(ctx->client);
-            k_sem_give(&ctx->completion_sem);
+            request_abandon(ctx, COAP_REQUEST_CALLBACK_ABORT);
             return;
         }
+        // coap_client only asks for the next block once we return, so time the next reply from here rather than
+        // charging it for however long the stream callback took.
+        ctx->last_reply_time = k_uptime_get();
     }
 
+    track_block(ctx, offset, len, last_block, slow);
     ctx->current_offset = offset + len;
 
     if (last_block) {
         LOG_INF("Transfer complete, %zu bytes", ctx->current_offset);
-        ctx->result = COAP_REQUEST_SUCCESS;
-        k_sem_give(&ctx->completion_sem);
+        request_finish(ctx, COAP_REQUEST_SUCCESS);
     }
 }
 
-coap_request_result_t do_coap_request(struct coap_client *client, struct sockaddr *server_addr,
-                                    const char* path, enum coap_method method, const uint8_t* payload,
-                                    size_t payload_len, coap_stream_callback_t stream_cb,
-                                    void* user_data, uint32_t timeout_seconds)
+// Runs on coap_client's receive thread. coap_request_wait doesn't return until no call is in here, so the request
+// (and whatever the stream callback writes to) can't go away under it.
+static void internal_coap_callback(int16_t result_code, size_t offset, const uint8_t *payload,
+                                 size_t len, bool last_block, void *user_data)
+{
+    struct coap_request *ctx = (struct coap_request *)user_data;
+
+    k_spinlock_key_t key = k_spin_lock(&callback_lock);
+    ctx->in_callback++;
+    k_spin_unlock(&callback_lock, key);
+
+    handle_reply(ctx, result_code, offset, payload, len, last_block);
+
+    // Nothing touches the request after the give: the waiter may return and let go of it straight away.
+    key = k_spin_lock(&callback_lock);
+    if (--ctx->in_callback == 0 && ctx->idle_wanted) {
+        k_sem_give(&ctx->idle);
+    }
+    k_spin_unlock(&callback_lock, key);
+}
+
+void coap_request_submit(struct coap_request *req, struct coap_session *session, const char *path,
+                         enum coap_method method, const uint8_t *payload, size_t payload_len,
+                         struct coap_client_option *options, size_t num_options, struct coap_blockwise *blockwise,
+                         coap_stream_callback_t stream_cb, void *user_data, uint32_t timeout_seconds)
 {
-    struct coap_request_context ctx = {0};
     int ret;
 
-    if (!client || !server_addr || !path) {
-        return COAP_REQUEST_PROTO_ERROR;
+    *req = (struct coap_request){
+        .session = session,
+        .stream_cb = stream_cb,
+        .user_data = user_data,
+        .result = COAP_REQUEST_NETWORK_ERROR,
+        .blockwise = blockwise,
+        .started = k_uptime_get(),
+    };
+    k_sem_init(&req->done, 0, 1);
+    k_sem_init(&req->idle, 0, 1);
+    req->deadline = req->started + (int64_t)timeout_seconds * MSEC_PER_SEC;
+    req->last_reply_time = req->started;
+
+    if (!session || !path) {
+        request_finish(req, COAP_REQUEST_PROTO_ERROR);
+        return;
+    }
+    if (session->sockfd < 0) {
+        request_finish(req, COAP_REQUEST_NETWORK_ERROR);
+        return;
     }
 
-    k_sem_init(&ctx.completion_sem, 0, 1);
-    ctx.stream_cb = stream_cb;
-    ctx.user_data = user_data;
-    ctx.result = COAP_REQUEST_NETWORK_ERROR;
-    ctx.current_offset = 0;
-    ctx.callback_aborted = false;
-    ctx.client = client;
+    if (num_options + (blockwise ? 1 : 0) > ARRAY_SIZE(req->options)) {
+        LOG_ERR("Too many options: %zu", num_options);
+        request_finish(req, COAP_REQUEST_PROTO_ERROR);
+        return;
+    }
+    // coap_client sends the options again with every follow-up block, so they live with the request.
+    if (num_options > 0) {
+        memcpy(req->options, options, num_options * sizeof(*options));
+    }
+    if (blockwise) {
+        req->block2_opt = &req->options[num_options];
+        set_block2_option(req->block2_opt, 0, blockwise->preferred_szx);
+        num_options++;
 
-    ctx.sockfd = zsock_socket(server_addr->sa_family, SOCK_DGRAM, 0);
-    if (ctx.sockfd < 0) {
-        LOG_ERR("Failed to create socket: %d", errno);
-        return COAP_REQUEST_NETWORK_ERROR;
+        blockwise->block_size = 0;
+        blockwise->blocks = 0;
+        blockwise->slow_blocks = 0;
     }
 
-    struct coap_client_request request = {
+    // Start from what this session's earlier requests have taught us about the round trip.
+    struct coap_transmission_parameters params = coap_get_transmission_parameters();
+    req->ack_timeout_ms = coap_session_ack_timeout(session);
+    params.ack_timeout = req->ack_timeout_ms;
+
+    req->client_req = (struct coap_client_request){
         .method = method,
         .confirmable = true,
         .path = path,
         .payload = payload,
         .len = payload_len,
         .cb = internal_coap_callback,
-        .options = NULL,
-        .num_options = 0,
-        .user_data = &ctx
+        .options = num_options > 0 ? req->options : NULL,
+        .num_options = num_options,
+        .user_data = req,
     };
 
-    LOG_INF("Starting CoAP %s request to %s",
+    LOG_INF("Starting CoAP %s request to %s (ACK timeout %u ms)",
             method == COAP_METHOD_GET ? "GET" :
-            method == COAP_METHOD_POST ? "POST" : "OTHER", path);
+            method == COAP_METHOD_POST ? "POST" : "OTHER", path, req->ack_timeout_ms);
 
-    ret = coap_client_req(client, ctx.sockfd, server_addr, &request, NULL);
+    session->requests++;
+    ret = coap_client_req(session->client, session->sockfd, &session->server_addr, &req->client_req, &params);
     if (ret < 0) {
         LOG_ERR("Failed to send CoAP request: %d", ret);
-        zsock_close(ctx.sockfd);
-        return COAP_REQUEST_NETWORK_ERROR;
+        request_finish(req, COAP_REQUEST_NETWORK_ERROR);
     }
+}
 
-    ret = k_sem_take(&ctx.completion_sem, K_SECONDS(timeout_seconds));
+coap_request_result_t coap_request_wait(struct coap_request *req)
+{
+    int64_t remaining = req->deadline - k_uptime_get();
+    int ret = k_sem_take(&req->done, K_MSEC(MAX(remaining, 0)));
 
-    if (ret == -EAGAIN) {
-        LOG_WRN("CoAP request timed out after %u seconds", timeout_seconds);
-        coap_client_cancel_requests(client);
-        ctx.result = COAP_REQUEST_TIMEOUT;
+    if (ret == -EAGAIN && atomic_cas(&req->finished, 0, 1)) {
+        LOG_WRN("CoAP request timed out after %u ms", (uint32_t)(req->deadline - req->started));
+        req->result = COAP_REQUEST_TIMEOUT;
+        coap_client_cancel_request(req->session->client, &req->client_req);
+        if (req->blockwise) {
+            req->blockwise->slow_blocks++; // The one that never came.
+        }
+        req->stats.retransmits++;
     }
 
-    zsock_close(ctx.sockfd);
+    // The result is settled, but a reply may still be on its way through internal_coap_callback (which will see
+    // the request is finished and leave it alone). Wait until nothing is, so the caller can let go of the request.
+    k_spinlock_key_t key = k_spin_lock(&callback_lock);
+    bool busy = req->in_callback > 0;
+    req->idle_wanted = busy;
+    k_spin_unlock(&callback_lock, key);
+    if (busy && k_sem_take(&req->idle, K_MSEC(COAP_REQUEST_CALLBACK_DRAIN_MS)) != 0) {
+        LOG_ERR("Stream callback still running after %d ms", COAP_REQUEST_CALLBACK_DRAIN_MS);
+    }
+
+    req->stats.bytes = req->current_offset;
+    req->stats.elapsed_ms = k_uptime_get() - req->started;
+    if (req->session) {
+        req->session->last = req->stats;
+        req->session->retransmits += req->stats.retransmits;
+    }
+
+    LOG_DBG("CoAP request completed with result: %d", req->result);
+    return req->result;
+}
+
+void coap_request_wait_all(struct coap_request *reqs[], size_t num)
+{
+    // Each one's deadline is its own, so waiting in order doesn't hold up the others.
+    for (size_t i = 0; i < num; i++) {
+        coap_request_wait(reqs[i]);
+    }
+}
 
-    LOG_DBG("CoAP request completed with result: %d", ctx.result);
-    return ctx.result;
-}
\ No newline at end of file
+coap_request_result_t do_coap_request(struct coap_session *session,
+                                    const char* path, enum coap_method method, const uint8_t* payload,
+                                    size_t payload_len, struct coap_client_option *options,
+                                    size_t num_options, struct coap_blockwise *blockwise,
+                                    coap_stream_callback_t stream_cb, void* user_data, uint32_t timeout_seconds)
+{
+    struct coap_request req;
+
+    coap_request_submit(&req, session, path, method, payload, payload_len, options, num_options, blockwise,
+                        stream_cb, user_data, timeout_seconds);
+    return coap_request_wait(&req);
+}
+
+enum coap_block_size coap_blockwise_next_szx(const struct coap_blockwise *bw, enum coap_block_size max_szx)
+{
+    enum coap_block_size szx = MIN(bw->preferred_szx, max_szx);
+
+    // No point asking for more than the server is willing to send.
+    if (bw->block_size > 0) {
+        szx = MIN(szx, coap_bytes_to_block_size(bw->block_size));
+    }
+
+    // A lost 6LoWPAN fragment costs the whole block, so bigger blocks only pay off on a clean link.
+    if (bw->slow_blocks * 8 > bw->blocks) {
+        return szx > COAP_BLOCK_64 ? szx - 1 : szx;
+    }
+    if (bw->slow_blocks == 0 && bw->blocks >= 8 && szx == bw->preferred_szx && szx < max_szx) {
+        return szx + 1;
+    }
+    return szx;
+}
@@ -9,6 +9,7 @@
  */
 typedef enum {
     COAP_REQUEST_SUCCESS = 0,
+    COAP_REQUEST_VALID = 1, // 2.03 Valid: the ETag we sent still matches, no payload.
     COAP_REQUEST_TIMEOUT = -1,
     COAP_REQUEST_NETWORK_ERROR = -2,
     COAP_REQUEST_PROTO_ERROR = -3,
@@ -35,4 +36,100 @@ typedef int (*coap_stream_callback_t)(
     void *user_data
 );
 
-coap_request_result_t do_coap_request(struct coap_client *client, struct sockaddr *server_addr, const char* path, enum coap_method method, const uint8_t* payload, size_t payload_len, coap_stream_callback_t stream_cb, void* user_data, uint32_t timeout_seconds);
\ No newline at end of file
+/**
+ * Block2 size negotiation for a download.
+ *
+ * The first request asks for blocks of preferred_szx (RFC 7959 early negotiation); the server may send smaller
+ * ones, and coap_client never asks for more than CONFIG_COAP_CLIENT_BLOCK_SIZE. The rest is filled in by
+ * do_coap_request.
+ */
+struct coap_blockwise {
+    enum coap_block_size preferred_szx;
+    size_t block_size; // What the server actually sent, or 0 if the response wasn't blockwise.
+    uint32_t blocks;
+    // Blocks that took longer than the retransmission timeout to arrive - so most likely one of the fragments of
+    // the block or its request was lost and the whole thing sent again.
+    uint32_t slow_blocks;
+};
+
+// What one request cost on the network.
+struct coap_request_stats {
+    uint32_t bytes; // Of response payload.
+    uint32_t elapsed_ms;
+    uint16_t replies; // One per block.
+    // Replies that took longer than the retransmission timeout (so most likely answered a resend), plus one if the
+    // request timed out altogether.
+    uint16_t retransmits;
+};
+
+// Caller's options plus our Block2.
+#define COAP_REQUEST_MAX_OPTIONS 4
+
+/**
+ * A conversation with one server, e.g. everything one wake sends to the host.
+ *
+ * Requests share its socket, and each reply feeds a round trip estimate that sets the next request's
+ * retransmission timeout, instead of every request starting from CONFIG_COAP_INIT_ACK_TIMEOUT_MS.
+ */
+struct coap_session {
+    struct coap_client *client;
+    struct sockaddr server_addr;
+    int sockfd;
+    bool has_rtt;
+    uint32_t srtt_ms;
+    uint32_t rttvar_ms;
+    struct coap_request_stats last; // The most recently finished request.
+    uint16_t requests;
+    uint16_t retransmits; // Over every request.
+};
+
+// Opens the session's socket. Returns 0 or a negative errno.
+int coap_session_open(struct coap_session *session, struct coap_client *client, const struct sockaddr *server_addr);
+// Closes the socket. Requests on a closed session fail with COAP_REQUEST_NETWORK_ERROR.
+void coap_session_close(struct coap_session *session);
+// Retransmission timeout the next request will start with.
+uint32_t coap_session_ack_timeout(const struct coap_session *session);
+
+/**
+ * A request sent with coap_request_submit, so that others can be in flight alongside it (up to
+ * CONFIG_COAP_CLIENT_MAX_REQUESTS). The caller owns it; it has to stay put until coap_request_wait returns.
+ */
+struct coap_request {
+    struct coap_session *session;
+    struct k_sem done;
+    coap_stream_callback_t stream_cb;
+    void *user_data;
+    coap_request_result_t result;
+    size_t current_offset;
+    atomic_t finished; // Set by whichever settles the result first: a reply, or the waiter giving up.
+    int in_callback; // Replies being handled on coap_client's thread right now, under the module's lock.
+    bool idle_wanted; // The waiter is waiting for in_callback to drop to zero...
+    struct k_sem idle; // ...and is given this when it does.
+    struct coap_blockwise *blockwise;
+    struct coap_client_option options[COAP_REQUEST_MAX_OPTIONS];
+    struct coap_client_option *block2_opt; // Until the first reply, after which coap_client sends Block2 itself.
+    struct coap_client_request client_req; // coap_client finds the request to cancel by it.
+    uint32_t ack_timeout_ms;
+    int64_t started;
+    int64_t deadline;
+    int64_t last_reply_time; // When we last sent or heard from the server - each reply prompts the next request.
+    struct coap_request_stats stats;
+};
+
+// Send a request and return without waiting for the reply. Arguments as for do_coap_request; timeout_seconds runs
+// from now. If it can't be sent, it's already finished and waiting returns the error straight away.
+void coap_request_submit(struct coap_request *req, struct coap_session *session, const char *path, enum coap_method method, const uint8_t *payload, size_t payload_len, struct coap_client_option *options, size_t num_options, struct coap_blockwise *blockwise, coap_stream_callback_t stream_cb, void *user_data, uint32_t timeout_seconds);
+// Wait for a submitted request to finish or time out, and return its result. It's then recorded as the session's
+// last request.
+coap_request_result_t coap_request_wait(struct coap_request *req);
+// Wait for all of NUM submitted requests. Their results are in each one's result.
+void coap_request_wait_all(struct coap_request *reqs[], size_t num);
+
+// Send a request and wait for it.
+// options (may be NULL) are sent with the request, e.g. an ETag to validate a cached response.
+// blockwise (may be NULL) negotiates the Block2 size of a download and reports how it went.
+coap_request_result_t do_coap_request(struct coap_session *session, const char* path, enum coap_method method, const uint8_t* payload, size_t payload_len, struct coap_client_option *options, size_t num_options, struct coap_blockwise *blockwise, coap_stream_callback_t stream_cb, void* user_data, uint32_t timeout_seconds);
+
+// Block size to ask for on the next download, given how the last one with BW went: one step smaller if too many
+// blocks had to be resent, one step larger (up to max_szx) if none did.
+enum coap_block_size coap_blockwise_next_szx(const struct coap_blockwise *bw, enum coap_block_size max_szx);
\ No newline at end of file
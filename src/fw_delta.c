@@ -0,0 +1,253 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
+#include <zephyr/sys/util.h>
+
+#include "fw_delta.h"
+
+LOG_MODULE_REGISTER(fw_delta, LOG_LEVEL_INF);
+
+enum fw_delta_state {
+    DELTA_HEADER,
+    DELTA_OP,
+    DELTA_SEEK,
+    DELTA_LENGTH,
+    DELTA_COPY,
+    DELTA_ADD,
+    DELTA_INSERT,
+    DELTA_ERROR,
+};
+
+#define DELTA_OP_COPY 0
+#define DELTA_OP_ADD 1
+#define DELTA_OP_INSERT 2
+
+// Nothing in a delta needs more than 32 bits.
+#define DELTA_MAX_VARINT_SHIFT 28
+
+void fw_delta_init(struct fw_delta *d, const struct fw_delta_io *io, size_t source_limit) {
+    memset(d, 0, sizeof(*d));
+    d->io = *io;
+    d->source_limit = source_limit;
+    d->state = DELTA_HEADER;
+}
+
+// Check the delta was made against the image we're running, before any of it goes to flash.
+static int fw_delta_check_source(struct fw_delta *d) {
+    uint32_t source_crc = sys_get_le32(&d->header[8]);
+    uint32_t crc = 0;
+
+    if (memcmp(d->header, FW_DELTA_MAGIC, FW_DELTA_MAGIC_LEN) != 0) {
+        LOG_ERR("not a firmware delta");
+        return -EINVAL;
+    }
+    d->source_size = sys_get_le32(&d->header[4]);
+    d->target_size = sys_get_le32(&d->header[12]);
+    d->target_crc = sys_get_le32(&d->header[16]);
+    if (d->source_size > d->source_limit) {
+        LOG_ERR("delta is against a %u byte image, we have room for %zu", d->source_size, d->source_limit);
+        return -EINVAL;
+    }
+
+    for (size_t off = 0; off < d->source_size; off += sizeof(d->buf)) {
+        size_t n = MIN(sizeof(d->buf), d->source_size - off);
+        int ret = d->io.read_source(d->io.ctx, off, d->buf, n);
+
+        if (ret < 0) {
+            LOG_ERR("failed to read the running image at %zu: %d", off, ret);
+            return ret;
+        }
+        crc = crc32_ieee_update(crc, d->buf, n);
+    }
+    if (crc != source_crc) {
+        LOG_ERR("delta is against another image (CRC %08x, ours %08x)", source_crc, crc);
+        return -EINVAL;
+    }
+    LOG_INF("Applying delta against our %u byte image, for a %u byte one", d->source_size, d->target_size);
+    return 0;
+}
+
+static int fw_delta_read(struct fw_delta *d, size_t n) {
+    int ret = d->io.read_source(d->io.ctx, d->cursor, d->buf, n);
+
+    if (ret < 0) {
+        LOG_ERR("failed to read the running image at %lld: %d", (long long)d->cursor, ret);
+    }
+    return ret;
+}
+
+static int fw_delta_emit(struct fw_delta *d, const uint8_t *data, size_t len) {
+    int ret = d->io.write_target(d->io.ctx, data, len);
+
+    if (ret < 0) {
+        LOG_ERR("failed to write the new image at %u: %d", d->written, ret);
+        return ret;
+    }
+    d->crc = crc32_ieee_update(d->crc, data, len);
+    d->written += len;
+    return 0;
+}
+
+// Once an op's length is known, make sure it stays inside the target and (for COPY and ADD) the source.
+static enum fw_delta_state fw_delta_start(struct fw_delta *d) {
+    if (d->count > d->target_size - d->written) {
+        LOG_ERR("delta op of %u bytes runs past the end of the image", d->count);
+        return DELTA_ERROR;
+    }
+    if (d->op == DELTA_OP_INSERT) {
+        return DELTA_INSERT;
+    }
+    if (d->cursor < 0 || d->cursor + d->count > d->source_size) {
+        LOG_ERR("delta op reads %u bytes at %lld, outside the running image", d->count, (long long)d->cursor);
+        return DELTA_ERROR;
+    }
+    return d->op == DELTA_OP_COPY ? DELTA_COPY : DELTA_ADD;
+}
+
+int fw_delta_write(struct fw_delta *d, const uint8_t *data, size_t len) {
+    const uint8_t *p = data;
+    const uint8_t *end = data + len;
+    size_t n;
+
+    while (1) {
+        switch (d->state) {
+        case DELTA_HEADER:
+            if (p == end) {
+                return 0;
+            }
+            n = MIN((size_t)(end - p), sizeof(d->header) - d->header_len);
+            memcpy(&d->header[d->header_len], p, n);
+            d->header_len += n;
+            p += n;
+            if (d->header_len == sizeof(d->header)) {
+                d->state = fw_delta_check_source(d) < 0 ? DELTA_ERROR : DELTA_OP;
+            }
+            break;
+
+        case DELTA_OP:
+            if (p == end) {
+                return 0;
+            }
+            if (d->written == d->target_size) {
+                LOG_ERR("delta carries on past the end of the image");
+                d->state = DELTA_ERROR;
+                break;
+            }
+            d->op = *p++;
+            if (d->op > DELTA_OP_INSERT) {
+                LOG_ERR("unknown delta op %u", d->op);
+                d->state = DELTA_ERROR;
+                break;
+            }
+            d->varint = 0;
+            d->varint_shift = 0;
+            d->state = d->op == DELTA_OP_INSERT ? DELTA_LENGTH : DELTA_SEEK;
+            break;
+
+        case DELTA_SEEK:
+        case DELTA_LENGTH:
+            if (p == end) {
+                return 0;
+            }
+            if (d->varint_shift > DELTA_MAX_VARINT_SHIFT) {
+                LOG_ERR("delta varint too long");
+                d->state = DELTA_ERROR;
+                break;
+            }
+            d->varint |= (uint32_t)(*p & 0x7F) << d->varint_shift;
+            d->varint_shift += 7;
+            if (*p++ & 0x80) {
+                break;
+            }
+            if (d->state == DELTA_SEEK) {
+                // Zigzag: the low bit is the sign.
+                d->cursor += (d->varint & 1) ? -(int64_t)(d->varint >> 1) - 1 : (int64_t)(d->varint >> 1);
+                d->varint = 0;
+                d->varint_shift = 0;
+                d->state = DELTA_LENGTH;
+            } else {
+                d->count = d->varint;
+                d->state = fw_delta_start(d);
+            }
+            break;
+
+        case DELTA_COPY:
+            // Doesn't need any input, so runs to the end of the op.
+            n = MIN(d->count, sizeof(d->buf));
+            if (fw_delta_read(d, n) < 0 || fw_delta_emit(d, d->buf, n) < 0) {
+                d->state = DELTA_ERROR;
+                break;
+            }
+            d->cursor += n;
+            d->count -= n;
+            if (d->count == 0) {
+                d->state = DELTA_OP;
+            }
+            break;
+
+        case DELTA_ADD:
+            if (d->count == 0) {
+                d->state = DELTA_OP;
+                break;
+            }
+            if (p == end) {
+                return 0;
+            }
+            n = MIN(d->count, MIN((size_t)(end - p), sizeof(d->buf)));
+            if (fw_delta_read(d, n) < 0) {
+                d->state = DELTA_ERROR;
+                break;
+            }
+            for (size_t i = 0; i < n; i++) {
+                d->buf[i] += p[i];
+            }
+            if (fw_delta_emit(d, d->buf, n) < 0) {
+                d->state = DELTA_ERROR;
+                break;
+            }
+            p += n;
+            d->cursor += n;
+            d->count -= n;
+            break;
+
+        case DELTA_INSERT:
+            if (d->count == 0) {
+                d->state = DELTA_OP;
+                break;
+            }
+            if (p == end) {
+                return 0;
+            }
+            n = MIN(d->count, (size_t)(end - p));
+            if (fw_delta_emit(d, p, n) < 0) {
+                d->state = DELTA_ERROR;
+                break;
+            }
+            p += n;
+            d->count -= n;
+            break;
+
+        case DELTA_ERROR:
+        default:
+            return -EINVAL;
+        }
+    }
+}
+
+int fw_delta_finish(struct fw_delta *d) {
+    if (d->state != DELTA_OP || d->written != d->target_size) {
+        LOG_ERR("delta ended after %u of %u bytes", d->written, d->target_size);
+        d->state = DELTA_ERROR;
+        return -EINVAL;
+    }
+    if (d->crc != d->target_crc) {
+        LOG_ERR("new image CRC %08x, delta promised %08x", d->crc, d->target_crc);
+        d->state = DELTA_ERROR;
+        return -EINVAL;
+    }
+    return 0;
+}
@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// Applies a binary delta from the host as it streams in, rebuilding a new firmware image from the one we're
+// running. The format is described in host/src/fw_delta.rs.
+
+#define FW_DELTA_MAGIC "WPD1"
+#define FW_DELTA_MAGIC_LEN 4
+#define FW_DELTA_HEADER_LEN 20
+
+// Source bytes are read and combined this many at a time.
+#define FW_DELTA_CHUNK 256
+
+struct fw_delta_io {
+    // Read LEN bytes of the running image at OFFSET into BUF. 0 or a negative errno.
+    int (*read_source)(void *ctx, size_t offset, uint8_t *buf, size_t len);
+    // Append LEN bytes to the new image. 0 or a negative errno.
+    int (*write_target)(void *ctx, const uint8_t *data, size_t len);
+    void *ctx;
+};
+
+struct fw_delta {
+    struct fw_delta_io io;
+    size_t source_limit;
+    uint8_t state;
+    uint8_t header[FW_DELTA_HEADER_LEN];
+    uint8_t header_len;
+    uint32_t source_size;
+    uint32_t target_size;
+    uint32_t target_crc;
+    uint32_t written;
+    uint32_t crc; // Of what we've written so far.
+    uint8_t op;
+    uint32_t varint;
+    uint8_t varint_shift;
+    int64_t cursor; // Where in the source the next COPY or ADD reads, after its seek.
+    uint32_t count; // Bytes left in the current op.
+    uint8_t buf[FW_DELTA_CHUNK];
+};
+
+// Start applying a delta against a running image that can be at most SOURCE_LIMIT bytes.
+void fw_delta_init(struct fw_delta *d, const struct fw_delta_io *io, size_t source_limit);
+// Apply the next LEN bytes of the delta. 0, or a negative errno once the delta turns out to be malformed, made
+// against a different image, or reading or writing fails - after which it stays failed.
+int fw_delta_write(struct fw_delta *d, const uint8_t *data, size_t len);
+// Call at the end of the delta. 0 if it produced the whole image it promised, with the right CRC.
+int fw_delta_finish(struct fw_delta *d);
@@ -9,10 +9,21 @@
     #define HEATSHRINK_FREE(P, SZ) free(P)
 #else
     /* Required parameters for static configuration */
-    #define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE 300 // we get 256 bytes per CoAP chunk.
-    #define HEATSHRINK_STATIC_WINDOW_BITS 11 // 11,8 gives ~2K of RAM use, perfectly reasonable for this application.
+#ifdef CONFIG_APP_HEATSHRINK_FAST_DECODER
+    #define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE 0 // heatshrink_decoder_decode reads straight from the CoAP payload.
+#else
+    #define HEATSHRINK_STATIC_INPUT_BUFFER_SIZE 300 // larger CoAP blocks are sunk in several goes.
+#endif
+    // Largest window/lookahead we can decode - the host picks what each image actually uses.
+    // 11,8 gives ~2K of RAM use, perfectly reasonable for this application.
+#ifdef CONFIG_APP_HEATSHRINK_MAX_WINDOW_BITS
+    #define HEATSHRINK_STATIC_WINDOW_BITS CONFIG_APP_HEATSHRINK_MAX_WINDOW_BITS
+    #define HEATSHRINK_STATIC_LOOKAHEAD_BITS CONFIG_APP_HEATSHRINK_MAX_LOOKAHEAD_BITS
+#else
+    #define HEATSHRINK_STATIC_WINDOW_BITS 11
     #define HEATSHRINK_STATIC_LOOKAHEAD_BITS 8
 #endif
+#endif
 
 /* Turn on logging for debugging. */
 #define HEATSHRINK_DEBUGGING_LOGS 0
@@ -33,12 +33,14 @@ typedef enum {
 #define HEATSHRINK_DECODER_LOOKAHEAD_BITS(BUF) \
     ((BUF)->lookahead_sz2)
 #else
+/* The static window and lookahead sizes are the largest supported. The
+ * ones a stream actually uses are set by heatshrink_decoder_configure. */
 #define HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(_) \
     HEATSHRINK_STATIC_INPUT_BUFFER_SIZE
-#define HEATSHRINK_DECODER_WINDOW_BITS(_) \
-    (HEATSHRINK_STATIC_WINDOW_BITS)
+#define HEATSHRINK_DECODER_WINDOW_BITS(BUF) \
+    ((BUF)->window_sz2)
 #define HEATSHRINK_DECODER_LOOKAHEAD_BITS(BUF) \
-    (HEATSHRINK_STATIC_LOOKAHEAD_BITS)
+    ((BUF)->lookahead_sz2)
 #endif
 
 typedef struct {
@@ -50,18 +52,21 @@ typedef struct {
     uint8_t state;              /* current state machine node */
     uint8_t current_byte;       /* current byte of input */
     uint8_t bit_index;          /* current bit index */
+    uint8_t bit_count;          /* bits held in bit_buffer (fast decoder) */
+    uint32_t bit_buffer;        /* bit reservoir, newest bits lowest (fast decoder) */
 
-#if HEATSHRINK_DYNAMIC_ALLOC
-    /* Fields that are only used if dynamically allocated. */
     uint8_t window_sz2;         /* window buffer bits */
     uint8_t lookahead_sz2;      /* lookahead bits */
+
+#if HEATSHRINK_DYNAMIC_ALLOC
+    /* Fields that are only used if dynamically allocated. */
     uint16_t input_buffer_size; /* input buffer size */
 
     /* Input buffer, then expansion window buffer */
     uint8_t buffers[];
 #else
-    /* Input buffer, then expansion window buffer */
-    uint8_t buffers[(1 << HEATSHRINK_DECODER_WINDOW_BITS(_))
+    /* Input buffer, then expansion window buffer, sized for the largest window */
+    uint8_t buffers[(1 << HEATSHRINK_STATIC_WINDOW_BITS)
         + HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(_)];
 #endif
 } heatshrink_decoder;
@@ -82,6 +87,25 @@ void heatshrink_decoder_free(heatshrink_decoder *hsd);
 /* Reset a decoder. */
 void heatshrink_decoder_reset(heatshrink_decoder *hsd);
 
+#if !HEATSHRINK_DYNAMIC_ALLOC
+/* Set the window and lookahead sizes the next stream was compressed with,
+ * up to HEATSHRINK_STATIC_WINDOW_BITS / HEATSHRINK_STATIC_LOOKAHEAD_BITS.
+ * Call heatshrink_decoder_reset afterwards. Returns -1 if out of range. */
+static inline int heatshrink_decoder_configure(heatshrink_decoder *hsd,
+        uint8_t window_sz2, uint8_t lookahead_sz2) {
+    if ((window_sz2 < HEATSHRINK_MIN_WINDOW_BITS) ||
+        (window_sz2 > HEATSHRINK_STATIC_WINDOW_BITS) ||
+        (lookahead_sz2 < HEATSHRINK_MIN_LOOKAHEAD_BITS) ||
+        (lookahead_sz2 > HEATSHRINK_STATIC_LOOKAHEAD_BITS) ||
+        (lookahead_sz2 >= window_sz2)) {
+        return -1;
+    }
+    hsd->window_sz2 = window_sz2;
+    hsd->lookahead_sz2 = lookahead_sz2;
+    return 0;
+}
+#endif
+
 /* Sink at most SIZE bytes from IN_BUF into the decoder. *INPUT_SIZE is set to
  * indicate how many bytes were actually sunk (in case a buffer was filled). */
 HSD_sink_res heatshrink_decoder_sink(heatshrink_decoder *hsd,
@@ -92,6 +116,16 @@ HSD_sink_res heatshrink_decoder_sink(heatshrink_decoder *hsd,
 HSD_poll_res heatshrink_decoder_poll(heatshrink_decoder *hsd,
     uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
 
+/* Decode straight from IN_BUF into OUT_BUF, without copying the input into
+ * the decoder first (heatshrink_decoder_fast.c only). *INPUT_SIZE is set to
+ * how many bytes of IN_BUF were consumed and *OUTPUT_SIZE to how many were
+ * written. Returns HSDR_POLL_MORE if OUT_BUF filled up, in which case call
+ * again with the rest of IN_BUF and a fresh output buffer, or
+ * HSDR_POLL_EMPTY once all of IN_BUF is consumed. */
+HSD_poll_res heatshrink_decoder_decode(heatshrink_decoder *hsd,
+    const uint8_t *in_buf, size_t in_size, size_t *input_size,
+    uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+
 /* Notify the dencoder that the input stream is finished.
  * If the return value is HSDR_FINISH_MORE, there is still more output, so
  * call heatshrink_decoder_poll and repeat. */
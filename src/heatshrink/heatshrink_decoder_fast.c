@@ -0,0 +1,291 @@
+#include <stdlib.h>
+#include <string.h>
+#include "heatshrink_decoder.h"
+
+/* Drop-in replacement for heatshrink_decoder.c, with the same API and
+ * stream format. Link one or the other.
+ *
+ * Instead of pulling one bit at a time through a state machine, input is
+ * shifted a byte at a time into a 32-bit bit reservoir, and a token is
+ * only consumed once all of its bits are there. That leaves two states:
+ * decoding tokens, or emitting the rest of a back-reference that didn't
+ * fit in the last output buffer. Runs of literals are decoded in a tight
+ * loop, and back-references are copied with memcpy/memset wherever the
+ * source and destination don't overlap or wrap around the window.
+ *
+ * A whole back-reference token (1 + window bits + lookahead bits) has to
+ * fit in the reservoir after a refill, which always holds at least 25
+ * bits while input is available.
+ *
+ * Besides the upstream API, heatshrink_decoder_decode reads compressed
+ * data straight from the caller's buffer, so the internal input buffer
+ * can be configured down to nothing. */
+
+#define BACKREF_COUNT_BITS(HSD) (HEATSHRINK_DECODER_LOOKAHEAD_BITS(HSD))
+#define BACKREF_INDEX_BITS(HSD) (HEATSHRINK_DECODER_WINDOW_BITS(HSD))
+#define BACKREF_TOKEN_BITS(HSD) (1 + BACKREF_INDEX_BITS(HSD) + BACKREF_COUNT_BITS(HSD))
+#define LITERAL_TOKEN_BITS 9
+#define RESERVOIR_MIN_BITS 25
+
+#if !HEATSHRINK_DYNAMIC_ALLOC
+#if 1 + HEATSHRINK_STATIC_WINDOW_BITS + HEATSHRINK_STATIC_LOOKAHEAD_BITS > RESERVOIR_MIN_BITS
+#error "window + lookahead bits too large for the fast decoder's bit reservoir"
+#endif
+#endif
+
+#if HEATSHRINK_DYNAMIC_ALLOC
+heatshrink_decoder *heatshrink_decoder_alloc(uint16_t input_buffer_size,
+                                             uint8_t window_sz2,
+                                             uint8_t lookahead_sz2) {
+    if ((window_sz2 < HEATSHRINK_MIN_WINDOW_BITS) ||
+        (window_sz2 > HEATSHRINK_MAX_WINDOW_BITS) ||
+        (input_buffer_size == 0) ||
+        (lookahead_sz2 < HEATSHRINK_MIN_LOOKAHEAD_BITS) ||
+        (lookahead_sz2 >= window_sz2) ||
+        (1 + window_sz2 + lookahead_sz2 > RESERVOIR_MIN_BITS)) {
+        return NULL;
+    }
+    size_t buffers_sz = (1 << window_sz2) + input_buffer_size;
+    size_t sz = sizeof(heatshrink_decoder) + buffers_sz;
+    heatshrink_decoder *hsd = HEATSHRINK_MALLOC(sz);
+    if (hsd == NULL) { return NULL; }
+    hsd->input_buffer_size = input_buffer_size;
+    hsd->window_sz2 = window_sz2;
+    hsd->lookahead_sz2 = lookahead_sz2;
+    heatshrink_decoder_reset(hsd);
+    return hsd;
+}
+
+void heatshrink_decoder_free(heatshrink_decoder *hsd) {
+    size_t buffers_sz = (1 << hsd->window_sz2) + hsd->input_buffer_size;
+    size_t sz = sizeof(heatshrink_decoder) + buffers_sz;
+    HEATSHRINK_FREE(hsd, sz);
+    (void)sz;   /* may not be used by free */
+}
+#endif
+
+void heatshrink_decoder_reset(heatshrink_decoder *hsd) {
+    size_t buf_sz = 1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd);
+    size_t input_sz = HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd);
+    memset(hsd->buffers, 0, buf_sz + input_sz);
+    hsd->state = 0;
+    hsd->input_size = 0;
+    hsd->input_index = 0;
+    hsd->bit_index = 0x00;
+    hsd->current_byte = 0x00;
+    hsd->bit_count = 0;
+    hsd->bit_buffer = 0;
+    hsd->output_count = 0;
+    hsd->output_index = 0;
+    hsd->head_index = 0;
+}
+
+/* Copy SIZE bytes into the decoder's input buffer, if it will fit. */
+HSD_sink_res heatshrink_decoder_sink(heatshrink_decoder *hsd,
+        uint8_t *in_buf, size_t size, size_t *input_size) {
+    if ((hsd == NULL) || (in_buf == NULL) || (input_size == NULL)) {
+        return HSDR_SINK_ERROR_NULL;
+    }
+
+    size_t rem = HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd) - hsd->input_size;
+    if (rem == 0) {
+        *input_size = 0;
+        return HSDR_SINK_FULL;
+    }
+
+    size = rem < size ? rem : size;
+    /* copy into input buffer (at head of buffers) */
+    memcpy(&hsd->buffers[hsd->input_size], in_buf, size);
+    hsd->input_size += size;
+    *input_size = size;
+    return HSDR_SINK_OK;
+}
+
+
+/*****************
+ * Decompression *
+ *****************/
+
+/* Top up the reservoir a byte at a time from *IN, until it holds at
+ * least RESERVOIR_MIN_BITS or IN reaches IN_END. Bits above *NBITS are
+ * stale and get shifted out. */
+static inline void refill(const uint8_t **in, const uint8_t *in_end,
+        uint32_t *bits, uint8_t *nbits) {
+    const uint8_t *p = *in;
+    uint32_t b = *bits;
+    uint8_t n = *nbits;
+
+    while (n < RESERVOIR_MIN_BITS && p < in_end) {
+        b = (b << 8) | *p++;
+        n += 8;
+    }
+
+    *in = p;
+    *bits = b;
+    *nbits = n;
+}
+
+/* Emit COUNT bytes of the back-reference OFFSET bytes behind the window
+ * head into OUT, and append them to the window. (The repetition can
+ * include itself.) Returns the new head index. */
+static uint16_t yield_backref(uint8_t *window, uint16_t mask, uint16_t head,
+        uint16_t offset, uint8_t *out, size_t count) {
+    while (count > 0) {
+        uint16_t dst = head & mask;
+        uint16_t src = (head - offset) & mask;
+        size_t run = count;
+
+        /* Stop where either end wraps around the window. */
+        if (run > (size_t)(mask + 1 - dst)) { run = mask + 1 - dst; }
+        if (run > (size_t)(mask + 1 - src)) { run = mask + 1 - src; }
+
+        if (offset >= run) {
+            /* Source is entirely history. When OFFSET is the full window
+             * size, source and destination are the same bytes. */
+            memmove(&window[dst], &window[src], run);
+        } else if (offset == 1) {
+            memset(&window[dst], window[src], run);
+        } else if (offset < 8) {
+            for (size_t i = 0; i < run; i++) {
+                window[dst + i] = window[src + i];
+            }
+        } else {
+            /* Repeating pattern: copy one period at a time, each of which
+             * only reads bytes that are already final. */
+            run = offset;
+            memcpy(&window[dst], &window[src], run);
+        }
+        memcpy(out, &window[dst], run);
+
+        out += run;
+        head += run;
+        count -= run;
+    }
+    return head;
+}
+
+/* Decode from *IN until either the output buffer is full or the input
+ * runs out, advancing *IN past the bytes that went into the reservoir.
+ * Returns the number of bytes written to OUT_BUF. */
+static size_t decode(heatshrink_decoder *hsd,
+        const uint8_t **in, const uint8_t *in_end,
+        uint8_t *out_buf, size_t out_buf_size) {
+    uint8_t *out = out_buf;
+    uint8_t *const out_end = out_buf + out_buf_size;
+    uint8_t *const window = &hsd->buffers[HEATSHRINK_DECODER_INPUT_BUFFER_SIZE(hsd)];
+    const uint16_t mask = (1 << HEATSHRINK_DECODER_WINDOW_BITS(hsd)) - 1;
+    const uint8_t count_bits = BACKREF_COUNT_BITS(hsd);
+    const uint8_t backref_bits = BACKREF_TOKEN_BITS(hsd);
+    uint32_t bits = hsd->bit_buffer;
+    uint8_t nbits = hsd->bit_count;
+    uint16_t head = hsd->head_index;
+
+    while (1) {
+        /* Finish a back-reference left over from the last call, or just decoded. */
+        if (hsd->output_count > 0) {
+            size_t count = (size_t)(out_end - out);
+            if (hsd->output_count < count) { count = hsd->output_count; }
+            head = yield_backref(window, mask, head, hsd->output_index, out, count);
+            out += count;
+            hsd->output_count -= count;
+            if (hsd->output_count > 0) { break; } /* out of output space */
+        }
+
+        /* Run of literals. */
+        while (out < out_end) {
+            if (nbits < LITERAL_TOKEN_BITS) {
+                refill(in, in_end, &bits, &nbits);
+                if (nbits < LITERAL_TOKEN_BITS) { break; }
+            }
+            if (((bits >> (nbits - 1)) & 0x01) != HEATSHRINK_LITERAL_MARKER) { break; }
+            nbits -= LITERAL_TOKEN_BITS;
+            uint8_t c = (uint8_t)(bits >> nbits);
+            window[head++ & mask] = c;
+            *out++ = c;
+        }
+        if (out == out_end) { break; }
+
+        /* Back-reference: marker bit, then index - 1, then count - 1. */
+        if (nbits < backref_bits) {
+            refill(in, in_end, &bits, &nbits);
+            if (nbits < backref_bits) { break; } /* out of input */
+        }
+        if (((bits >> (nbits - 1)) & 0x01) != HEATSHRINK_BACKREF_MARKER) {
+            continue; /* refill made room for another literal */
+        }
+        nbits -= backref_bits;
+        uint32_t token = bits >> nbits;
+        hsd->output_index = ((token >> count_bits) & mask) + 1;
+        hsd->output_count = (token & ((1 << count_bits) - 1)) + 1;
+    }
+
+    hsd->bit_buffer = bits;
+    hsd->bit_count = nbits;
+    hsd->head_index = head;
+    return (size_t)(out - out_buf);
+}
+
+HSD_poll_res heatshrink_decoder_poll(heatshrink_decoder *hsd,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    if ((hsd == NULL) || (out_buf == NULL) || (output_size == NULL)) {
+        return HSDR_POLL_ERROR_NULL;
+    }
+
+    const uint8_t *in = &hsd->buffers[hsd->input_index];
+    *output_size = decode(hsd, &in, &hsd->buffers[hsd->input_size],
+        out_buf, out_buf_size);
+
+    hsd->input_index = (uint16_t)(in - hsd->buffers);
+    if (hsd->input_index == hsd->input_size) {
+        hsd->input_index = 0; /* input is exhausted */
+        hsd->input_size = 0;
+    }
+
+    if (*output_size == out_buf_size) { return HSDR_POLL_MORE; }
+    return HSDR_POLL_EMPTY;
+}
+
+HSD_poll_res heatshrink_decoder_decode(heatshrink_decoder *hsd,
+        const uint8_t *in_buf, size_t in_size, size_t *input_size,
+        uint8_t *out_buf, size_t out_buf_size, size_t *output_size) {
+    if ((hsd == NULL) || (in_buf == NULL && in_size > 0) ||
+        (input_size == NULL) || (out_buf == NULL) || (output_size == NULL)) {
+        return HSDR_POLL_ERROR_NULL;
+    }
+
+    /* Anything sunk earlier comes first. */
+    if (hsd->input_size > 0) {
+        HSD_poll_res res = heatshrink_decoder_poll(hsd, out_buf, out_buf_size, output_size);
+        *input_size = 0;
+        if (res != HSDR_POLL_EMPTY) { return res; }
+        out_buf += *output_size;
+        out_buf_size -= *output_size;
+    } else {
+        *output_size = 0;
+    }
+
+    const uint8_t *in = in_buf;
+    size_t produced = decode(hsd, &in, in_buf + in_size, out_buf, out_buf_size);
+    *input_size = (size_t)(in - in_buf);
+    *output_size += produced;
+
+    if (produced == out_buf_size) { return HSDR_POLL_MORE; }
+    return HSDR_POLL_EMPTY;
+}
+
+HSD_finish_res heatshrink_decoder_finish(heatshrink_decoder *hsd) {
+    if (hsd == NULL) { return HSDR_FINISH_ERROR_NULL; }
+    if ((hsd->output_count > 0) || (hsd->input_size > 0)) {
+        return HSDR_FINISH_MORE;
+    }
+    if (hsd->bit_count == 0) { return HSDR_FINISH_DONE; }
+
+    /* A whole token may be sitting in the reservoir if the last poll ran
+     * out of output space. Anything shorter is the 0-bit padding of the
+     * last byte (which looks like the start of a backref), or a token cut
+     * off by the end of the stream. */
+    uint8_t marker = (hsd->bit_buffer >> (hsd->bit_count - 1)) & 0x01;
+    uint8_t needed = (marker == HEATSHRINK_LITERAL_MARKER)
+        ? LITERAL_TOKEN_BITS : BACKREF_TOKEN_BITS(hsd);
+    return hsd->bit_count >= needed ? HSDR_FINISH_MORE : HSDR_FINISH_DONE;
+}
@@ -0,0 +1,333 @@
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/logging/log.h>
+#include <zephyr/sys/byteorder.h>
+
+#include "image_codec.h"
+
+LOG_MODULE_REGISTER(image_codec, LOG_LEVEL_INF);
+
+enum row_rle_state {
+    RLE_HEADER,
+    RLE_MODE,
+    RLE_OP,
+    RLE_RUN_VALUE,
+    RLE_RUN_LENGTH,
+    RLE_LITERAL,
+    RLE_RUN,
+    RLE_ERROR,
+};
+
+#define RLE_MODE_RAW 0
+#define RLE_MODE_ROW_DELTA 1
+
+#define RLE_MAX_LITERAL_OP 0x3F
+#define RLE_MAX_ZERO_RUN_OP 0x7E
+#define RLE_LONG_ZERO_RUN_OP 0x7F
+#define RLE_LONG_RUN_OP 0xFF
+// A varint never needs more than this for a run inside one plane.
+#define RLE_MAX_LEN_SHIFT 28
+
+static void row_rle_reset(struct row_rle_decoder *rle) {
+    rle->state = RLE_HEADER;
+    rle->header_len = 0;
+}
+
+static int row_rle_parse_header(struct row_rle_decoder *rle) {
+    rle->row_bytes = sys_get_le16(&rle->header[0]);
+    rle->plane_bytes = sys_get_le32(&rle->header[2]);
+    if (rle->row_bytes == 0 || rle->row_bytes > ROW_RLE_MAX_ROW_BYTES || rle->plane_bytes == 0 ||
+        rle->plane_bytes % rle->row_bytes != 0) {
+        LOG_ERR("bad row RLE header: %u byte rows, %u byte planes", rle->row_bytes, rle->plane_bytes);
+        return -1;
+    }
+    return 0;
+}
+
+// Once the length of a literal or run is known, make sure it stays inside the plane.
+static enum row_rle_state row_rle_start(struct row_rle_decoder *rle, enum row_rle_state next) {
+    if (rle->count > rle->plane_remaining) {
+        LOG_ERR("row RLE op of %u bytes runs past the end of the plane", rle->count);
+        return RLE_ERROR;
+    }
+    rle->plane_remaining -= rle->count;
+    return next;
+}
+
+// Write N residual bytes to OUT - either IN (a literal) or N copies of VALUE when IN is NULL (a run) - undoing
+// the row delta if the plane has one.
+static void row_rle_emit(struct row_rle_decoder *rle, const uint8_t *in, uint8_t value, uint8_t *out, size_t n) {
+    if (rle->mode == RLE_MODE_RAW) {
+        if (in) {
+            memcpy(out, in, n);
+        } else {
+            memset(out, value, n);
+        }
+        return;
+    }
+
+    while (n > 0) {
+        size_t chunk = MIN(n, (size_t)(rle->row_bytes - rle->col));
+        uint8_t *prev = &rle->prev_row[rle->col];
+
+        if (in == NULL && value == 0) {
+            memcpy(out, prev, chunk); // Same as the row above - the common case.
+        } else {
+            for (size_t i = 0; i < chunk; i++) {
+                prev[i] ^= in ? in[i] : value;
+            }
+            memcpy(out, prev, chunk);
+            if (in) {
+                in += chunk;
+            }
+        }
+
+        out += chunk;
+        n -= chunk;
+        rle->col += chunk;
+        if (rle->col == rle->row_bytes) {
+            rle->col = 0;
+        }
+    }
+}
+
+static HSD_poll_res row_rle_decode(struct row_rle_decoder *rle, const uint8_t *in, size_t len, size_t *consumed,
+                                   uint8_t *out, size_t space, size_t *produced) {
+    const uint8_t *p = in;
+    const uint8_t *in_end = in + len;
+    uint8_t *o = out;
+    uint8_t *out_end = out + space;
+    size_t n;
+
+    while (1) {
+        switch (rle->state) {
+        case RLE_HEADER:
+            if (p == in_end) {
+                goto suspend;
+            }
+            rle->header[rle->header_len++] = *p++;
+            if (rle->header_len == sizeof(rle->header)) {
+                rle->state = row_rle_parse_header(rle) < 0 ? RLE_ERROR : RLE_MODE;
+            }
+            break;
+
+        case RLE_MODE:
+            if (p == in_end) {
+                goto suspend;
+            }
+            rle->mode = *p++;
+            if (rle->mode != RLE_MODE_RAW && rle->mode != RLE_MODE_ROW_DELTA) {
+                LOG_ERR("unknown row RLE plane mode %u", rle->mode);
+                rle->state = RLE_ERROR;
+                break;
+            }
+            rle->plane_remaining = rle->plane_bytes;
+            rle->col = 0;
+            memset(rle->prev_row, 0, rle->row_bytes);
+            rle->state = RLE_OP;
+            break;
+
+        case RLE_OP:
+            if (rle->plane_remaining == 0) {
+                rle->state = RLE_MODE;
+                break;
+            }
+            if (p == in_end) {
+                goto suspend;
+            }
+            rle->op = *p++;
+            if (rle->op <= RLE_MAX_LITERAL_OP) {
+                rle->count = rle->op + 1;
+                rle->state = row_rle_start(rle, RLE_LITERAL);
+            } else if (rle->op <= RLE_MAX_ZERO_RUN_OP) {
+                rle->value = 0;
+                rle->count = rle->op - RLE_MAX_LITERAL_OP;
+                rle->state = row_rle_start(rle, RLE_RUN);
+            } else if (rle->op == RLE_LONG_ZERO_RUN_OP) {
+                rle->value = 0;
+                rle->count = RLE_LONG_ZERO_RUN_OP - RLE_MAX_LITERAL_OP;
+                rle->len_shift = 0;
+                rle->state = RLE_RUN_LENGTH;
+            } else {
+                rle->state = RLE_RUN_VALUE;
+            }
+            break;
+
+        case RLE_RUN_VALUE:
+            if (p == in_end) {
+                goto suspend;
+            }
+            rle->value = *p++;
+            rle->count = (rle->op & 0x7F) + 1;
+            if (rle->op == RLE_LONG_RUN_OP) {
+                rle->len_shift = 0;
+                rle->state = RLE_RUN_LENGTH;
+            } else {
+                rle->state = row_rle_start(rle, RLE_RUN);
+            }
+            break;
+
+        case RLE_RUN_LENGTH:
+            if (p == in_end) {
+                goto suspend;
+            }
+            if (rle->len_shift > RLE_MAX_LEN_SHIFT) {
+                LOG_ERR("row RLE run length too long");
+                rle->state = RLE_ERROR;
+                break;
+            }
+            rle->count += (uint32_t)(*p & 0x7F) << rle->len_shift;
+            rle->len_shift += 7;
+            if ((*p++ & 0x80) == 0) {
+                rle->state = row_rle_start(rle, RLE_RUN);
+            }
+            break;
+
+        case RLE_LITERAL:
+            n = MIN(rle->count, MIN((size_t)(in_end - p), (size_t)(out_end - o)));
+            row_rle_emit(rle, p, 0, o, n);
+            p += n;
+            o += n;
+            rle->count -= n;
+            if (rle->count > 0) {
+                goto suspend; // Out of input or output space.
+            }
+            rle->state = RLE_OP;
+            break;
+
+        case RLE_RUN:
+            n = MIN(rle->count, (size_t)(out_end - o));
+            row_rle_emit(rle, NULL, rle->value, o, n);
+            o += n;
+            rle->count -= n;
+            if (rle->count > 0) {
+                goto suspend; // Out of output space.
+            }
+            rle->state = RLE_OP;
+            break;
+
+        case RLE_ERROR:
+        default:
+            *consumed = p - in;
+            *produced = o - out;
+            return HSDR_POLL_ERROR_UNKNOWN;
+        }
+    }
+
+suspend:
+    *consumed = p - in;
+    *produced = o - out;
+    return o == out_end ? HSDR_POLL_MORE : HSDR_POLL_EMPTY;
+}
+
+void image_decoder_reset(struct image_decoder *dec) {
+    dec->codec = -1;
+    dec->need_params = false;
+}
+
+static int heatshrink_start(heatshrink_decoder *hsd, uint8_t window_sz2, uint8_t lookahead_sz2) {
+    if (heatshrink_decoder_configure(hsd, window_sz2, lookahead_sz2) < 0) {
+        LOG_ERR("can't decode heatshrink %u/%u, we support up to %u/%u", window_sz2, lookahead_sz2,
+                HEATSHRINK_STATIC_WINDOW_BITS, HEATSHRINK_STATIC_LOOKAHEAD_BITS);
+        return -1;
+    }
+    heatshrink_decoder_reset(hsd);
+    return 0;
+}
+
+static HSD_poll_res heatshrink_decode(heatshrink_decoder *hsd, const uint8_t *in, size_t len, size_t *consumed,
+                                      uint8_t *out, size_t space, size_t *produced) {
+#ifdef CONFIG_APP_HEATSHRINK_FAST_DECODER
+    return heatshrink_decoder_decode(hsd, in, len, consumed, out, space, produced);
+#else
+    // The upstream decoder needs the input copied in first.
+    *consumed = 0;
+    if (len > 0 && heatshrink_decoder_sink(hsd, (uint8_t *)in, len, consumed) < 0) {
+        return HSDR_POLL_ERROR_NULL;
+    }
+    return heatshrink_decoder_poll(hsd, out, space, produced);
+#endif
+}
+
+HSD_poll_res image_decoder_decode(struct image_decoder *dec, const uint8_t *in, size_t len, size_t *consumed,
+                                  uint8_t *out, size_t space, size_t *produced) {
+    size_t skipped = 0;
+    HSD_poll_res res;
+
+    *consumed = 0;
+    *produced = 0;
+    if (dec->codec < 0) {
+        if (len == 0) {
+            return HSDR_POLL_EMPTY;
+        }
+        dec->codec = in[0];
+        in++;
+        len--;
+        skipped = 1;
+
+        switch (dec->codec) {
+        case IMAGE_CODEC_HEATSHRINK:
+            if (heatshrink_start(&dec->hsd, 11, 8) < 0) {
+                return HSDR_POLL_ERROR_UNKNOWN;
+            }
+            break;
+        case IMAGE_CODEC_ROW_RLE:
+            row_rle_reset(&dec->rle);
+            break;
+        case IMAGE_CODEC_HEATSHRINK_PARAMS:
+            dec->need_params = true;
+            break;
+        default:
+            LOG_ERR("host sent an image in unknown codec %d", dec->codec);
+            return HSDR_POLL_ERROR_UNKNOWN;
+        }
+        LOG_INF("image codec: %d", dec->codec);
+    }
+
+    if (dec->need_params) {
+        if (len == 0) {
+            *consumed = skipped;
+            return HSDR_POLL_EMPTY;
+        }
+        uint8_t params = in[0];
+        in++;
+        len--;
+        skipped++;
+        if (heatshrink_start(&dec->hsd, params >> 4, params & 0x0F) < 0) {
+            return HSDR_POLL_ERROR_UNKNOWN;
+        }
+        dec->need_params = false;
+        LOG_INF("heatshrink window %u, lookahead %u", params >> 4, params & 0x0F);
+    }
+
+    switch (dec->codec) {
+    case IMAGE_CODEC_HEATSHRINK:
+    case IMAGE_CODEC_HEATSHRINK_PARAMS:
+        res = heatshrink_decode(&dec->hsd, in, len, consumed, out, space, produced);
+        break;
+    case IMAGE_CODEC_ROW_RLE:
+        res = row_rle_decode(&dec->rle, in, len, consumed, out, space, produced);
+        break;
+    default:
+        return HSDR_POLL_ERROR_UNKNOWN;
+    }
+    *consumed += skipped;
+    return res;
+}
+
+HSD_finish_res image_decoder_finish(struct image_decoder *dec) {
+    if (dec->need_params) {
+        return HSDR_FINISH_DONE;
+    }
+    switch (dec->codec) {
+    case IMAGE_CODEC_HEATSHRINK:
+    case IMAGE_CODEC_HEATSHRINK_PARAMS:
+        return heatshrink_decoder_finish(&dec->hsd);
+    case IMAGE_CODEC_ROW_RLE:
+        // Only a run can still have output without more input.
+        return (dec->rle.state == RLE_RUN && dec->rle.count > 0) ? HSDR_FINISH_MORE : HSDR_FINISH_DONE;
+    default:
+        return HSDR_FINISH_DONE;
+    }
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <zephyr/sys/util.h>
+
+#include "heatshrink/heatshrink_decoder.h"
+
+// Codecs the host can compress images with. We advertise the ones we support in the image request as a bitmask
+// of BIT(codec), and the host starts the image with one byte naming the codec it picked.
+// The stream formats are described in host/src/image_codec.rs.
+enum image_codec {
+    IMAGE_CODEC_HEATSHRINK = 0, // Window 11, lookahead 8.
+    IMAGE_CODEC_ROW_RLE = 1,
+    IMAGE_CODEC_HEATSHRINK_PARAMS = 2, // One byte of (window << 4 | lookahead) first, within what we advertise.
+};
+
+// Plain heatshrink is always 11/8, which we can only take if the decoder is built at least that big.
+#if HEATSHRINK_STATIC_WINDOW_BITS >= 11 && HEATSHRINK_STATIC_LOOKAHEAD_BITS >= 8
+#define IMAGE_CODECS_SUPPORTED \
+    (BIT(IMAGE_CODEC_HEATSHRINK) | BIT(IMAGE_CODEC_ROW_RLE) | BIT(IMAGE_CODEC_HEATSHRINK_PARAMS))
+#else
+#define IMAGE_CODECS_SUPPORTED (BIT(IMAGE_CODEC_ROW_RLE) | BIT(IMAGE_CODEC_HEATSHRINK_PARAMS))
+#endif
+
+// Row RLE needs the previous row to undo row deltas. 800 pixels at 2bpp is 200 bytes.
+#define ROW_RLE_MAX_ROW_BYTES 256
+
+struct row_rle_decoder {
+    uint8_t state;
+    uint8_t header[6];
+    uint8_t header_len;
+    uint16_t row_bytes;
+    uint32_t plane_bytes;
+    uint32_t plane_remaining;
+    uint8_t mode;
+    uint8_t op; // Control byte of the op in progress.
+    uint8_t value; // Byte being repeated by a run.
+    uint32_t count; // Bytes left in the current literal or run.
+    uint8_t len_shift; // Position in a varint run length.
+    uint16_t col;
+    uint8_t prev_row[ROW_RLE_MAX_ROW_BYTES];
+};
+
+// Decoder for an image stream in any of the supported codecs, picked by the stream's first byte.
+struct image_decoder {
+    int codec; // -1 until the codec byte has arrived.
+    bool need_params; // Waiting on the parameter byte of IMAGE_CODEC_HEATSHRINK_PARAMS.
+    union {
+        heatshrink_decoder hsd;
+        struct row_rle_decoder rle;
+    };
+};
+
+void image_decoder_reset(struct image_decoder *dec);
+// Decode from IN into at most SPACE bytes at OUT, setting *CONSUMED and *PRODUCED.
+// Same contract as heatshrink_decoder_decode: HSDR_POLL_MORE if OUT filled up (call again with the rest of IN),
+// HSDR_POLL_EMPTY once all of IN is consumed, negative on error (including an unknown codec or a malformed stream).
+HSD_poll_res image_decoder_decode(struct image_decoder *dec, const uint8_t *in, size_t len, size_t *consumed,
+                                  uint8_t *out, size_t space, size_t *produced);
+// Call at the end of the stream. HSDR_FINISH_MORE means there's still output to collect with image_decoder_decode.
+HSD_finish_res image_decoder_finish(struct image_decoder *dec);
@@ -16,6 +16,7 @@
 #include <zephyr/net/openthread.h>
 #include <openthread/thread.h>
 #include <openthread/dataset.h>
+#include <openthread/link.h>
 
 #include <zephyr/net/net_mgmt.h>
 #include <zephyr/net/socket.h>
@@ -23,14 +24,17 @@
 
 #include <zephyr/dfu/flash_img.h>
 #include <zephyr/dfu/mcuboot.h>
+#include <zephyr/storage/flash_map.h>
 
 #include <app_version.h>
 #include <zephyr/sys/util.h>
+#include <zephyr/sys/byteorder.h>
+#include <zephyr/sys/crc.h>
 
 #include <stdio.h>
 #include <zephyr/drivers/gpio.h>
 
-#include "heatshrink/heatshrink_decoder.h"
+#include "image_codec.h"
 
 #if DT_NODE_EXISTS(DT_NODELABEL(npm2100_vbat))
 #include <zephyr/drivers/sensor/npm2100_vbat.h>
@@ -45,6 +49,7 @@
 #include <zcbor_encode.h>
 
 #include "coap_request.h"
+#include "fw_delta.h"
 #include "cbor.h"
 #include "wrapped_settings.h"
 
@@ -126,11 +131,47 @@ static int epd_cfg_callback(const struct shell* shell, size_t argc, char** argv)
 
 SHELL_CMD_REGISTER(epc, NULL, "epaper config settings", epd_cfg_callback);
 
+// Per-phase timing of the last few display updates since boot, newest first.
+static int epd_timing_callback(const struct shell* shell, size_t argc, char** argv) {
+    const struct device *eink_dev = DEVICE_DT_GET(DT_NODELABEL(eink));
+    struct epd_update_timing timing;
+    size_t i;
+
+    for (i = 0; epd_get_update_timing(eink_dev, i, &timing) == 0; i++) {
+        shell_print(shell, "#%zu type %u%s: spi %u us", i, timing.epd_type, timing.partial ? " (partial)" : "", timing.spi_time_us);
+        shell_print(shell, "  power on  %10u us %8u B", timing.phases[EPD_PHASE_POWER_ON].time_us, timing.phases[EPD_PHASE_POWER_ON].bytes);
+        shell_print(shell, "  transfer  %10u us %8u B", timing.phases[EPD_PHASE_TRANSFER].time_us, timing.phases[EPD_PHASE_TRANSFER].bytes);
+        shell_print(shell, "  refresh   %10u us %8u B", timing.phases[EPD_PHASE_REFRESH].time_us, timing.phases[EPD_PHASE_REFRESH].bytes);
+        shell_print(shell, "  power off %10u us %8u B", timing.phases[EPD_PHASE_POWER_OFF].time_us, timing.phases[EPD_PHASE_POWER_OFF].bytes);
+    }
+    if (i == 0) {
+        shell_print(shell, "no display updates since boot");
+    }
+    return 0;
+}
+
+SHELL_CMD_REGISTER(ept, NULL, "epaper update timings", epd_timing_callback);
+
 
 /* Define the size of the box */
 #define BOX_WIDTH  40
 #define BOX_HEIGHT 40
 
+// What this wake cost on the network, saved at hibernate for the next heartbeat to report.
+#define NET_STATS_KEY "net_stats"
+static struct net_stats net_stats;
+static int64_t ot_started;
+
+// main() sleeps until Thread attaches, or gives up on it, rather than polling the role.
+#define WAKE_EVENT_ATTACHED BIT(0)
+#define WAKE_EVENT_ATTACH_TIMEOUT BIT(1)
+static K_EVENT_DEFINE(wake_events);
+
+static void attach_timeout(struct k_timer *timer) {
+    k_event_post(&wake_events, WAKE_EVENT_ATTACH_TIMEOUT);
+}
+static K_TIMER_DEFINE(attach_timer, attach_timeout, NULL);
+
 static void on_thread_state_changed(otChangedFlags flags, void *user_data)
 {
 	if (flags & OT_CHANGED_THREAD_ROLE) {
@@ -138,13 +179,18 @@ static void on_thread_state_changed(otChangedFlags flags, void *user_data)
 		case OT_DEVICE_ROLE_CHILD:
 		case OT_DEVICE_ROLE_ROUTER:
 		case OT_DEVICE_ROLE_LEADER:
-			LOG_INF("OpenThread connected");
+			if (net_stats.attach_ms == 0) {
+				net_stats.attach_ms = MAX(k_uptime_get() - ot_started, 1);
+			}
+			LOG_INF("OpenThread connected after %u ms", net_stats.attach_ms);
+			k_event_post(&wake_events, WAKE_EVENT_ATTACHED);
 			break;
 
 		case OT_DEVICE_ROLE_DISABLED:
 		case OT_DEVICE_ROLE_DETACHED:
 		default:
 			LOG_INF("OpenThread detached");
+			k_event_clear(&wake_events, WAKE_EVENT_ATTACHED);
 			break;
 		}
 	}
@@ -161,6 +207,44 @@ static void on_thread_state_changed(otChangedFlags flags, void *user_data)
     }
 }
 
+// Note what a request cost.
+static void net_stats_add(enum net_transfer_kind kind, coap_request_result_t res, const struct coap_request_stats *stats) {
+    if (net_stats.num_transfers >= NET_STATS_MAX_TRANSFERS) {
+        return;
+    }
+    struct net_transfer *t = &net_stats.transfers[net_stats.num_transfers++];
+    t->kind = kind;
+    t->result = res;
+    t->bytes = stats->bytes;
+    t->elapsed_ms = stats->elapsed_ms;
+    t->replies = stats->replies;
+    t->retransmits = stats->retransmits;
+    LOG_INF("net: request %u took %u ms for %u bytes, %u replies (%u retransmits)", kind, t->elapsed_ms, t->bytes,
+            t->replies, t->retransmits);
+}
+
+// Keep this wake's stats for the next heartbeat, along with how the link to our parent ended up.
+static void net_stats_save(const struct coap_session *session) {
+    otInstance *instance = openthread_get_default_instance();
+    otRouterInfo parent;
+
+    if (otThreadGetDeviceRole(instance) == OT_DEVICE_ROLE_CHILD && otThreadGetParentInfo(instance, &parent) == OT_ERROR_NONE) {
+        net_stats.parent_rloc16 = parent.mRloc16;
+        net_stats.parent_lq_in = parent.mLinkQualityIn;
+        net_stats.parent_lq_out = parent.mLinkQualityOut;
+        if (otThreadGetParentAverageRssi(instance, &net_stats.parent_rssi) != OT_ERROR_NONE) {
+            net_stats.parent_rssi = 0;
+        }
+    }
+    if (session != NULL) {
+        net_stats.srtt_ms = session->srtt_ms;
+    }
+    int ret = wrapped_settings_set_raw(NET_STATS_KEY, (uint8_t *)&net_stats, sizeof(net_stats));
+    if (ret < 0) {
+        LOG_ERR("failed to save network stats: %d", ret);
+    }
+}
+
 static struct openthread_state_changed_callback ot_state_chaged_cb = {
 	.otCallback = on_thread_state_changed};
 
@@ -168,19 +252,225 @@ static struct openthread_state_changed_callback ot_state_chaged_cb = {
 
 static struct coap_client client = {0};
 
-static int fw_coap_response(const uint8_t *payload, size_t len, size_t offset, bool last_block, void *user_data) {
-    struct flash_img_context *write_ctx = (struct flash_img_context *) user_data;
+// A firmware download that doesn't finish in one wake carries on where it left off in the next one. FW_DOWNLOAD_KEY
+// holds the version being downloaded; how much of it is already in flash is stream_flash's own progress record.
+#define FW_DOWNLOAD_KEY "fw_dl"
+#define FW_PROGRESS_KEY "fw_progress"
+// Record progress every this many bytes, in case we lose power partway.
+#define FW_PROGRESS_INTERVAL (32 * 1024)
+// The version whose delta we couldn't apply, so we fetch it whole instead.
+#define FW_NO_DELTA_KEY "fw_no_delta"
+
+// Firmware comes compressed when it helps, as this magic and then an image stream (see host/src/image_codec.rs).
+// We tell the host we can take that with protocol_version 2, which means decoding plain heatshrink.
+#define FW_COMPRESSED_MAGIC "WPZ1"
+#define FW_COMPRESSED_MAGIC_LEN 4
+#define HEARTBEAT_PROTOCOL_VERSION ((IMAGE_CODECS_SUPPORTED & BIT(IMAGE_CODEC_HEATSHRINK)) ? 2 : 1)
+
+struct fw_write_context {
+    struct flash_img_context img;
+    size_t resumed_at;
+    size_t saved; // Bytes in flash as of the last progress record.
+    const struct flash_area *running; // The image we're running, when we asked for a delta against it.
+    bool compressed; // The host sent the download compressed, see host/src/image_codec.rs.
+    bool delta; // The host sent a delta.
+    size_t received; // Bytes of the download after decompression.
+    uint8_t head[FW_DELTA_MAGIC_LEN]; // Enough of the download to tell a delta from an image.
+    size_t head_len;
+    struct fw_delta applier;
+    struct image_decoder dec;
+    uint8_t decoded[256];
+};
+
+// Only bytes stream_flash has written out count - anything still in its buffer is fetched again on resume.
+static void fw_save_progress(struct fw_write_context *ctx) {
+    size_t written = flash_img_bytes_written(&ctx->img);
+
+    if (written == ctx->saved) {
+        return;
+    }
+    int ret = stream_flash_progress_save(&ctx->img.stream, FW_PROGRESS_KEY);
+    if (ret < 0) {
+        LOG_ERR("failed to save firmware download progress: %d", ret);
+        return;
+    }
+    ctx->saved = written;
+    LOG_INF("Firmware download progress: %zu bytes", written);
+}
+
+static void fw_forget_progress(struct fw_write_context *ctx) {
+    uint8_t none = 0;
+
+    stream_flash_progress_clear(&ctx->img.stream, FW_PROGRESS_KEY);
+    wrapped_settings_set_raw(FW_DOWNLOAD_KEY, &none, 0);
+    ctx->saved = 0;
+}
+
+// Pick up a download of VERSION from an earlier wake, if there was one. Returns the offset to continue from.
+static size_t fw_resume(struct fw_write_context *ctx, uint32_t version) {
+    uint32_t saved_version = 0;
+    size_t len = 0;
+    int ret = wrapped_settings_get_raw(FW_DOWNLOAD_KEY, (uint8_t *)&saved_version, sizeof(saved_version), &len);
+
+    if (ret == 0 && len == sizeof(saved_version) && saved_version == version) {
+        ret = stream_flash_progress_load(&ctx->img.stream, FW_PROGRESS_KEY);
+        if (ret < 0) {
+            LOG_WRN("failed to load firmware download progress, starting over: %d", ret);
+        } else {
+            ctx->saved = flash_img_bytes_written(&ctx->img);
+            ctx->resumed_at = ctx->saved;
+            if (ctx->resumed_at > 0) {
+                LOG_INF("Resuming download of %08x at %zu bytes", version, ctx->resumed_at);
+            }
+            return ctx->resumed_at;
+        }
+    }
+
+    // Nothing to resume, or it was of another version.
+    fw_forget_progress(ctx);
+    ret = wrapped_settings_set_raw(FW_DOWNLOAD_KEY, (uint8_t *)&version, sizeof(version));
+    if (ret < 0) {
+        LOG_ERR("failed to save firmware download version: %d", ret);
+    }
+    return 0;
+}
+
+static bool fw_delta_allowed(uint32_t version) {
+    uint32_t failed_version = 0;
+    size_t len = 0;
+    int ret = wrapped_settings_get_raw(FW_NO_DELTA_KEY, (uint8_t *)&failed_version, sizeof(failed_version), &len);
+
+    return !(ret == 0 && len == sizeof(failed_version) && failed_version == version);
+}
+
+static int fw_read_running(void *ctx, size_t offset, uint8_t *buf, size_t len) {
+    struct fw_write_context *write_ctx = (struct fw_write_context *) ctx;
+
+    return flash_area_read(write_ctx->running, offset, buf, len);
+}
+
+static int fw_write_new(void *ctx, const uint8_t *data, size_t len) {
+    struct fw_write_context *write_ctx = (struct fw_write_context *) ctx;
+
+    return flash_img_buffered_write(&write_ctx->img, data, len, false);
+}
+
+// Write LEN bytes of an image (or a delta to one) to flash.
+static int fw_store(struct fw_write_context *write_ctx, const uint8_t *data, size_t len, bool last) {
+    // What a delta has written so far isn't somewhere in the delta we could ask the host to resume from, so there's
+    // no progress to save.
+    if (write_ctx->delta) {
+        if (fw_delta_write(&write_ctx->applier, data, len) < 0 || (last && fw_delta_finish(&write_ctx->applier) < 0)) {
+            return -1;
+        }
+        return 0;
+    }
 
     int err = 0;
-    if ((err = flash_img_buffered_write(write_ctx, payload, len, last_block)) < 0) {
+    if ((err = flash_img_buffered_write(&write_ctx->img, data, len, last)) < 0) {
         LOG_ERR("Failed writing to flash: %d", err);
         return -1;
-    } else {
-        LOG_INF("Write succeeded for this block (pos %zu), continuing", offset + len);
+    }
+
+    if (flash_img_bytes_written(&write_ctx->img) - write_ctx->saved >= FW_PROGRESS_INTERVAL) {
+        fw_save_progress(write_ctx);
     }
     return 0;
 }
 
+// The download, decompressed if it came compressed.
+static int fw_receive(struct fw_write_context *write_ctx, const uint8_t *data, size_t len, bool last) {
+    write_ctx->received += len;
+
+    // The host only sends a delta if we asked and it's smaller than the image. It starts with FW_DELTA_MAGIC where an
+    // image starts with MCUboot's header. Decompressed, the first few bytes can come in separate pieces.
+    if (write_ctx->running && write_ctx->head_len < FW_DELTA_MAGIC_LEN) {
+        size_t n = MIN(len, FW_DELTA_MAGIC_LEN - write_ctx->head_len);
+
+        memcpy(write_ctx->head + write_ctx->head_len, data, n);
+        write_ctx->head_len += n;
+        data += n;
+        len -= n;
+        if (write_ctx->head_len < FW_DELTA_MAGIC_LEN && !last) {
+            return 0;
+        }
+
+        write_ctx->delta = memcmp(write_ctx->head, FW_DELTA_MAGIC, FW_DELTA_MAGIC_LEN) == 0;
+        if (write_ctx->delta) {
+            struct fw_delta_io io = {
+                .read_source = fw_read_running,
+                .write_target = fw_write_new,
+                .ctx = write_ctx,
+            };
+            fw_delta_init(&write_ctx->applier, &io, write_ctx->running->fa_size);
+        }
+        if (fw_store(write_ctx, write_ctx->head, write_ctx->head_len, last && len == 0) < 0) {
+            return -1;
+        }
+        if (len == 0) {
+            return 0;
+        }
+    }
+    return fw_store(write_ctx, data, len, last);
+}
+
+static int fw_decompress(struct fw_write_context *write_ctx, const uint8_t *payload, size_t len, bool last_block) {
+    HSD_poll_res pres;
+    size_t pos = 0;
+    size_t consumed;
+    size_t produced;
+
+    do {
+        pres = image_decoder_decode(&write_ctx->dec, payload + pos, len - pos, &consumed, write_ctx->decoded,
+                                    sizeof(write_ctx->decoded), &produced);
+        if (pres < 0) {
+            LOG_ERR("Failed to decompress firmware: %d", pres);
+            return -1;
+        }
+        pos += consumed;
+        if (produced > 0 && fw_receive(write_ctx, write_ctx->decoded, produced, false) < 0) {
+            return -1;
+        }
+    } while (pres == HSDR_POLL_MORE || pos < len);
+
+    if (!last_block) {
+        return 0;
+    }
+    while (image_decoder_finish(&write_ctx->dec) == HSDR_FINISH_MORE) {
+        pres = image_decoder_decode(&write_ctx->dec, NULL, 0, &consumed, write_ctx->decoded,
+                                    sizeof(write_ctx->decoded), &produced);
+        if (pres < 0 || fw_receive(write_ctx, write_ctx->decoded, produced, false) < 0) {
+            return -1;
+        }
+    }
+    return fw_receive(write_ctx, NULL, 0, true);
+}
+
+static int fw_coap_response(const uint8_t *payload, size_t len, size_t offset, bool last_block, void *user_data) {
+    struct fw_write_context *write_ctx = (struct fw_write_context *) user_data;
+    int ret;
+
+    if (offset == 0) {
+        write_ctx->compressed = len >= FW_COMPRESSED_MAGIC_LEN &&
+                                memcmp(payload, FW_COMPRESSED_MAGIC, FW_COMPRESSED_MAGIC_LEN) == 0;
+        if (write_ctx->compressed) {
+            image_decoder_reset(&write_ctx->dec);
+            payload += FW_COMPRESSED_MAGIC_LEN;
+            len -= FW_COMPRESSED_MAGIC_LEN;
+        }
+    }
+
+    if (write_ctx->compressed) {
+        ret = fw_decompress(write_ctx, payload, len, last_block);
+    } else {
+        ret = fw_receive(write_ctx, payload, len, last_block);
+    }
+    if (ret == 0) {
+        LOG_INF("Write succeeded for this block (pos %zu), continuing", write_ctx->resumed_at + write_ctx->received);
+    }
+    return ret;
+}
+
 #define DISPLAY_WIDTH 800
 #define DISPLAY_HEIGHT 480
 
@@ -204,88 +494,419 @@ static int buffer_coap_response(const uint8_t *payload, size_t len, size_t offse
     return 0;
 }
 
+#define IMAGE_CRC_LEN 4
+
+enum img_panel_state {
+    IMG_PANEL_OFF,
+    IMG_PANEL_STARTING, // main() is powering it up, and blocks are held until it has.
+    IMG_PANEL_READY, // img_coap_response writes blocks out as they come (or fails them, if panel_result < 0).
+};
+
+struct img_held_block {
+    uint8_t data[CONFIG_APP_COAP_BLOCK_SIZE];
+    size_t len;
+    bool last_block;
+};
+
 struct image_write_context {
     struct device *eink_dev;
     size_t max_data;
     size_t total_produced;
-    
-    heatshrink_decoder hsd;
+
+    // Ping-pong output buffers. The decoder fills the active one while the other is
+    // being clocked out to the display asynchronously.
+    uint8_t out_bufs[2][CONFIG_APP_IMAGE_BUFFER_SIZE];
+    uint8_t active_buf;
+    size_t active_fill;
+
+    // Multi-plane displays get all planes back-to-back in one stream, each plane_size bytes long.
+    // We switch the display over to the next plane when the current one is full.
+    size_t plane_size;
+    int num_planes;
+    int current_plane;
+    size_t plane_remaining;
+
+    // Unless there's no ETag to revalidate, the panel is only powered on once image data actually arrives, so a
+    // 2.03 Valid never wakes it. main() does that (img_power_up_on_data) when img_coap_response signals the first
+    // block, so the panel's init sequence doesn't hold up coap_client's thread. Blocks that arrive in the meantime
+    // wait in held[], and main() writes them out before it hands the panel over to img_coap_response.
+    bool panel_on;
+    enum img_panel_state panel_state;
+    struct k_mutex panel_lock; // Guards panel_state and held[] between coap_client's thread and main().
+    struct k_poll_signal panel_signal;
+    int panel_result;
+    struct img_held_block held[CONFIG_APP_IMAGE_HELD_BLOCKS];
+    size_t held_first;
+    size_t held_count;
+    // Running hash of the compressed image, which the host also uses as the image's ETag.
+    uint64_t etag_hash;
+    // Running CRC32 of the decoded frame, checked against the one the host appends before we refresh.
+    // The trailer is the last IMAGE_CRC_LEN bytes of the payload, so that many are held back from the decoder
+    // until we know whether more data follows.
+    uint32_t frame_crc;
+    uint8_t crc_tail[IMAGE_CRC_LEN];
+    size_t crc_held;
+
+    struct image_decoder dec;
 };
 
-static int img_coap_response(const uint8_t *payload, size_t len, size_t offset, bool last_block, void *user_data)
-{
-    struct image_write_context * ctx = (struct image_write_context *) user_data;
-    size_t payload_pos = 0;
-    HSD_sink_res sres;
+#define IMAGE_ETAG_KEY "img_etag"
+#define IMAGE_ETAG_LEN 8
+// Tries per wake at getting a complete image before giving up until the next one.
+#define IMAGE_FETCH_ATTEMPTS 3
+
+// Block2 size for image and firmware downloads. Each wake starts from what the last one settled on, and it's
+// adjusted after every download by how many blocks had to be resent.
+#define DOWNLOAD_SZX_KEY "coap_szx"
+#define DOWNLOAD_MAX_SZX coap_bytes_to_block_size(CONFIG_APP_COAP_BLOCK_SIZE)
+BUILD_ASSERT(IS_POWER_OF_TWO(CONFIG_APP_COAP_BLOCK_SIZE), "CoAP block sizes are powers of two");
+BUILD_ASSERT(CONFIG_APP_COAP_BLOCK_SIZE <= CONFIG_COAP_CLIENT_BLOCK_SIZE,
+             "coap_client won't take blocks larger than COAP_CLIENT_BLOCK_SIZE");
+static enum coap_block_size download_szx;
+
+// Radio frames in and out, from OpenThread's MAC counters. Each 6LoWPAN fragment is a frame, so comparing these
+// across a download shows what a block size costs on air.
+struct radio_frames {
+    uint32_t tx;
+    uint32_t tx_retry; // Resent for lack of an ACK.
+    uint32_t rx;
+};
+// 127 byte PSDU plus preamble and header at 250 kbit/s.
+#define RADIO_MAX_FRAME_US 4256
+
+static void radio_frames_get(struct radio_frames *frames) {
+    const otMacCounters *counters = otLinkGetCounters(openthread_get_default_instance());
+
+    frames->tx = counters->mTxTotal;
+    frames->tx_retry = counters->mTxRetry;
+    frames->rx = counters->mRxTotal;
+}
+
+static void download_szx_load(void) {
+    uint8_t szx;
+    size_t len = 0;
+    int ret = wrapped_settings_get_raw(DOWNLOAD_SZX_KEY, &szx, sizeof(szx), &len);
+
+    download_szx = (ret == 0 && len == sizeof(szx) && szx <= DOWNLOAD_MAX_SZX) ? szx : DOWNLOAD_MAX_SZX;
+    LOG_INF("Download block size: %u", coap_block_size_to_bytes(download_szx));
+}
+
+// Log what a download cost, and pick the block size for the next one.
+static void download_done(const char *what, coap_request_result_t res, const struct coap_blockwise *bw,
+                          const struct radio_frames *before, int64_t started) {
+    struct radio_frames after;
+
+    radio_frames_get(&after);
+    uint32_t frames = (after.tx - before->tx) + (after.rx - before->rx);
+    LOG_INF("%s: result %d in %u ms, %u blocks of %zu bytes (%u slow)", what, res, (uint32_t)(k_uptime_get() - started),
+            bw->blocks, bw->block_size, bw->slow_blocks);
+    LOG_INF("%s: %u frames sent (%u retries), %u received, at most %u ms on air", what, after.tx - before->tx,
+            after.tx_retry - before->tx_retry, after.rx - before->rx, frames * RADIO_MAX_FRAME_US / 1000);
+
+    enum coap_block_size next = coap_blockwise_next_szx(bw, DOWNLOAD_MAX_SZX);
+    if (next != download_szx) {
+        LOG_INF("Download block size %u -> %u", coap_block_size_to_bytes(download_szx),
+                coap_block_size_to_bytes(next));
+        download_szx = next;
+        uint8_t szx = next;
+        int ret = wrapped_settings_set_raw(DOWNLOAD_SZX_KEY, &szx, sizeof(szx));
+        if (ret < 0) {
+            LOG_ERR("failed to save download block size: %d", ret);
+        }
+    }
+}
+
+// 64-bit FNV-1a over the compressed image, matching content_etag on the host.
+// coap_client doesn't hand us response options, so we work out the ETag ourselves as the image streams in.
+#define IMAGE_ETAG_SEED 0xcbf29ce484222325ULL
+static uint64_t image_etag_update(uint64_t hash, const uint8_t *data, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+// Power the panel up and point it at the first plane.
+static int img_start_panel(struct image_write_context *ctx) {
+    int epd_res = epd_power_on(ctx->eink_dev);
+    if (epd_res < 0) {
+        LOG_ERR("failed to power on display: %d", epd_res);
+        return -1;
+    }
+    ctx->panel_on = true;
+
+    // Whatever the panel showed is about to be overwritten, so the stored ETag no longer describes it.
+    uint8_t none = 0;
+    wrapped_settings_set_raw(IMAGE_ETAG_KEY, &none, 0);
+
+    epd_res = epd_start_write_data(ctx->eink_dev, 0);
+    if (epd_res < 0) {
+        LOG_ERR("failed to init write: %d", epd_res);
+        return -1;
+    }
+    return 0;
+}
+
+// Hand the active buffer to the display and switch to the other one.
+// This blocks only if the previous buffer still hasn't finished going out.
+static int img_flush_buffer(struct image_write_context *ctx) {
+    if (ctx->active_fill == 0) {
+        return 0;
+    }
+
+    int epd_res = epd_continue_write_data_async(ctx->eink_dev, ctx->out_bufs[ctx->active_buf], ctx->active_fill);
+    if (epd_res < 0) {
+        LOG_ERR("Failed write to display: %d", epd_res);
+        return -1;
+    }
+    ctx->active_buf ^= 1;
+    ctx->active_fill = 0;
+    return 0;
+}
+
+// Called when the current plane is full: push out what's left of it and point the display at the next plane.
+static int img_next_plane(struct image_write_context *ctx) {
+    if (img_flush_buffer(ctx) < 0) {
+        return -1;
+    }
+
+    ctx->current_plane++;
+    if (ctx->current_plane >= ctx->num_planes) {
+        return 0;
+    }
+
+    LOG_INF("Starting plane %d", ctx->current_plane);
+    int epd_res = epd_start_write_data(ctx->eink_dev, ctx->current_plane);
+    if (epd_res < 0) {
+        LOG_ERR("failed to start plane %d: %d", ctx->current_plane, epd_res);
+        return -1;
+    }
+    ctx->plane_remaining = ctx->plane_size;
+    return 0;
+}
+
+// Decode all of IN (which may be empty, to drain what's left after finish) straight into the output buffers.
+// A buffer never straddles two planes, so each plane's data is flushed before its successor's command goes out.
+static int img_drain_decoder(struct image_write_context *ctx, const uint8_t *in, size_t len) {
     HSD_poll_res pres;
-    HSD_finish_res fres;
+    size_t pos = 0;
+    do {
+        size_t consumed = 0;
+        size_t did_poll = 0;
+
+        if (ctx->plane_remaining == 0) {
+            // Every plane is full - anything else the decoder produces would overrun the display.
+            uint8_t extra;
+            pres = image_decoder_decode(&ctx->dec, in + pos, len - pos, &consumed, &extra, sizeof(extra), &did_poll);
+            pos += consumed;
+            if (pres < 0 || did_poll > 0) {
+                LOG_ERR("would overrun: more than %zu received", ctx->total_produced);
+                return -1;
+            }
+            continue;
+        }
+
+        size_t space = MIN(sizeof(ctx->out_bufs[0]) - ctx->active_fill, ctx->plane_remaining);
+        pres = image_decoder_decode(&ctx->dec, in + pos, len - pos, &consumed,
+                          ctx->out_bufs[ctx->active_buf] + ctx->active_fill, space, &did_poll);
+        if (pres < 0) {
+            LOG_ERR("poll failed: %d", pres);
+            return -1;
+        }
+        pos += consumed;
+        ctx->frame_crc = crc32_ieee_update(ctx->frame_crc, ctx->out_bufs[ctx->active_buf] + ctx->active_fill, did_poll);
+        ctx->total_produced += did_poll;
+        if (ctx->total_produced > ctx->max_data) {
+            LOG_ERR("would overrun: %zu received", ctx->total_produced);
+            return -1;
+        }
 
-    uint8_t temp_buffer[100];
-
-    while (payload_pos < len) {
-        size_t size_in_payload = len - payload_pos;
-        size_t actually_read = 0;
-        sres = heatshrink_decoder_sink(&ctx->hsd, payload + payload_pos, size_in_payload, &actually_read);
-        payload_pos+= actually_read;
-        do {
-            size_t did_poll = 0;
-            pres = heatshrink_decoder_poll(&ctx->hsd, temp_buffer, sizeof(temp_buffer), &did_poll);
-            if (pres < 0) { 
-                LOG_ERR("pres1 failed: %d", pres);
+        ctx->active_fill += did_poll;
+        ctx->plane_remaining -= did_poll;
+        if (ctx->plane_remaining == 0) {
+            if (img_next_plane(ctx) < 0) {
                 return -1;
             }
-            //LOG_INF("Polled for %zu bytes", did_poll);
-            ctx->total_produced += did_poll;
-            if (ctx->total_produced > ctx->max_data) {
-                LOG_ERR("would overrun: %zu received", ctx->total_produced);
+        } else if (ctx->active_fill == sizeof(ctx->out_bufs[0])) {
+            if (img_flush_buffer(ctx) < 0) {
                 return -1;
             }
+        }
+    } while (pres == HSDR_POLL_MORE || pos < len);
 
-            if (did_poll > 0) {
-                int epd_res = epd_continue_write_data(ctx->eink_dev, temp_buffer, did_poll);
-                if (epd_res < 0) {
-                    LOG_ERR("Failed write to display: %d", epd_res);
-                    return -1;
-                }
-            }
-        } while (pres == HSDR_POLL_MORE);
+    return 0;
+}
+
+// Decode everything received so far except the last IMAGE_CRC_LEN bytes, which might be the CRC trailer.
+static int img_decode_payload(struct image_write_context *ctx, const uint8_t *payload, size_t len) {
+    size_t total = ctx->crc_held + len;
+    size_t feed = total > IMAGE_CRC_LEN ? total - IMAGE_CRC_LEN : 0;
+
+    // Bytes held back from the last block come first.
+    size_t from_held = MIN(feed, ctx->crc_held);
+    if (from_held > 0) {
+        if (img_drain_decoder(ctx, ctx->crc_tail, from_held) < 0) {
+            return -1;
+        }
+        memmove(ctx->crc_tail, ctx->crc_tail + from_held, ctx->crc_held - from_held);
+        ctx->crc_held -= from_held;
+    }
+
+    size_t from_payload = feed - from_held;
+    if (from_payload > 0 && img_drain_decoder(ctx, payload, from_payload) < 0) {
+        return -1;
+    }
+    memcpy(ctx->crc_tail + ctx->crc_held, payload + from_payload, len - from_payload);
+    ctx->crc_held += len - from_payload;
+    return 0;
+}
+
+// Only a whole frame that matches the host's CRC is worth a refresh.
+static int img_verify_frame(struct image_write_context *ctx) {
+    if (ctx->total_produced != ctx->max_data) {
+        LOG_ERR("short frame: %zu of %zu bytes", ctx->total_produced, ctx->max_data);
+        return -1;
+    }
+    if (ctx->crc_held != IMAGE_CRC_LEN) {
+        LOG_ERR("image ended without a CRC");
+        return -1;
+    }
+    uint32_t expected = sys_get_le32(ctx->crc_tail);
+    if (ctx->frame_crc != expected) {
+        LOG_ERR("frame CRC mismatch: got %08x, host sent %08x", ctx->frame_crc, expected);
+        return -1;
+    }
+    return 0;
+}
+
+// Decode a block of the image and write it out to the panel, which is already on.
+static int img_write_block(struct image_write_context *ctx, const uint8_t *payload, size_t len, bool last_block)
+{
+    HSD_finish_res fres;
+
+    ctx->etag_hash = image_etag_update(ctx->etag_hash, payload, len);
+
+    if (img_decode_payload(ctx, payload, len) < 0) {
+        return -1;
     }
 
     LOG_INF("Total produced: %zu", ctx->total_produced);
 	    
     if (last_block) {
-        fres = heatshrink_decoder_finish(&ctx->hsd);
+        fres = image_decoder_finish(&ctx->dec);
         if (fres == HSDR_FINISH_MORE) {
             LOG_INF("Got bytes after finish...");
-            do {
-                size_t did_poll = 0;
-                pres = heatshrink_decoder_poll(&ctx->hsd, temp_buffer, sizeof(temp_buffer), &did_poll);
-                if (pres < 0) { 
-                    LOG_ERR("pres failed: %d", pres);
-                    return -1;
-                }
-                LOG_INF("finish polled for %zu bytes", did_poll);
-                ctx->total_produced += did_poll;
-                if (ctx->total_produced > ctx->max_data) {
-                    LOG_ERR("would overrun: %zu received", ctx->total_produced);
-                    return -1;
-                }
-                if (did_poll > 0) {
-                    int epd_res = epd_continue_write_data(ctx->eink_dev, temp_buffer, did_poll);
-                    if (epd_res < 0) {
-                        LOG_ERR("Failed write to display: %d", epd_res);
-                        return -1;
-                    }
-                }
-            } while (pres == HSDR_POLL_MORE);
+            if (img_drain_decoder(ctx, NULL, 0) < 0) {
+                return -1;
+            }
         } else {
             LOG_INF("Finish result: %d", fres);
         }
+        // Push out whatever is left in the partially filled buffer, and wait for it to land.
+        if (img_flush_buffer(ctx) < 0) {
+            return -1;
+        }
+        int epd_res = epd_wait_write_data(ctx->eink_dev);
+        if (epd_res < 0) {
+            LOG_ERR("Failed write to display: %d", epd_res);
+            return -1;
+        }
+        if (img_verify_frame(ctx) < 0) {
+            return -1;
+        }
     }
 
     return 0;
 }
 
+// Keep a block for main() to write out once the panel is up. Called with panel_lock held.
+static int img_hold_block(struct image_write_context *ctx, const uint8_t *payload, size_t len, bool last_block)
+{
+    if (ctx->held_count == ARRAY_SIZE(ctx->held) || len > sizeof(ctx->held[0].data)) {
+        LOG_ERR("No room to hold a %zu byte block while the panel powers up", len);
+        ctx->panel_result = -ENOBUFS;
+        return -1;
+    }
+    struct img_held_block *held = &ctx->held[(ctx->held_first + ctx->held_count) % ARRAY_SIZE(ctx->held)];
+    memcpy(held->data, payload, len);
+    held->len = len;
+    held->last_block = last_block;
+    ctx->held_count++;
+    return 0;
+}
+
+static int img_coap_response(const uint8_t *payload, size_t len, size_t offset, bool last_block, void *user_data)
+{
+    struct image_write_context * ctx = (struct image_write_context *) user_data;
+    int ret;
+
+    k_mutex_lock(&ctx->panel_lock, K_FOREVER);
+    if (ctx->panel_state != IMG_PANEL_READY) {
+        // Let the next block's request go out while main() powers the panel up.
+        ret = ctx->panel_result < 0 ? -1 : img_hold_block(ctx, payload, len, last_block);
+        if (ctx->panel_state == IMG_PANEL_OFF) {
+            ctx->panel_state = IMG_PANEL_STARTING;
+            k_poll_signal_raise(&ctx->panel_signal, 0);
+        }
+        k_mutex_unlock(&ctx->panel_lock);
+        return ret;
+    }
+    k_mutex_unlock(&ctx->panel_lock);
+
+    if (ctx->panel_result < 0) {
+        return -1;
+    }
+    return img_write_block(ctx, payload, len, last_block);
+}
+
+// Power the panel up once the image's first block arrives, unless the request finishes without one (a 2.03 Valid,
+// or a failure), then write out the blocks held meanwhile. Afterwards panel_result says whether all that worked: the
+// request can succeed with its last block still held, so only this knows whether the frame made it to the panel.
+static void img_power_up_on_data(struct image_write_context *ctx, struct coap_request *req)
+{
+    if (ctx->panel_state == IMG_PANEL_READY) {
+        return;
+    }
+
+    struct k_poll_event events[] = {
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SIGNAL, K_POLL_MODE_NOTIFY_ONLY, &ctx->panel_signal),
+        K_POLL_EVENT_INITIALIZER(K_POLL_TYPE_SEM_AVAILABLE, K_POLL_MODE_NOTIFY_ONLY, &req->done),
+    };
+    k_poll(events, ARRAY_SIZE(events), K_MSEC(MAX(req->deadline - k_uptime_get(), 0)));
+
+    unsigned int signaled;
+    int unused;
+    k_poll_signal_check(&ctx->panel_signal, &signaled, &unused);
+    if (!signaled) {
+        return;
+    }
+
+    int ret = img_start_panel(ctx);
+    for (;;) {
+        k_mutex_lock(&ctx->panel_lock, K_FOREVER);
+        if (ret < 0) {
+            ctx->panel_result = ret;
+        }
+        if (ctx->panel_result < 0 || ctx->held_count == 0) {
+            // From here on img_coap_response writes (or fails) blocks itself.
+            ctx->panel_state = IMG_PANEL_READY;
+            k_mutex_unlock(&ctx->panel_lock);
+            return;
+        }
+        struct img_held_block *held = &ctx->held[ctx->held_first];
+        k_mutex_unlock(&ctx->panel_lock);
+
+        // coap_client's thread only ever adds behind this one, so it's safe to read unlocked.
+        ret = img_write_block(ctx, held->data, held->len, held->last_block);
+
+        k_mutex_lock(&ctx->panel_lock, K_FOREVER);
+        ctx->held_first = (ctx->held_first + 1) % ARRAY_SIZE(ctx->held);
+        ctx->held_count--;
+        k_mutex_unlock(&ctx->panel_lock);
+    }
+}
+
 uint64_t get_deviceaddr_mac() {
 
     uint64_t device_id_mac = 0;
@@ -358,6 +979,121 @@ static const struct device *npm2100_pmic = DEVICE_DT_GET(DT_NODELABEL(npm2100_pm
 static const struct gpio_dt_spec green_led = GPIO_DT_SPEC_GET(DT_ALIAS(heartbeat_led), gpios);
 #endif
 
+// Act on the heartbeat's reply: confirm the image we booted and take the check-in interval the host gave us.
+// Returns the firmware version to upgrade to, or APPVERSION if there's nothing to do.
+static uint32_t hb_handle_reply(const struct coap_request *hb_request, const uint8_t *res_encoded, size_t res_len,
+                                uint32_t *sleep_for_seconds) {
+    net_stats_add(NET_TRANSFER_HEARTBEAT, hb_request->result, &hb_request->stats);
+    LOG_INF("HB return code: %d", hb_request->result);
+    if (hb_request->result != COAP_REQUEST_SUCCESS) {
+        return APPVERSION;
+    }
+
+    LOG_INF("Got %zu bytes from HB", res_len);
+    struct device_heartbeat_response hb_resp;
+    int ret = decode_heartbeat_response(res_encoded, res_len, &hb_resp);
+    if (ret != 0) {
+        LOG_INF("Failed to decode heartbeat: %d", ret);
+        return APPVERSION;
+    }
+
+    if (!boot_is_img_confirmed()) {
+        if (boot_write_img_confirmed() != 0) {
+            LOG_ERR("Failed to mark image as confirmed!");
+        } else {
+            LOG_INF("Marked image as OK.");
+        }
+    }
+
+    LOG_INF("Decoded heartbeat. Desired firmware version: %08x, sleep interval %u", hb_resp.desired_firmware, hb_resp.checkin_interval);
+    *sleep_for_seconds = hb_resp.checkin_interval;
+
+    #if IS_DEVKIT == 0
+    if (hb_resp.desired_firmware == APPVERSION) {
+        LOG_INF("Firmware up to date, no action.");
+    }
+    return hb_resp.desired_firmware;
+    #else
+    LOG_INF("Is devkit, ignoring potential firmware upgrade.");
+    return APPVERSION;
+    #endif
+}
+
+// Download firmware VERSION and, if that works, mark it to boot next. Returns true if the caller should reset
+// into it. The host reads the protocol version from the heartbeat request HB_REQ, which goes with the download.
+static bool fw_upgrade(struct coap_session *session, uint32_t version, const uint8_t *hb_req, size_t hb_req_len) {
+    coap_request_result_t res;
+    int ret;
+
+    LOG_WRN("Starting firmware upgrade: %08x -> %08x", APPVERSION, version);
+
+    // Static for the decompressor's window.
+    static struct fw_write_context fw_write;
+    memset(&fw_write, 0, sizeof(fw_write));
+    if ((ret = flash_img_init(&fw_write.img)) < 0) {
+        LOG_ERR("Failed to init flash image write: %d", ret);
+    }
+
+    char firmware_path[30] = {0};
+
+    snprintf(firmware_path, 29, "fw/%08x.bin", version);
+
+    // coap_client can only follow a Block2 transfer from its first block, so to resume we
+    // ask the host for the rest of the image instead ("o=<offset>"). Starting afresh, we ask
+    // for a delta against the image we're running ("d=<version>"), unless one for this
+    // version already failed.
+    size_t fw_offset = fw_resume(&fw_write, version);
+    struct coap_client_option fw_query = {
+        .code = COAP_OPTION_URI_QUERY,
+    };
+    bool fw_has_query = false;
+    if (fw_offset > 0) {
+        fw_query.len = snprintf((char *)fw_query.value, sizeof(fw_query.value), "o=%zu", fw_offset);
+        fw_has_query = true;
+    } else if (fw_delta_allowed(version) &&
+               flash_area_open(FIXED_PARTITION_ID(slot0_partition), &fw_write.running) == 0) {
+        fw_query.len = snprintf((char *)fw_query.value, sizeof(fw_query.value), "d=%08x", APPVERSION);
+        fw_has_query = true;
+    }
+
+    struct coap_blockwise fw_blocks = {.preferred_szx = download_szx};
+    struct radio_frames fw_frames;
+    int64_t fw_started = k_uptime_get();
+    radio_frames_get(&fw_frames);
+    static struct coap_request fw_request;
+    coap_request_submit(&fw_request, session, firmware_path, COAP_METHOD_GET, hb_req, hb_req_len, fw_has_query ? &fw_query : NULL, fw_has_query ? 1 : 0, &fw_blocks, fw_coap_response, (void*) &fw_write, 120);
+    res = coap_request_wait(&fw_request);
+    download_done("fw", res, &fw_blocks, &fw_frames, fw_started);
+    net_stats_add(NET_TRANSFER_FIRMWARE, res, &fw_request.stats);
+
+    if (res == COAP_REQUEST_SUCCESS) {
+        // The rest can come back empty if everything had already arrived.
+        flash_img_buffered_write(&fw_write.img, NULL, 0, true);
+        fw_forget_progress(&fw_write);
+    } else if (res == COAP_REQUEST_CALLBACK_ABORT) {
+        // Flash writes failed, so what's there can't be trusted.
+        fw_forget_progress(&fw_write);
+        if (fw_write.delta) {
+            // Or the delta didn't apply. The whole image will.
+            wrapped_settings_set_raw(FW_NO_DELTA_KEY, (uint8_t *)&version, sizeof(version));
+        }
+    } else if (fw_write.delta) {
+        fw_forget_progress(&fw_write);
+    } else {
+        fw_save_progress(&fw_write);
+    }
+    if (fw_write.running) {
+        flash_area_close(fw_write.running);
+    }
+
+    if (res != COAP_REQUEST_SUCCESS) {
+        return false;
+    }
+    LOG_INF("Firmware upgrade downloaded. Kicking off upgrade....");
+    boot_request_upgrade(0);
+    return true;
+}
+
 int main(void)
 {
     LOG_INF("Starting app version: %s", APP_VERSION_STRING);
@@ -388,6 +1124,7 @@ int main(void)
             LOG_ERR("failed to initialize settings...: %d", ret);
             return 0;
     }
+    download_szx_load();
 
     // e-paper will not be written to if the type is invalid or we can't get dimensions.
     // This prevents us from bricking a display by writing bad data to it.
@@ -417,7 +1154,9 @@ int main(void)
     openthread_state_changed_callback_register(&ot_state_chaged_cb);
     //set_ot_data();
     LOG_INF("Starting OpenThread!");
+    ot_started = k_uptime_get();
     openthread_run();
+    k_timer_start(&attach_timer, K_SECONDS(CONFIG_APP_THREAD_ATTACH_TIMEOUT), K_NO_WAIT);
 
 
 	ret = coap_client_init(&client, NULL);
@@ -446,11 +1185,20 @@ int main(void)
     struct device_heartbeat_request req = {
         .device_id = device_id_mac, // Note: device_id realistically should be u32. 
         .current_firmware = APPVERSION,
-        .protocol_version = 1,
+        .protocol_version = HEARTBEAT_PROTOCOL_VERSION,
         .vbat_mv = vbat_mv
     };
 
-    uint8_t req_encoded[100];
+    // We hibernate (losing RAM) after every update, so the previous wake's display timing comes back from settings.
+    size_t timing_size = 0;
+    ret = wrapped_settings_get_raw("ep_timing", (uint8_t*) &req.display_timing, sizeof(req.display_timing), &timing_size);
+    req.has_display_timing = (ret >= 0 && timing_size == sizeof(req.display_timing));
+    // Likewise how the previous wake's network went. A firmware update changing the struct just loses one report.
+    size_t net_stats_size = 0;
+    ret = wrapped_settings_get_raw(NET_STATS_KEY, (uint8_t*) &req.net_stats, sizeof(req.net_stats), &net_stats_size);
+    req.has_net_stats = (ret >= 0 && net_stats_size == sizeof(req.net_stats));
+
+    uint8_t req_encoded[384];
     size_t req_encoded_size = 0;
     ret = encode_heartbeat_request(&req, req_encoded, sizeof(req_encoded), &req_encoded_size);
     if (ret != 0) {
@@ -468,14 +1216,14 @@ int main(void)
     // default to wake every 5 minutes if not otherwise commanded.
     uint32_t sleep_for_seconds = 600;
 
-    int connection_waits = 0;
-
     int tried_coap = 0;
-    /* The application can now enter a low-power state or do other work */
+    /* Sleep until we attach or give up, waking each second just to blink the heartbeat LED */
     while (1) {
-        // Are we connected?
-        otDeviceRole role = otThreadGetDeviceRole(openthread_get_default_instance());
-        if (role == OT_DEVICE_ROLE_CHILD || role == OT_DEVICE_ROLE_ROUTER || role == OT_DEVICE_ROLE_LEADER) {
+        uint32_t events = k_event_wait(&wake_events, WAKE_EVENT_ATTACHED | WAKE_EVENT_ATTACH_TIMEOUT, false, K_SECONDS(1));
+        if (events & WAKE_EVENT_ATTACHED) {
+            // Attached, so it can't time out any more (it may have just as we attached).
+            k_timer_stop(&attach_timer);
+            k_event_clear(&wake_events, WAKE_EVENT_ATTACH_TIMEOUT);
 
             if (tried_coap == 0) {
                 LOG_INF("Trying CoAP. vbat: %d! %llu", vbat_mv, device_id_mac);
@@ -489,105 +1237,158 @@ int main(void)
                 addr6->sin6_port = htons(5683);
                 zsock_inet_pton(AF_INET6, "fd7d:56af:ad45:1:9fc6:1d58:d2db:2517", &addr6->sin6_addr);
 
-                
-                // Do our heartbeat first.
-
-                coap_request_result_t  res = do_coap_request(&client, &sa, "hb", COAP_METHOD_PUT, req_encoded, req_encoded_size, buffer_coap_response, (void*) &bufwrite, 10);
-                LOG_INF("HB return code: %d", res);
-                if (res == 0) {
-                    LOG_INF("Got %zu bytes from HB", bufwrite.current_size);
-                    struct device_heartbeat_response hb_resp;
-                    res = decode_heartbeat_response(res_encoded, bufwrite.current_size, &hb_resp);
-                    if (res == 0) {
-                        if (!boot_is_img_confirmed()) {
-                            if (boot_write_img_confirmed() != 0) {
-                                LOG_ERR("Failed to mark image as confirmed!");
-                            } else {
-                                LOG_INF("Marked image as OK.");
-                            }
-                        }
-
-                        LOG_INF("Decoded heartbeat. Desired firmware version: %08x, sleep interval %u", hb_resp.desired_firmware, hb_resp.checkin_interval);
-                        
-                        if (hb_resp.desired_firmware != APPVERSION && (IS_DEVKIT == 0)) {
-                            LOG_WRN("Starting firmware upgrade: %08x -> %08x", APPVERSION, hb_resp.desired_firmware);
-
-                            struct flash_img_context write_ctx;
-                            if ((ret = flash_img_init(&write_ctx)) < 0) {
-                                LOG_ERR("Failed to init flash image write: %d", ret);
-                            }
-
-                            char firmware_path[30] = {0};
-
-                            snprintf(firmware_path, 29, "fw/%08x.bin", hb_resp.desired_firmware);
-
-                            res = do_coap_request(&client, &sa, firmware_path, COAP_METHOD_GET, req_encoded, req_encoded_size, fw_coap_response, (void*) &write_ctx, 120);
-
-                            if (res == 0) {
-                                LOG_INF("Firmware upgrade downloaded. Kicking off upgrade....");
-                                boot_request_upgrade(0);
-                                // by using the npm2100 reset here, we'll set a 10 second wdt
-                                // for zephyr to start up again, which should be plenty of time if the image is correct.
-                                #if DT_NODE_EXISTS(DT_NODELABEL(npm2100_pmic))
-                                mfd_npm2100_reset(npm2100_pmic);
-                                #else
-                                LOG_INF("no PMIC - reset board manually");
-                                #endif
-                            }
-                        } else {
-                            #if IS_DEVKIT == 0
-                            LOG_INF("Firmware up to date, no action.");
-                            #else
-                            LOG_INF("Is devkit, ignoring potential firmware upgrade.");
-                            #endif
-                        }
-
-                        sleep_for_seconds = hb_resp.checkin_interval;
-                    } else {
-                        LOG_INF("Failed to decode heartbeat: %d", res);
-                    }
+                // Everything this wake sends goes through one session, so later requests start with a
+                // retransmission timeout tuned by the earlier ones. If it can't open, every request fails.
+                struct coap_session session;
+                ret = coap_session_open(&session, &client, &sa);
+                if (ret < 0) {
+                    LOG_ERR("failed to open CoAP session: %d", ret);
                 }
+                
+                // The heartbeat and the image don't depend on each other, so both go out at once and the image
+                // can be on its way while the host answers the heartbeat. Only a firmware upgrade needs the
+                // heartbeat's reply, and that goes last.
+                static struct coap_request hb_request;
+                coap_request_submit(&hb_request, &session, "hb", COAP_METHOD_PUT, req_encoded, req_encoded_size, NULL, 0, NULL, buffer_coap_response, (void*) &bufwrite, 10);
+                bool hb_pending = true;
+                uint32_t upgrade_to = APPVERSION;
+                coap_request_result_t res;
 
                 if (ep_disabled == 0) {
+                    static struct coap_request img_request;
+                    // Separate from the heartbeat's, which a firmware download sends again.
+                    uint8_t img_req_encoded[128];
+                    size_t img_req_encoded_size = 0;
+                    int img_attempts = 0;
                     // Then fetch an updated image
+                fetch_image:
+                    img_attempts++;
                     memset(&img_write, 0, sizeof(struct image_write_context));
-                    heatshrink_decoder_reset(&img_write.hsd);
+                    image_decoder_reset(&img_write.dec);
                     img_write.eink_dev = eink_dev;
                     img_write.max_data = eink_dimensions.expected_data_size;
+                    img_write.plane_size = eink_dimensions.plane_data_size;
+                    img_write.num_planes = eink_dimensions.planes;
+                    img_write.current_plane = 0;
+                    img_write.plane_remaining = eink_dimensions.plane_data_size;
+                    img_write.etag_hash = IMAGE_ETAG_SEED;
+                    k_mutex_init(&img_write.panel_lock);
+                    k_poll_signal_init(&img_write.panel_signal);
+
+                    // Ask the host to only send the image if it differs from what's on the panel.
+                    struct coap_client_option etag_opt = {
+                        .code = COAP_OPTION_ETAG,
+                    };
+                    size_t etag_len = 0;
+                    ret = wrapped_settings_get_raw(IMAGE_ETAG_KEY, etag_opt.value, sizeof(etag_opt.value), &etag_len);
+                    bool have_etag = (ret == 0 && etag_len == IMAGE_ETAG_LEN);
+                    etag_opt.len = IMAGE_ETAG_LEN;
 
                     struct image_request img_req = {
                         .device_id = device_id_mac,
                         .epd_type = (uint8_t) EPD_TYPE_WS_75_V2B,
-                        .expected_data_size = eink_dimensions.expected_data_size
+                        .expected_data_size = eink_dimensions.expected_data_size,
+                        .codecs = IMAGE_CODECS_SUPPORTED,
+                        .hs_window = HEATSHRINK_STATIC_WINDOW_BITS,
+                        .hs_lookahead = HEATSHRINK_STATIC_LOOKAHEAD_BITS,
+                        .frame_crc = true,
                     };
 
-                    ret = encode_image_request(&img_req, req_encoded, sizeof(req_encoded), &req_encoded_size);
+                    ret = encode_image_request(&img_req, img_req_encoded, sizeof(img_req_encoded), &img_req_encoded_size);
                     if (ret != 0) {
-                        LOG_ERR("failed to encode heartbeat: %d", ret);
+                        LOG_ERR("failed to encode image request: %d", ret);
                     }
 
-                    res = epd_power_on(eink_dev);
-                    if (res < 0) {
-                            LOG_ERR("failed to power on display: %d", res);
-                            goto hibernate;        
-                    }
-                    res = epd_start_write_data(eink_dev, 0);
-                    if (res < 0) {
-                            LOG_ERR("failed to init write: %d", res);
+                    // With no ETag to revalidate, whatever comes back gets drawn, so the panel can power up during
+                    // the round trip instead of when the first block arrives.
+                    if (!have_etag) {
+                        if (img_start_panel(&img_write) < 0) {
+                            epd_power_off(eink_dev);
                             goto hibernate;
+                        }
+                        img_write.panel_state = IMG_PANEL_READY;
                     }
-                    
-                    res = do_coap_request(&client, &sa, "img", COAP_METHOD_GET, req_encoded, req_encoded_size, img_coap_response, (void*) &img_write, 90);
+
+                    struct coap_blockwise img_blocks = {.preferred_szx = download_szx};
+                    struct radio_frames img_frames;
+                    int64_t img_started = k_uptime_get();
+                    radio_frames_get(&img_frames);
+                    coap_request_submit(&img_request, &session, "img", COAP_METHOD_GET, img_req_encoded, img_req_encoded_size, have_etag ? &etag_opt : NULL, have_etag ? 1 : 0, &img_blocks, img_coap_response, (void*) &img_write, 90);
+                    img_power_up_on_data(&img_write, &img_request);
+                    if (hb_pending) {
+                        coap_request_wait_all((struct coap_request *[]){&hb_request, &img_request}, 2);
+                        upgrade_to = hb_handle_reply(&hb_request, res_encoded, bufwrite.current_size, &sleep_for_seconds);
+                        hb_pending = false;
+                        res = img_request.result;
+                    } else {
+                        res = coap_request_wait(&img_request);
+                    }
+                    download_done("img", res, &img_blocks, &img_frames, img_started);
+                    net_stats_add(NET_TRANSFER_IMAGE, res, &img_request.stats);
                     LOG_INF("return code: %d", res);
-                    res = epd_do_refresh(eink_dev);
-                    if (res < 0) {
-                            LOG_ERR("failed to finish writing display: %d", res);
+                    if (res == COAP_REQUEST_SUCCESS && img_write.panel_result < 0) {
+                        // Everything arrived, but writing out the blocks held during power-up failed.
+                        res = COAP_REQUEST_CALLBACK_ABORT;
+                    }
+                    if (res == COAP_REQUEST_VALID) {
+                        LOG_INF("Image unchanged, leaving the display alone.");
+                        goto hibernate;
+                    }
+                    // Unless it was dropped for want of room to hold it while the panel powered up: that's worth
+                    // another try, which powers up first.
+                    if (img_write.total_produced == 0 && res != COAP_REQUEST_CALLBACK_ABORT) {
+                        LOG_ERR("No image data received, leaving the display alone.");
+                        if (img_write.panel_on) {
+                            epd_power_off(eink_dev);
+                        }
+                        goto hibernate;
+                    }
+
+                    // If the transfer was aborted, a write may still be in flight.
+                    epd_wait_write_data(eink_dev);
+                    if (res != COAP_REQUEST_SUCCESS) {
+                        // Truncated, corrupt or failed its CRC. The panel's RAM is part-written, but what it shows
+                        // doesn't change until a refresh, so leave it showing the old image and try again.
+                        LOG_ERR("Image transfer failed (%d), not refreshing.", res);
+                        ret = epd_power_off(eink_dev);
+                        if (ret < 0) {
+                                LOG_ERR("failed to power off display: %d", ret);
+                        }
+                        if (img_attempts < IMAGE_FETCH_ATTEMPTS) {
+                            LOG_INF("Retrying image fetch (attempt %d)", img_attempts + 1);
+                            goto fetch_image;
+                        }
+                        goto hibernate;
+                    }
+
+                    int refresh_res = epd_do_refresh(eink_dev);
+                    if (refresh_res < 0) {
+                            LOG_ERR("failed to finish writing display: %d", refresh_res);
                     }
                     k_msleep(1000);
                     LOG_ERR("Done refresh?");
-                    res = epd_power_off(eink_dev);
-                    if (res < 0) {
-                            LOG_ERR("failed to power off display: %d", res);
+                    ret = epd_power_off(eink_dev);
+                    if (ret < 0) {
+                            LOG_ERR("failed to power off display: %d", ret);
+                    }
+
+                    // Only a refreshed image is worth revalidating next time.
+                    if (refresh_res == 0) {
+                        uint8_t etag[IMAGE_ETAG_LEN];
+                        sys_put_be64(img_write.etag_hash, etag);
+                        ret = wrapped_settings_set_raw(IMAGE_ETAG_KEY, etag, sizeof(etag));
+                        if (ret < 0) {
+                            LOG_ERR("failed to save image ETag: %d", ret);
+                        }
+                    }
+
+                    // Keep this update's timing for the next heartbeat.
+                    struct epd_update_timing timing;
+                    if (epd_get_update_timing(eink_dev, 0, &timing) == 0) {
+                        ret = wrapped_settings_set_raw("ep_timing", (uint8_t*) &timing, sizeof(timing));
+                        if (ret < 0) {
+                            LOG_ERR("failed to save display timing: %d", ret);
+                        }
                     }
                 } else {
                     LOG_ERR("epd disabled (bad settings?), did not attempt a write.");
@@ -596,6 +1397,23 @@ int main(void)
                 tried_coap = 1;
 
                 hibernate:
+                if (hb_pending) {
+                    coap_request_wait(&hb_request);
+                    upgrade_to = hb_handle_reply(&hb_request, res_encoded, bufwrite.current_size, &sleep_for_seconds);
+                }
+                bool upgrading = upgrade_to != APPVERSION &&
+                                 fw_upgrade(&session, upgrade_to, req_encoded, req_encoded_size);
+                net_stats_save(&session);
+                coap_session_close(&session);
+                if (upgrading) {
+                    // by using the npm2100 reset here, we'll set a 10 second wdt
+                    // for zephyr to start up again, which should be plenty of time if the image is correct.
+                    #if DT_NODE_EXISTS(DT_NODELABEL(npm2100_pmic))
+                    mfd_npm2100_reset(npm2100_pmic);
+                    #else
+                    LOG_INF("no PMIC - reset board manually");
+                    #endif
+                }
                 LOG_INF("About to hibernate for %d seconds", sleep_for_seconds);
                 k_msleep(200);
                 #if DT_NODE_EXISTS(DT_NODELABEL(npm2100_pmic))
@@ -606,28 +1424,28 @@ int main(void)
                 k_sleep(K_SECONDS(sleep_for_seconds));
                 #endif
                 //LOG_INF("hibres: %d", hibres);
+            } else {
+                // Only without a PMIC to hibernate us: this wake is over, so idle until the board is reset.
+                k_msleep(1000);
             }
-        } else {
-            connection_waits++;
-            if (connection_waits > 60) {
-                LOG_INF("No connection after 1 minute. Sleeping for a while...");
-                k_msleep(200);
-                #if DT_NODE_EXISTS(DT_NODELABEL(npm2100_pmic))
-                mfd_npm2100_hibernate(npm2100_pmic, sleep_for_seconds * 1000, false);
-                k_sleep(K_SECONDS(sleep_for_seconds));
-                #else
-                LOG_INF("No PMIC - sleeping manually.");
-                k_sleep(K_SECONDS(sleep_for_seconds));
-                connection_waits = 0;
-                #endif
-            }
+        } else if (events & WAKE_EVENT_ATTACH_TIMEOUT) {
+            LOG_INF("No connection after %d seconds. Sleeping for a while...", CONFIG_APP_THREAD_ATTACH_TIMEOUT);
+            net_stats_save(NULL);
+            k_msleep(200);
+            #if DT_NODE_EXISTS(DT_NODELABEL(npm2100_pmic))
+            mfd_npm2100_hibernate(npm2100_pmic, sleep_for_seconds * 1000, false);
+            k_sleep(K_SECONDS(sleep_for_seconds));
+            #else
+            LOG_INF("No PMIC - sleeping manually.");
+            k_sleep(K_SECONDS(sleep_for_seconds));
+            k_event_clear(&wake_events, WAKE_EVENT_ATTACH_TIMEOUT);
+            k_timer_start(&attach_timer, K_SECONDS(CONFIG_APP_THREAD_ATTACH_TIMEOUT), K_NO_WAIT);
+            #endif
         }
 
     #if DT_HAS_ALIAS(heartbeat_led)
         gpio_pin_toggle_dt(&green_led);
     #endif
-		
-        k_msleep(1000);
     }
     return 0;
 }
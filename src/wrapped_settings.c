@@ -114,7 +114,7 @@ int wrapped_settings_get_raw(const char* key, uint8_t *data, size_t max_size, si
         *actual_size = (size_t)ctx.data_real_size;
     }
     
-    LOG_INF("Loaded %zu bytes from key '%s'", *actual_size, full_key);
+    LOG_INF("Loaded %zd bytes from key '%s'", ctx.data_real_size, full_key);
     return 0;
 }
 
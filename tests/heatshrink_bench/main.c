@@ -0,0 +1,464 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#else
+#define HAVE_CYCLES 0
+#endif
+
+#include "heatshrink_decoder.h"
+
+// Decodes a corpus of compressed panel frames with the upstream decoder and heatshrink_decoder_fast.c,
+// checking they agree byte for byte, and reports MB/s and cycles per output byte for each. The fast decoder is
+// run both through sink + poll and through heatshrink_decoder_decode, which reads the input in place.
+// Frames are fed the way main.c does it: 256 byte CoAP blocks in, 512 byte display buffers out.
+//
+// With no arguments a synthetic corpus is generated, one frame per panel type. Pass files written by the host
+// (image_files/<device>.bin) to measure real ones. Cycle counts come from the TSC, so they're reference cycles
+// and only meaningful on x86.
+
+HSD_sink_res ref_heatshrink_decoder_sink(heatshrink_decoder *hsd, uint8_t *in_buf, size_t size, size_t *input_size);
+HSD_poll_res ref_heatshrink_decoder_poll(heatshrink_decoder *hsd, uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+HSD_finish_res ref_heatshrink_decoder_finish(heatshrink_decoder *hsd);
+void ref_heatshrink_decoder_reset(heatshrink_decoder *hsd);
+
+struct decoder_impl {
+    const char *name;
+    void (*reset)(heatshrink_decoder *hsd);
+    HSD_sink_res (*sink)(heatshrink_decoder *hsd, uint8_t *in_buf, size_t size, size_t *input_size);
+    HSD_poll_res (*poll)(heatshrink_decoder *hsd, uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+    HSD_finish_res (*finish)(heatshrink_decoder *hsd);
+    // Zero-copy entry point, used instead of sink + poll when set.
+    HSD_poll_res (*decode)(heatshrink_decoder *hsd, const uint8_t *in_buf, size_t in_size, size_t *input_size,
+                           uint8_t *out_buf, size_t out_buf_size, size_t *output_size);
+};
+
+static const struct decoder_impl decoders[] = {
+    {"reference", ref_heatshrink_decoder_reset, ref_heatshrink_decoder_sink,
+     ref_heatshrink_decoder_poll, ref_heatshrink_decoder_finish, NULL},
+    {"fast", heatshrink_decoder_reset, heatshrink_decoder_sink,
+     heatshrink_decoder_poll, heatshrink_decoder_finish, NULL},
+    {"zero-copy", heatshrink_decoder_reset, heatshrink_decoder_sink,
+     heatshrink_decoder_poll, heatshrink_decoder_finish, heatshrink_decoder_decode},
+};
+
+#define NUM_DECODERS (sizeof(decoders) / sizeof(decoders[0]))
+
+#define BLOCK_SIZE 256
+#define OUT_BUF_SIZE 512
+#define MIN_BENCH_NS 200000000ULL
+
+#define WINDOW_BITS HEATSHRINK_STATIC_WINDOW_BITS
+#define LOOKAHEAD_BITS HEATSHRINK_STATIC_LOOKAHEAD_BITS
+
+struct frame {
+    char name[64];
+    uint8_t *compressed;
+    size_t compressed_len;
+    uint8_t *raw; // Reference decoder output.
+    size_t raw_len;
+};
+
+static heatshrink_decoder hsd;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t now_cycles(void) {
+#if HAVE_CYCLES
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+// Decode IN with IMPL, sinking at most SINK_SIZE bytes and polling at most POLL_SIZE bytes at a time.
+// Returns the decoded length, or -1 if it would exceed OUT_CAP.
+static long decode(const struct decoder_impl *impl, const uint8_t *in, size_t in_len, size_t sink_size,
+                   size_t poll_size, uint8_t *out, size_t out_cap) {
+    uint8_t buf[OUT_BUF_SIZE];
+    size_t in_pos = 0;
+    size_t out_len = 0;
+    HSD_poll_res pres;
+
+    heatshrink_decoder_configure(&hsd, WINDOW_BITS, LOOKAHEAD_BITS);
+    impl->reset(&hsd);
+    while (1) {
+        // With decode, SINK_SIZE is the size of each block handed over, like a CoAP payload.
+        size_t block_end = in_len - in_pos < sink_size ? in_len : in_pos + sink_size;
+
+        while (!impl->decode && in_pos < in_len) {
+            size_t chunk = in_len - in_pos < sink_size ? in_len - in_pos : sink_size;
+            size_t sunk = 0;
+            impl->sink(&hsd, (uint8_t *)in + in_pos, chunk, &sunk);
+            in_pos += sunk;
+            if (sunk == 0) {
+                break;
+            }
+        }
+
+        do {
+            size_t got = 0;
+            if (impl->decode) {
+                size_t used = 0;
+                pres = impl->decode(&hsd, in + in_pos, block_end - in_pos, &used, buf, poll_size, &got);
+                in_pos += used;
+            } else {
+                pres = impl->poll(&hsd, buf, poll_size, &got);
+            }
+            if (pres < 0 || out_len + got > out_cap) {
+                return -1;
+            }
+            memcpy(out + out_len, buf, got);
+            out_len += got;
+        } while (pres == HSDR_POLL_MORE);
+
+        if (in_pos == in_len && impl->finish(&hsd) == HSDR_FINISH_DONE) {
+            return (long)out_len;
+        }
+    }
+}
+
+/*
+ * Synthetic corpus. Compressed with a minimal greedy heatshrink encoder, which is enough to exercise the
+ * decoders with a realistic mix of literals, short matches and long runs.
+ */
+
+struct bit_writer {
+    uint8_t *buf;
+    size_t len;
+    uint8_t bits;
+    uint8_t nbits;
+};
+
+static void put_bits(struct bit_writer *bw, uint32_t value, uint8_t count) {
+    while (count-- > 0) {
+        bw->bits = (uint8_t)((bw->bits << 1) | ((value >> count) & 1));
+        if (++bw->nbits == 8) {
+            bw->buf[bw->len++] = bw->bits;
+            bw->bits = 0;
+            bw->nbits = 0;
+        }
+    }
+}
+
+#define HASH_BITS 14
+#define CHAIN_LIMIT 64
+
+static size_t hs_encode(const uint8_t *in, size_t len, uint8_t **out) {
+    const size_t window = 1u << WINDOW_BITS;
+    const size_t max_len = 1u << LOOKAHEAD_BITS;
+    // A backref only saves space once it replaces more than this many literals.
+    const size_t break_even = (1 + WINDOW_BITS + LOOKAHEAD_BITS) / 9;
+    int32_t *head = malloc(sizeof(int32_t) << HASH_BITS);
+    int32_t *prev = malloc(sizeof(int32_t) * len);
+    struct bit_writer bw = {.buf = malloc(len * 9 / 8 + 16)};
+
+    memset(head, 0xFF, sizeof(int32_t) << HASH_BITS);
+
+    for (size_t pos = 0; pos < len;) {
+        size_t best_len = 0;
+        size_t best_off = 0;
+
+        if (pos + 2 < len) {
+            uint32_t h = ((in[pos] << 8) ^ (in[pos + 1] << 4) ^ in[pos + 2]) & ((1u << HASH_BITS) - 1);
+            int chain = 0;
+            for (int32_t cand = head[h]; cand >= 0 && pos - (size_t)cand <= window && chain < CHAIN_LIMIT;
+                 cand = prev[cand], chain++) {
+                size_t n = 0;
+                while (n < max_len && pos + n < len && in[cand + n] == in[pos + n]) {
+                    n++;
+                }
+                if (n > best_len) {
+                    best_len = n;
+                    best_off = pos - (size_t)cand;
+                }
+            }
+        }
+
+        size_t advance = best_len > break_even ? best_len : 1;
+        if (best_len > break_even) {
+            put_bits(&bw, HEATSHRINK_BACKREF_MARKER, 1);
+            put_bits(&bw, (uint32_t)(best_off - 1), WINDOW_BITS);
+            put_bits(&bw, (uint32_t)(best_len - 1), LOOKAHEAD_BITS);
+        } else {
+            put_bits(&bw, HEATSHRINK_LITERAL_MARKER, 1);
+            put_bits(&bw, in[pos], 8);
+        }
+        for (size_t i = 0; i < advance; i++, pos++) {
+            if (pos + 2 < len) {
+                uint32_t h = ((in[pos] << 8) ^ (in[pos + 1] << 4) ^ in[pos + 2]) & ((1u << HASH_BITS) - 1);
+                prev[pos] = head[h];
+                head[h] = (int32_t)pos;
+            }
+        }
+    }
+    if (bw.nbits > 0) {
+        put_bits(&bw, 0, 8 - bw.nbits); // Zero padding, like the real encoder.
+    }
+
+    free(head);
+    free(prev);
+    *out = bw.buf;
+    return bw.len;
+}
+
+static uint32_t rng_state = 0x12345678;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+// A frame like the ones the host renders: white background, a few solid boxes, rows of text built from a
+// small glyph set, and a dithered picture. BPP is 1 (black/white) or 2 (four colour, 0 = black, 1 = white).
+static uint8_t *render_frame(int width, int height, int bpp, size_t *len) {
+    const int px_per_byte = 8 / bpp;
+    const int stride = width / px_per_byte;
+    const uint8_t white_px = 1; // White is 1 in both formats.
+    uint8_t white = 0;
+    uint8_t glyphs[16][12];
+    uint8_t *frame;
+
+    for (int i = 0; i < px_per_byte; i++) {
+        white = (uint8_t)((white << bpp) | white_px);
+    }
+    *len = (size_t)stride * height;
+    frame = malloc(*len);
+    memset(frame, white, *len);
+
+    for (int g = 0; g < 16; g++) {
+        for (int row = 0; row < 12; row++) {
+            glyphs[g][row] = (uint8_t)(rng() | (row == 0 || row == 11 ? 0xFF : 0x81));
+        }
+    }
+
+    // Header bar and a couple of boxes.
+    for (int y = 0; y < height / 10; y++) {
+        memset(frame + (size_t)y * stride, bpp == 1 ? 0x00 : 0xAA, stride);
+    }
+    for (int y = height / 3; y < height / 3 + height / 8; y++) {
+        memset(frame + (size_t)y * stride + stride / 8, 0x00, stride / 4);
+    }
+
+    // Text: lines of glyphs (one byte wide each), with word gaps.
+    for (int line_y = height / 8; line_y + 12 < height / 2; line_y += 16) {
+        for (int col = 1; col < stride - 1; col++) {
+            if (rng() % 6 == 0) {
+                continue;
+            }
+            const uint8_t *glyph = glyphs[rng() % 16];
+            for (int row = 0; row < 12; row++) {
+                frame[(size_t)(line_y + row) * stride + col] = (uint8_t)~glyph[row];
+            }
+        }
+    }
+
+    // Ordered-dither-ish picture in the bottom half, with some noise so it doesn't compress too well.
+    for (int y = height / 2 + 8; y < height - 8; y++) {
+        for (int x = 0; x < stride; x++) {
+            uint8_t b = 0;
+            for (int p = 0; p < px_per_byte; p++) {
+                int level = ((x * px_per_byte + p) * 255) / width;
+                int threshold = (int)(((x + y) * 37 + p * 91) & 0xFF) + (int)(rng() % 24) - 12;
+                b = (uint8_t)((b << bpp) | (level > threshold ? white_px : 0));
+            }
+            frame[(size_t)y * stride + x] = b;
+        }
+    }
+
+    return frame;
+}
+
+static int make_synthetic(struct frame *frames) {
+    static const struct {
+        const char *name;
+        int width, height, bpp, planes;
+    } panels[] = {
+        {"GDEY029T71H", 168, 384, 1, 2},
+        {"GDEM035F51", 184, 384, 2, 1},
+        {"GDEY029F51", 168, 384, 2, 1},
+        {"GDEM075F52", 800, 480, 2, 1},
+        {"WS_75_V2B", 800, 480, 1, 1},
+    };
+    int count = (int)(sizeof(panels) / sizeof(panels[0]));
+
+    for (int i = 0; i < count; i++) {
+        size_t plane_len;
+        uint8_t *raw = NULL;
+        size_t raw_len = 0;
+
+        for (int p = 0; p < panels[i].planes; p++) {
+            uint8_t *plane = render_frame(panels[i].width, panels[i].height, panels[i].bpp, &plane_len);
+            raw = realloc(raw, raw_len + plane_len);
+            memcpy(raw + raw_len, plane, plane_len);
+            raw_len += plane_len;
+            free(plane);
+        }
+        snprintf(frames[i].name, sizeof(frames[i].name), "%s", panels[i].name);
+        frames[i].compressed_len = hs_encode(raw, raw_len, &frames[i].compressed);
+        frames[i].raw = raw;
+        frames[i].raw_len = raw_len;
+    }
+    return count;
+}
+
+static int load_file(const char *path, struct frame *frame) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    frame->compressed = malloc(len > 0 ? (size_t)len : 1);
+    frame->compressed_len = fread(frame->compressed, 1, (size_t)len, f);
+    fclose(f);
+
+    const char *base = strrchr(path, '/');
+    snprintf(frame->name, sizeof(frame->name), "%s", base ? base + 1 : path);
+    frame->raw = NULL;
+    return 0;
+}
+
+// Fill in (or check) the expected output with the reference decoder, then make sure every decoder produces it
+// for a spread of input/output chunkings - odd sizes shake out bugs in suspending mid-token.
+static int verify(struct frame *frame, uint8_t *scratch, size_t scratch_cap) {
+    static const size_t sink_sizes[] = {BLOCK_SIZE, 1, 3, 300};
+    static const size_t poll_sizes[] = {OUT_BUF_SIZE, 1, 7, 256};
+
+    long len = decode(&decoders[0], frame->compressed, frame->compressed_len, BLOCK_SIZE, OUT_BUF_SIZE,
+                      scratch, scratch_cap);
+    if (len < 0) {
+        fprintf(stderr, "%s: reference decoder failed\n", frame->name);
+        return -1;
+    }
+    if (frame->raw == NULL) {
+        frame->raw = malloc((size_t)len + 1);
+        memcpy(frame->raw, scratch, (size_t)len);
+        frame->raw_len = (size_t)len;
+    } else if ((size_t)len != frame->raw_len || memcmp(scratch, frame->raw, (size_t)len) != 0) {
+        fprintf(stderr, "%s: reference decoder doesn't round-trip the test encoder\n", frame->name);
+        return -1;
+    }
+
+    for (size_t d = 0; d < NUM_DECODERS; d++) {
+        for (size_t s = 0; s < sizeof(sink_sizes) / sizeof(sink_sizes[0]); s++) {
+            for (size_t p = 0; p < sizeof(poll_sizes) / sizeof(poll_sizes[0]); p++) {
+                len = decode(&decoders[d], frame->compressed, frame->compressed_len, sink_sizes[s],
+                             poll_sizes[p], scratch, scratch_cap);
+                if (len != (long)frame->raw_len || memcmp(scratch, frame->raw, frame->raw_len) != 0) {
+                    fprintf(stderr, "%s: %s decoder output differs (sink %zu, poll %zu, len %ld vs %zu)\n",
+                            frame->name, decoders[d].name, sink_sizes[s], poll_sizes[p], len, frame->raw_len);
+                    return -1;
+                }
+            }
+        }
+    }
+    return 0;
+}
+
+struct result {
+    double mb_per_s;
+    double cycles_per_byte;
+};
+
+// Best of several runs, each long enough to swamp timer resolution.
+static struct result bench(const struct decoder_impl *impl, const struct frame *frame, uint8_t *scratch,
+                           size_t scratch_cap) {
+    struct result best = {0};
+
+    for (int run = 0; run < 5; run++) {
+        uint64_t iterations = 0;
+        uint64_t start_ns = now_ns();
+        uint64_t start_cycles = now_cycles();
+        uint64_t elapsed_ns;
+
+        do {
+            decode(impl, frame->compressed, frame->compressed_len, BLOCK_SIZE, OUT_BUF_SIZE, scratch,
+                   scratch_cap);
+            iterations++;
+            elapsed_ns = now_ns() - start_ns;
+        } while (elapsed_ns < MIN_BENCH_NS / 5);
+
+        uint64_t cycles = now_cycles() - start_cycles;
+        double bytes = (double)frame->raw_len * (double)iterations;
+        double mb_per_s = bytes / ((double)elapsed_ns / 1e9) / 1e6;
+        if (mb_per_s > best.mb_per_s) {
+            best.mb_per_s = mb_per_s;
+            best.cycles_per_byte = (double)cycles / bytes;
+        }
+    }
+    return best;
+}
+
+int main(int argc, char **argv) {
+    int count = argc > 1 ? argc - 1 : 0;
+    struct frame *frames = calloc(count > 8 ? (size_t)count : 8, sizeof(*frames));
+    size_t scratch_cap = 0;
+    int failed = 0;
+
+    if (count == 0) {
+        count = make_synthetic(frames);
+    } else {
+        for (int i = 0; i < count; i++) {
+            if (load_file(argv[i + 1], &frames[i]) < 0) {
+                return 1;
+            }
+        }
+    }
+
+    // The most a frame can decode to is a full-length backref per backref-sized token.
+    for (int i = 0; i < count; i++) {
+        size_t cap = frames[i].compressed_len * 8 / (1 + WINDOW_BITS + LOOKAHEAD_BITS) * (1u << LOOKAHEAD_BITS)
+            + OUT_BUF_SIZE;
+        if (cap > scratch_cap) {
+            scratch_cap = cap;
+        }
+    }
+    uint8_t *scratch = malloc(scratch_cap);
+
+    printf("window %d, lookahead %d, %d byte blocks in, %d byte buffers out\n\n", WINDOW_BITS, LOOKAHEAD_BITS,
+           BLOCK_SIZE, OUT_BUF_SIZE);
+    printf("%-16s %8s %8s", "frame", "in", "out");
+    for (size_t d = 0; d < NUM_DECODERS; d++) {
+        printf(" %10s %8s", decoders[d].name, "cyc/B");
+    }
+    printf(" %8s\n", "speedup");
+
+    for (int i = 0; i < count; i++) {
+        struct result results[NUM_DECODERS];
+
+        if (verify(&frames[i], scratch, scratch_cap) < 0) {
+            failed = 1;
+            continue;
+        }
+        printf("%-16s %8zu %8zu", frames[i].name, frames[i].compressed_len, frames[i].raw_len);
+        for (size_t d = 0; d < NUM_DECODERS; d++) {
+            results[d] = bench(&decoders[d], &frames[i], scratch, scratch_cap);
+            printf(" %5.1f MB/s %8.2f", results[d].mb_per_s, results[d].cycles_per_byte);
+        }
+        printf(" %7.2fx\n", results[NUM_DECODERS - 1].mb_per_s / results[0].mb_per_s);
+    }
+
+    for (int i = 0; i < count; i++) {
+        free(frames[i].compressed);
+        free(frames[i].raw);
+    }
+    free(frames);
+    free(scratch);
+    return failed;
+}
@@ -0,0 +1,106 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "bench.h"
+
+// In bench_bottom.c.
+uint64_t protocol_bench_host_ns(void);
+void protocol_bench_report(const char *line);
+
+#define BENCH_STACK_SIZE 8192
+
+K_THREAD_STACK_DEFINE(bench_stack, BENCH_STACK_SIZE);
+static struct k_thread bench_thread;
+
+struct bench_call {
+    void (*fn)(void *arg);
+    void *arg;
+    int iterations;
+    uint64_t host_ns;
+    uint64_t sim_cycles;
+};
+
+static void report_row(const char *name, int iterations, const struct bench_result *res, size_t bytes) {
+    static bool header_done;
+    char line[160];
+
+    // From host time - 0 when it's not about throughput.
+    uint32_t kb_per_s = (bytes > 0 && res->host_ns > 0) ? (uint32_t)(bytes * 1000000ull / res->host_ns) : 0;
+
+    if (!header_done) {
+        TC_PRINT("%-28s %6s %10s %10s %10s %8s\n", "bench", "calls", "host_ns", "sim_us", "KB/s", "stack");
+        protocol_bench_report("bench,calls,host_ns,sim_us,kb_per_s,stack_bytes");
+        header_done = true;
+    }
+    TC_PRINT("%-28s %6d %10llu %10llu %10u %8zu\n", name, iterations, (unsigned long long)res->host_ns,
+             (unsigned long long)res->sim_us, kb_per_s, res->stack_used);
+    snprintf(line, sizeof(line), "%s,%d,%llu,%llu,%u,%zu", name, iterations, (unsigned long long)res->host_ns,
+             (unsigned long long)res->sim_us, kb_per_s, res->stack_used);
+    protocol_bench_report(line);
+}
+
+static void bench_entry(void *p1, void *p2, void *p3) {
+    struct bench_call *call = p1;
+    uint64_t start_cycles = k_cycle_get_64();
+    uint64_t start_ns = protocol_bench_host_ns();
+
+    for (int i = 0; i < call->iterations; i++) {
+        call->fn(call->arg);
+    }
+
+    call->host_ns = protocol_bench_host_ns() - start_ns;
+    call->sim_cycles = k_cycle_get_64() - start_cycles;
+}
+
+void bench_run(const char *name, void (*fn)(void *arg), void *arg, int iterations, size_t bytes,
+               struct bench_result *res) {
+    struct bench_call call = {
+        .fn = fn,
+        .arg = arg,
+        .iterations = iterations,
+    };
+    size_t unused = 0;
+
+    // A new thread gets a freshly painted stack, so the high-water mark is this call's alone.
+    k_thread_create(&bench_thread, bench_stack, K_THREAD_STACK_SIZEOF(bench_stack), bench_entry, &call, NULL, NULL,
+                    k_thread_priority_get(k_current_get()), 0, K_NO_WAIT);
+    k_thread_name_set(&bench_thread, "bench");
+    zassert_ok(k_thread_join(&bench_thread, K_FOREVER));
+    zassert_ok(k_thread_stack_space_get(&bench_thread, &unused));
+
+    res->host_ns = call.host_ns / iterations;
+    res->sim_us = k_cyc_to_us_floor64(call.sim_cycles) / iterations;
+    res->stack_used = K_THREAD_STACK_SIZEOF(bench_stack) - unused;
+    report_row(name, iterations, res, bytes);
+}
+
+struct thread_lookup {
+    const char *name;
+    struct k_thread *found;
+};
+
+static void find_thread(const struct k_thread *thread, void *user_data) {
+    struct thread_lookup *lookup = user_data;
+    const char *name = k_thread_name_get((k_tid_t)thread);
+
+    if (name != NULL && strcmp(name, lookup->name) == 0) {
+        lookup->found = (struct k_thread *)thread;
+    }
+}
+
+void bench_report_thread_stack(const char *report_name, const char *thread_name) {
+    struct thread_lookup lookup = {.name = thread_name};
+    struct bench_result res = {0};
+    size_t unused;
+
+    k_thread_foreach(find_thread, &lookup);
+    if (lookup.found == NULL || k_thread_stack_space_get(lookup.found, &unused) != 0) {
+        TC_PRINT("no stack info for thread %s\n", thread_name);
+        return;
+    }
+    res.stack_used = lookup.found->stack_info.size - unused;
+    report_row(report_name, 0, &res, 0);
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Per-call cost of the firmware's protocol paths on native_sim.
+//
+// host_ns is real CPU time on the build machine (native_sim's own clock only moves when something sleeps), so it's
+// only comparable between runs on the same machine. sim_us is simulated time, which is what a CoAP round trip
+// costs in timeouts and waits. stack is the deepest the call got into a freshly painted stack.
+//
+// Every result is printed, and appended as CSV to $PROTOCOL_BENCH_REPORT when that's set.
+
+struct bench_result {
+    uint64_t host_ns; // Per call.
+    uint64_t sim_us; // Per call.
+    size_t stack_used;
+};
+
+// Run FN(ARG) ITERATIONS times on its own thread and report it as NAME. BYTES is how much data one call handles,
+// for a throughput column, or 0.
+void bench_run(const char *name, void (*fn)(void *arg), void *arg, int iterations, size_t bytes,
+               struct bench_result *res);
+
+// Report the stack high-water mark of an already running thread, by name.
+void bench_report_thread_stack(const char *report_name, const char *thread_name);
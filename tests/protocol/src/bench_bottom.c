@@ -0,0 +1,30 @@
+// Host side of the benchmark: built into the native simulator runner against the host's libc.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+uint64_t protocol_bench_host_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void protocol_bench_report(const char *line) {
+    static FILE *report;
+    const char *path = getenv("PROTOCOL_BENCH_REPORT");
+
+    if (path == NULL) {
+        return;
+    }
+    if (report == NULL) {
+        report = fopen(path, "w");
+        if (report == NULL) {
+            return;
+        }
+    }
+    fprintf(report, "%s\n", line);
+    fflush(report);
+}
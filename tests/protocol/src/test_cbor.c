@@ -0,0 +1,194 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "cbor.h"
+#include "bench.h"
+
+// The golden files in tests/protocol/golden are also checked by the host's tests (host/src/business.rs), so a
+// change on either side that the other can't read fails one of them.
+
+static const uint8_t golden_heartbeat_request[] = {
+#include "golden/heartbeat_request.cbor.inc"
+};
+
+static const uint8_t golden_heartbeat_request_no_timing[] = {
+#include "golden/heartbeat_request_no_timing.cbor.inc"
+};
+
+static const uint8_t golden_heartbeat_request_net[] = {
+#include "golden/heartbeat_request_net.cbor.inc"
+};
+
+static const uint8_t golden_image_request[] = {
+#include "golden/image_request.cbor.inc"
+};
+
+static const uint8_t golden_heartbeat_response[] = {
+#include "golden/heartbeat_response.cbor.inc"
+};
+
+// What the golden files hold.
+static const struct device_heartbeat_request heartbeat_request = {
+    .device_id = 0x12345678,
+    .current_firmware = 0x00010203,
+    .protocol_version = 1,
+    .vbat_mv = 2980,
+    .has_display_timing = true,
+    .display_timing = {
+        .epd_type = EPD_TYPE_WS_75_V2B,
+        .partial = false,
+        .spi_time_us = 180000,
+        .phases = {
+            [EPD_PHASE_POWER_ON] = {.time_us = 120000, .bytes = 64},
+            [EPD_PHASE_TRANSFER] = {.time_us = 2500000, .bytes = 48000},
+            [EPD_PHASE_REFRESH] = {.time_us = 3900000},
+            [EPD_PHASE_POWER_OFF] = {.time_us = 100000},
+        },
+    },
+};
+
+static const struct device_heartbeat_request heartbeat_request_no_timing = {
+    .device_id = 0x12345678,
+    .current_firmware = 0x00010203,
+    .protocol_version = 1,
+    .vbat_mv = -1, // What we send when the fuel gauge can't be read.
+};
+
+static const struct device_heartbeat_request heartbeat_request_net = {
+    .device_id = 0x12345678,
+    .current_firmware = 0x00010203,
+    .protocol_version = 2,
+    .vbat_mv = 2950,
+    .has_net_stats = true,
+    .net_stats = {
+        .attach_ms = 4350,
+        .parent_rloc16 = 0x4c00,
+        .parent_rssi = -71,
+        .parent_lq_in = 3,
+        .parent_lq_out = 2,
+        .srtt_ms = 180,
+        .num_transfers = 2,
+        .transfers = {
+            {.kind = NET_TRANSFER_HEARTBEAT, .result = 0, .bytes = 2, .elapsed_ms = 210, .replies = 1},
+            {.kind = NET_TRANSFER_IMAGE, .result = 0, .bytes = 21440, .elapsed_ms = 9800, .replies = 21,
+             .retransmits = 2},
+        },
+    },
+};
+
+static const struct image_request image_request = {
+    .device_id = 0x12345678,
+    .epd_type = EPD_TYPE_WS_75_V2B,
+    .expected_data_size = 48000,
+    .codecs = 0x7,
+    .hs_window = 11,
+    .hs_lookahead = 8,
+    .frame_crc = true,
+};
+
+#define GOLDEN_DESIRED_FIRMWARE 0x00010203
+#define GOLDEN_CHECKIN_INTERVAL 600
+
+static uint8_t encoded[256];
+
+ZTEST(cbor, test_heartbeat_request_matches_host) {
+    size_t len = 0;
+
+    zassert_ok(encode_heartbeat_request(&heartbeat_request, encoded, sizeof(encoded), &len));
+    zassert_equal(len, sizeof(golden_heartbeat_request));
+    zassert_mem_equal(encoded, golden_heartbeat_request, len);
+}
+
+ZTEST(cbor, test_heartbeat_request_without_timing_matches_host) {
+    size_t len = 0;
+
+    zassert_ok(encode_heartbeat_request(&heartbeat_request_no_timing, encoded, sizeof(encoded), &len));
+    zassert_equal(len, sizeof(golden_heartbeat_request_no_timing));
+    zassert_mem_equal(encoded, golden_heartbeat_request_no_timing, len);
+}
+
+ZTEST(cbor, test_heartbeat_request_with_net_stats_matches_host) {
+    size_t len = 0;
+
+    zassert_ok(encode_heartbeat_request(&heartbeat_request_net, encoded, sizeof(encoded), &len));
+    zassert_equal(len, sizeof(golden_heartbeat_request_net));
+    zassert_mem_equal(encoded, golden_heartbeat_request_net, len);
+}
+
+ZTEST(cbor, test_image_request_matches_host) {
+    size_t len = 0;
+
+    zassert_ok(encode_image_request(&image_request, encoded, sizeof(encoded), &len));
+    zassert_equal(len, sizeof(golden_image_request));
+    zassert_mem_equal(encoded, golden_image_request, len);
+}
+
+ZTEST(cbor, test_encode_runs_out_of_space) {
+    size_t len = 0;
+
+    zassert_equal(encode_heartbeat_request(&heartbeat_request, encoded, sizeof(golden_heartbeat_request) - 1, &len),
+                  -ENOMEM);
+    zassert_equal(encode_image_request(&image_request, encoded, sizeof(golden_image_request) - 1, &len), -ENOMEM);
+}
+
+ZTEST(cbor, test_decode_heartbeat_response_from_host) {
+    struct device_heartbeat_response resp;
+
+    zassert_ok(decode_heartbeat_response(golden_heartbeat_response, sizeof(golden_heartbeat_response), &resp));
+    zassert_equal(resp.desired_firmware, GOLDEN_DESIRED_FIRMWARE);
+    zassert_equal(resp.checkin_interval, GOLDEN_CHECKIN_INTERVAL);
+}
+
+ZTEST(cbor, test_decode_skips_unknown_keys) {
+    // The golden response with "extra": [1, 2] added, as a newer host might send.
+    uint8_t with_extra[sizeof(golden_heartbeat_response) + 9];
+    static const uint8_t extra[] = {0x65, 'e', 'x', 't', 'r', 'a', 0x82, 0x01, 0x02};
+    struct device_heartbeat_response resp;
+
+    memcpy(with_extra, golden_heartbeat_response, sizeof(golden_heartbeat_response));
+    memcpy(with_extra + sizeof(golden_heartbeat_response), extra, sizeof(extra));
+    with_extra[0]++; // One more pair in the map header.
+
+    zassert_ok(decode_heartbeat_response(with_extra, sizeof(with_extra), &resp));
+    zassert_equal(resp.desired_firmware, GOLDEN_DESIRED_FIRMWARE);
+    zassert_equal(resp.checkin_interval, GOLDEN_CHECKIN_INTERVAL);
+}
+
+ZTEST(cbor, test_decode_rejects_truncated_response) {
+    struct device_heartbeat_response resp;
+
+    for (size_t len = 0; len < sizeof(golden_heartbeat_response); len++) {
+        zassert_not_ok(decode_heartbeat_response(golden_heartbeat_response, len, &resp), "accepted %zu bytes", len);
+    }
+}
+
+static void bench_encode_heartbeat(void *arg) {
+    size_t len;
+
+    encode_heartbeat_request(&heartbeat_request, encoded, sizeof(encoded), &len);
+}
+
+static void bench_encode_image_request(void *arg) {
+    size_t len;
+
+    encode_image_request(&image_request, encoded, sizeof(encoded), &len);
+}
+
+static void bench_decode_response(void *arg) {
+    struct device_heartbeat_response resp;
+
+    decode_heartbeat_response(golden_heartbeat_response, sizeof(golden_heartbeat_response), &resp);
+}
+
+ZTEST(cbor, test_benchmark_cbor) {
+    struct bench_result res;
+
+    bench_run("encode_heartbeat_request", bench_encode_heartbeat, NULL, 10000, 0, &res);
+    bench_run("encode_image_request", bench_encode_image_request, NULL, 10000, 0, &res);
+    bench_run("decode_heartbeat_response", bench_decode_response, NULL, 10000, 0, &res);
+}
+
+ZTEST_SUITE(cbor, NULL, NULL, NULL, NULL, NULL);
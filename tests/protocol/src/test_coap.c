@@ -0,0 +1,611 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/net/socket.h>
+#include <zephyr/net/coap.h>
+#include <zephyr/net/coap_client.h>
+#include <zephyr/ztest.h>
+
+#include "cbor.h"
+#include "coap_request.h"
+#include "bench.h"
+
+// do_coap_request against a stand-in for the host's CoAP server, on loopback. It serves:
+//   PUT hb       the golden heartbeat response, piggybacked
+//   GET img      SERVER_IMAGE_SIZE bytes in Block2 blocks of the size asked for (up to server_max_szx), or 2.03
+//                Valid if the request's ETag matches
+//   GET slow     nothing at all
+//   anything else 4.04
+
+static const uint8_t golden_heartbeat_response[] = {
+#include "golden/heartbeat_response.cbor.inc"
+};
+
+#define SERVER_PORT 5683
+#define SERVER_IMAGE_SIZE 4000
+// When the first request doesn't ask for a block size.
+#define SERVER_BLOCK_SZX COAP_BLOCK_256
+#define SERVER_STACK_SIZE 4096
+#define SERVER_BUF_SIZE 1280
+#define SERVER_MAX_PATH 32
+
+static const uint8_t server_etag[] = {0x01, 0x23, 0x45, 0x67, 0x89, 0xab, 0xcd, 0xef};
+static uint8_t server_image[SERVER_IMAGE_SIZE];
+
+// What the server saw of the last request.
+static uint8_t server_last_payload[256];
+static size_t server_last_payload_len;
+static int server_first_block2; // Block2 option of the first img request, or negative if it had none.
+static uint8_t server_follow_up[SERVER_BUF_SIZE]; // The img request for block 1, as it came in.
+static size_t server_follow_up_len;
+static enum coap_block_size server_max_szx;
+
+static K_SEM_DEFINE(server_ready, 0, 1);
+K_THREAD_STACK_DEFINE(server_stack, SERVER_STACK_SIZE);
+static struct k_thread server_thread;
+
+static struct coap_client client;
+static struct coap_session session;
+static struct sockaddr_in6 server_addr = {
+    .sin6_family = AF_INET6,
+    .sin6_port = htons(SERVER_PORT),
+    .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+};
+
+static int server_get_path(const struct coap_packet *req, char *path, size_t size) {
+    struct coap_option opts[4];
+    size_t len = 0;
+    int count = coap_find_options(req, COAP_OPTION_URI_PATH, opts, ARRAY_SIZE(opts));
+
+    for (int i = 0; i < count; i++) {
+        if (len + opts[i].len + 2 > size) {
+            return -ENOMEM;
+        }
+        if (i > 0) {
+            path[len++] = '/';
+        }
+        memcpy(&path[len], opts[i].value, opts[i].len);
+        len += opts[i].len;
+    }
+    path[len] = '\0';
+    return 0;
+}
+
+static bool server_etag_matches(const struct coap_packet *req) {
+    struct coap_option etag;
+
+    return coap_find_options(req, COAP_OPTION_ETAG, &etag, 1) == 1 && etag.len == sizeof(server_etag) &&
+           memcmp(etag.value, server_etag, sizeof(server_etag)) == 0;
+}
+
+// Fill RESP with the reply to REQ. Returns nonzero if there is nothing to send.
+static int server_handle(const struct coap_packet *req, struct coap_packet *resp, uint8_t *buf, size_t size) {
+    char path[SERVER_MAX_PATH];
+    uint16_t payload_len;
+    const uint8_t *payload = coap_packet_get_payload(req, &payload_len);
+
+    server_last_payload_len = MIN(payload_len, sizeof(server_last_payload));
+    if (payload != NULL) {
+        memcpy(server_last_payload, payload, server_last_payload_len);
+    }
+
+    if (server_get_path(req, path, sizeof(path)) < 0) {
+        return coap_ack_init(resp, req, buf, size, COAP_RESPONSE_CODE_BAD_REQUEST);
+    }
+
+    if (strcmp(path, "hb") == 0) {
+        return coap_ack_init(resp, req, buf, size, COAP_RESPONSE_CODE_CONTENT) ||
+               coap_packet_append_payload_marker(resp) ||
+               coap_packet_append_payload(resp, golden_heartbeat_response, sizeof(golden_heartbeat_response));
+    }
+
+    if (strcmp(path, "img") == 0) {
+        if (server_etag_matches(req)) {
+            return coap_ack_init(resp, req, buf, size, COAP_RESPONSE_CODE_VALID) ||
+                   coap_packet_append_option(resp, COAP_OPTION_ETAG, server_etag, sizeof(server_etag));
+        }
+
+        // The client asks for the next block with a Block2 option, and for the first one with or without.
+        // Block2 is critical and not repeatable, so a second one gets 4.02 as from any conformant server
+        // (RFC 7252 5.4.5) - even if it matches.
+        struct coap_option block2_opts[2];
+        int block2 = coap_get_option_int(req, COAP_OPTION_BLOCK2);
+        if (coap_find_options(req, COAP_OPTION_BLOCK2, block2_opts, ARRAY_SIZE(block2_opts)) > 1) {
+            return coap_ack_init(resp, req, buf, size, COAP_RESPONSE_CODE_BAD_OPTION);
+        }
+        if (block2 < 0 || (block2 >> 4) == 0) {
+            server_first_block2 = block2;
+        } else if ((block2 >> 4) == 1) {
+            memcpy(server_follow_up, req->data, req->offset);
+            server_follow_up_len = req->offset;
+        }
+        int szx = block2 < 0 ? SERVER_BLOCK_SZX : MIN(block2 & 0x7, server_max_szx);
+        size_t block_size = coap_block_size_to_bytes(szx);
+        size_t num = block2 < 0 ? 0 : (size_t)block2 >> 4;
+        size_t offset = num * block_size;
+        if (offset >= sizeof(server_image)) {
+            return coap_ack_init(resp, req, buf, size, COAP_RESPONSE_CODE_BAD_OPTION);
+        }
+        size_t len = MIN(block_size, sizeof(server_image) - offset);
+        bool more = offset + len < sizeof(server_image);
+
+        return coap_ack_init(resp, req, buf, size, COAP_RESPONSE_CODE_CONTENT) ||
+               coap_packet_append_option(resp, COAP_OPTION_ETAG, server_etag, sizeof(server_etag)) ||
+               coap_append_option_int(resp, COAP_OPTION_BLOCK2, (num << 4) | (more << 3) | szx) ||
+               coap_packet_append_payload_marker(resp) ||
+               coap_packet_append_payload(resp, &server_image[offset], len);
+    }
+
+    if (strcmp(path, "slow") == 0) {
+        return -ENOENT;
+    }
+
+    return coap_ack_init(resp, req, buf, size, COAP_RESPONSE_CODE_NOT_FOUND);
+}
+
+static void server_entry(void *p1, void *p2, void *p3) {
+    static uint8_t rx[SERVER_BUF_SIZE];
+    static uint8_t tx[SERVER_BUF_SIZE];
+    struct sockaddr_in6 bind_addr = {
+        .sin6_family = AF_INET6,
+        .sin6_port = htons(SERVER_PORT),
+        .sin6_addr = IN6ADDR_LOOPBACK_INIT,
+    };
+    int sock = zsock_socket(AF_INET6, SOCK_DGRAM, IPPROTO_UDP);
+
+    // Not the test thread, so no zasserts here - coap_setup fails when server_ready never comes.
+    if (sock < 0 || zsock_bind(sock, (struct sockaddr *)&bind_addr, sizeof(bind_addr)) < 0) {
+        TC_PRINT("stand-in server failed to start: %d\n", errno);
+        return;
+    }
+    k_sem_give(&server_ready);
+
+    while (1) {
+        struct sockaddr_in6 from;
+        socklen_t from_len = sizeof(from);
+        struct coap_packet req;
+        struct coap_packet resp;
+
+        ssize_t len = zsock_recvfrom(sock, rx, sizeof(rx), 0, (struct sockaddr *)&from, &from_len);
+        if (len < 0 || coap_packet_parse(&req, rx, len, NULL, 0) < 0) {
+            continue;
+        }
+
+        if (server_handle(&req, &resp, tx, sizeof(tx)) != 0) {
+            continue;
+        }
+        zsock_sendto(sock, resp.data, resp.offset, 0, (struct sockaddr *)&from, from_len);
+    }
+}
+
+// Collects a response, like buffer_coap_response in main.c.
+struct collect_ctx {
+    uint8_t data[SERVER_IMAGE_SIZE];
+    size_t len;
+    int calls;
+    bool last_seen;
+    int abort_after; // Fail the callback on this call, or 0 to never.
+};
+
+static int collect_response(const uint8_t *payload, size_t len, size_t offset, bool last_block, void *user_data) {
+    struct collect_ctx *ctx = user_data;
+
+    ctx->calls++;
+    if (ctx->abort_after > 0 && ctx->calls >= ctx->abort_after) {
+        return -1;
+    }
+    if (offset != ctx->len || offset + len > sizeof(ctx->data)) {
+        return -1;
+    }
+    memcpy(&ctx->data[offset], payload, len);
+    ctx->len += len;
+    ctx->last_seen = last_block;
+    return 0;
+}
+
+static struct collect_ctx collected;
+
+struct raw_option {
+    uint16_t code;
+    uint16_t len;
+    const uint8_t *value;
+};
+
+// Walk the options of the CoAP message MSG by hand, rather than trusting coap_packet_parse, to see exactly what went
+// on the wire. Returns how many there were, or -EINVAL if they run off the end.
+static int raw_options(const uint8_t *msg, size_t len, struct raw_option *opts, int max) {
+    size_t pos = 4 + (msg[0] & 0x0f); // Fixed header, then the token.
+    uint16_t code = 0;
+    int count = 0;
+
+    while (pos < len && msg[pos] != 0xff) {
+        uint16_t delta = msg[pos] >> 4;
+        uint16_t opt_len = msg[pos] & 0x0f;
+        pos++;
+        // 13 and 14 say the real value follows, in one or two bytes.
+        if (delta == 13) {
+            delta = 13 + msg[pos++];
+        } else if (delta == 14) {
+            delta = 269 + (msg[pos] << 8 | msg[pos + 1]);
+            pos += 2;
+        }
+        if (opt_len == 13) {
+            opt_len = 13 + msg[pos++];
+        } else if (opt_len == 14) {
+            opt_len = 269 + (msg[pos] << 8 | msg[pos + 1]);
+            pos += 2;
+        }
+        if (delta == 15 || opt_len == 15 || pos + opt_len > len || count == max) {
+            return -EINVAL;
+        }
+        code += delta;
+        opts[count++] = (struct raw_option){.code = code, .len = opt_len, .value = &msg[pos]};
+        pos += opt_len;
+    }
+    return count;
+}
+
+static coap_request_result_t request(const char *path, enum coap_method method, const uint8_t *payload, size_t len,
+                                     struct coap_client_option *options, size_t num_options, uint32_t timeout) {
+    return do_coap_request(&session, path, method, payload, len, options, num_options, NULL, collect_response,
+                           &collected, timeout);
+}
+
+static coap_request_result_t download(struct coap_blockwise *bw, struct coap_client_option *options,
+                                      size_t num_options) {
+    return do_coap_request(&session, "img", COAP_METHOD_GET, NULL, 0, options, num_options, bw, collect_response,
+                           &collected, 10);
+}
+
+ZTEST(coap_request, test_heartbeat_round_trip) {
+    static const struct device_heartbeat_request hb = {
+        .device_id = 0x12345678,
+        .current_firmware = 0x00010203,
+        .protocol_version = 1,
+        .vbat_mv = 2980,
+    };
+    uint8_t req[128];
+    size_t req_len;
+    struct device_heartbeat_response resp;
+
+    zassert_ok(encode_heartbeat_request(&hb, req, sizeof(req), &req_len));
+    zassert_equal(request("hb", COAP_METHOD_PUT, req, req_len, NULL, 0, 5), COAP_REQUEST_SUCCESS);
+
+    zassert_equal(server_last_payload_len, req_len);
+    zassert_mem_equal(server_last_payload, req, req_len);
+    zassert_true(collected.last_seen);
+    zassert_ok(decode_heartbeat_response(collected.data, collected.len, &resp));
+    zassert_equal(resp.desired_firmware, 0x00010203);
+    zassert_equal(resp.checkin_interval, 600);
+}
+
+ZTEST(coap_request, test_block2_transfer) {
+    zassert_equal(request("img", COAP_METHOD_GET, NULL, 0, NULL, 0, 10), COAP_REQUEST_SUCCESS);
+
+    zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+    zassert_mem_equal(collected.data, server_image, SERVER_IMAGE_SIZE);
+    zassert_equal(collected.calls, DIV_ROUND_UP(SERVER_IMAGE_SIZE, coap_block_size_to_bytes(SERVER_BLOCK_SZX)));
+    zassert_true(collected.last_seen);
+}
+
+ZTEST(coap_request, test_block2_negotiated_size) {
+    static const enum coap_block_size sizes[] = {COAP_BLOCK_64, COAP_BLOCK_256, COAP_BLOCK_512, COAP_BLOCK_1024};
+
+    for (size_t i = 0; i < ARRAY_SIZE(sizes); i++) {
+        struct coap_blockwise bw = {.preferred_szx = sizes[i]};
+        size_t block_size = coap_block_size_to_bytes(sizes[i]);
+
+        collected = (struct collect_ctx){0};
+        zassert_equal(download(&bw, NULL, 0), COAP_REQUEST_SUCCESS, "%zu byte blocks", block_size);
+        zassert_equal(server_first_block2, sizes[i], "first request should ask for %zu byte blocks", block_size);
+        zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+        zassert_mem_equal(collected.data, server_image, SERVER_IMAGE_SIZE);
+        zassert_equal(bw.block_size, block_size);
+        zassert_equal(bw.blocks, DIV_ROUND_UP(SERVER_IMAGE_SIZE, block_size));
+        zassert_equal(bw.slow_blocks, 0);
+    }
+}
+
+ZTEST(coap_request, test_block2_server_sends_smaller) {
+    struct coap_blockwise bw = {.preferred_szx = COAP_BLOCK_1024};
+
+    server_max_szx = COAP_BLOCK_512;
+    zassert_equal(download(&bw, NULL, 0), COAP_REQUEST_SUCCESS);
+    zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+    zassert_mem_equal(collected.data, server_image, SERVER_IMAGE_SIZE);
+    zassert_equal(bw.block_size, 512);
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_1024), COAP_BLOCK_512, "no use asking for more");
+}
+
+ZTEST(coap_request, test_block2_with_etag) {
+    struct coap_blockwise bw = {.preferred_szx = COAP_BLOCK_1024};
+    struct coap_client_option etag = {
+        .code = COAP_OPTION_ETAG,
+        .len = sizeof(server_etag),
+    };
+
+    memset(etag.value, 0, sizeof(etag.value));
+    zassert_equal(download(&bw, &etag, 1), COAP_REQUEST_SUCCESS);
+    zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+    zassert_equal(bw.block_size, 1024);
+
+    memcpy(etag.value, server_etag, sizeof(server_etag));
+    zassert_equal(download(&bw, &etag, 1), COAP_REQUEST_VALID);
+    zassert_equal(bw.blocks, 0);
+}
+
+// A follow-up carries coap_client's Block2 for the next block, and our first-block Block2 turned into Size2 - in
+// number order, though coap_client appends them the other way round.
+ZTEST(coap_request, test_block2_follow_up_on_the_wire) {
+    struct coap_blockwise bw = {.preferred_szx = COAP_BLOCK_256};
+    struct coap_client_option etag = {
+        .code = COAP_OPTION_ETAG,
+        .len = sizeof(server_etag),
+    };
+    struct raw_option opts[8];
+
+    memset(etag.value, 0, sizeof(etag.value));
+    zassert_equal(download(&bw, &etag, 1), COAP_REQUEST_SUCCESS);
+    zassert_true(server_follow_up_len > 0, "no request for block 1");
+
+    int count = raw_options(server_follow_up, server_follow_up_len, opts, ARRAY_SIZE(opts));
+    zassert_equal(count, 4, "got %d options", count);
+    zassert_equal(opts[0].code, COAP_OPTION_ETAG);
+    zassert_equal(opts[0].len, sizeof(server_etag));
+    zassert_equal(opts[1].code, COAP_OPTION_URI_PATH);
+    zassert_equal(opts[1].len, 3);
+    zassert_mem_equal(opts[1].value, "img", 3);
+    zassert_equal(opts[2].code, COAP_OPTION_BLOCK2);
+    zassert_equal(opts[2].len, 1);
+    zassert_equal(opts[2].value[0], (1 << 4) | COAP_BLOCK_256, "block 1, same size");
+    zassert_equal(opts[3].code, COAP_OPTION_SIZE2);
+    zassert_equal(opts[3].len, 0);
+}
+
+ZTEST(coap_request, test_next_block_size) {
+    struct coap_blockwise bw = {.preferred_szx = COAP_BLOCK_512, .block_size = 512, .blocks = 20};
+
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_1024), COAP_BLOCK_1024, "clean, so try larger");
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_512), COAP_BLOCK_512, "already at the maximum");
+
+    bw.slow_blocks = 2;
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_1024), COAP_BLOCK_512, "a few resent, stay put");
+
+    bw.slow_blocks = 3;
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_1024), COAP_BLOCK_256, "too many resent");
+
+    // A timeout on the first block counts as one slow block out of none.
+    bw = (struct coap_blockwise){.preferred_szx = COAP_BLOCK_1024, .slow_blocks = 1};
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_1024), COAP_BLOCK_512);
+
+    bw = (struct coap_blockwise){.preferred_szx = COAP_BLOCK_64, .blocks = 10, .slow_blocks = 10};
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_1024), COAP_BLOCK_64, "never below 64 bytes");
+
+    bw = (struct coap_blockwise){.preferred_szx = COAP_BLOCK_256, .blocks = 3};
+    zassert_equal(coap_blockwise_next_szx(&bw, COAP_BLOCK_1024), COAP_BLOCK_256, "too few blocks to tell");
+}
+
+ZTEST(coap_request, test_matching_etag_is_valid) {
+    struct coap_client_option etag = {
+        .code = COAP_OPTION_ETAG,
+        .len = sizeof(server_etag),
+    };
+
+    memcpy(etag.value, server_etag, sizeof(server_etag));
+    zassert_equal(request("img", COAP_METHOD_GET, NULL, 0, &etag, 1, 5), COAP_REQUEST_VALID);
+    zassert_equal(collected.calls, 0, "2.03 shouldn't reach the stream callback");
+}
+
+ZTEST(coap_request, test_stale_etag_gets_content) {
+    struct coap_client_option etag = {
+        .code = COAP_OPTION_ETAG,
+        .len = sizeof(server_etag),
+    };
+
+    memset(etag.value, 0, sizeof(etag.value));
+    zassert_equal(request("img", COAP_METHOD_GET, NULL, 0, &etag, 1, 10), COAP_REQUEST_SUCCESS);
+    zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+}
+
+ZTEST(coap_request, test_not_found_is_proto_error) {
+    zassert_equal(request("nope", COAP_METHOD_GET, NULL, 0, NULL, 0, 5), COAP_REQUEST_PROTO_ERROR);
+}
+
+ZTEST(coap_request, test_callback_abort) {
+    collected.abort_after = 2;
+    zassert_equal(request("img", COAP_METHOD_GET, NULL, 0, NULL, 0, 10), COAP_REQUEST_CALLBACK_ABORT);
+    zassert_equal(collected.calls, 2);
+
+    // The client has to be usable again straight away, the way main.c retries a failed image.
+    collected = (struct collect_ctx){0};
+    zassert_equal(request("img", COAP_METHOD_GET, NULL, 0, NULL, 0, 10), COAP_REQUEST_SUCCESS);
+    zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+}
+
+ZTEST(coap_request, test_no_reply_times_out) {
+    zassert_equal(request("slow", COAP_METHOD_GET, NULL, 0, NULL, 0, 1), COAP_REQUEST_TIMEOUT);
+}
+
+static int stall_response(const uint8_t *payload, size_t len, size_t offset, bool last_block, void *user_data) {
+    k_msleep(1500);
+    return collect_response(payload, len, offset, last_block, user_data);
+}
+
+ZTEST(coap_request, test_timeout_waits_for_callback) {
+    struct coap_request img;
+
+    // Gives up a second in, half way through handling the first block.
+    coap_request_submit(&img, &session, "img", COAP_METHOD_GET, NULL, 0, NULL, 0, NULL, stall_response, &collected,
+                        1);
+    zassert_equal(coap_request_wait(&img), COAP_REQUEST_TIMEOUT, "finishing the block shouldn't undo the timeout");
+    zassert_equal(collected.calls, 1, "returned while the stream callback was still running");
+
+    k_msleep(500);
+    zassert_equal(collected.calls, 1, "the request carried on after it was given up on");
+}
+
+ZTEST(coap_request, test_session_learns_round_trip) {
+    int sockfd = session.sockfd;
+
+    zassert_false(session.has_rtt);
+    zassert_equal(coap_session_ack_timeout(&session), CONFIG_COAP_INIT_ACK_TIMEOUT_MS);
+
+    zassert_equal(request("hb", COAP_METHOD_PUT, server_image, 64, NULL, 0, 5), COAP_REQUEST_SUCCESS);
+    zassert_true(session.has_rtt);
+    collected = (struct collect_ctx){0};
+    zassert_equal(request("img", COAP_METHOD_GET, NULL, 0, NULL, 0, 10), COAP_REQUEST_SUCCESS);
+
+    // Loopback round trips are well under the floor.
+    zassert_equal(coap_session_ack_timeout(&session), 1000, "got %u ms", coap_session_ack_timeout(&session));
+    zassert_equal(session.sockfd, sockfd, "requests should share the session's socket");
+}
+
+ZTEST(coap_request, test_session_counts_requests) {
+    zassert_equal(request("img", COAP_METHOD_GET, NULL, 0, NULL, 0, 10), COAP_REQUEST_SUCCESS);
+    zassert_equal(session.last.bytes, SERVER_IMAGE_SIZE);
+    zassert_equal(session.last.replies, DIV_ROUND_UP(SERVER_IMAGE_SIZE, coap_block_size_to_bytes(SERVER_BLOCK_SZX)));
+    zassert_equal(session.last.retransmits, 0);
+
+    zassert_equal(request("slow", COAP_METHOD_GET, NULL, 0, NULL, 0, 1), COAP_REQUEST_TIMEOUT);
+    zassert_equal(session.last.bytes, 0);
+    zassert_equal(session.last.replies, 0);
+    zassert_equal(session.last.retransmits, 1, "a request that never got a reply counts as resent");
+    zassert_true(session.last.elapsed_ms >= 1000);
+
+    zassert_equal(session.requests, 2);
+    zassert_equal(session.retransmits, 1);
+}
+
+// The way main.c sends the heartbeat and image together.
+ZTEST(coap_request, test_concurrent_requests) {
+    static struct collect_ctx hb_collected;
+    struct coap_request hb;
+    struct coap_request img;
+    struct device_heartbeat_response resp;
+
+    hb_collected = (struct collect_ctx){0};
+    coap_request_submit(&hb, &session, "hb", COAP_METHOD_PUT, server_image, 64, NULL, 0, NULL, collect_response,
+                        &hb_collected, 5);
+    coap_request_submit(&img, &session, "img", COAP_METHOD_GET, NULL, 0, NULL, 0, NULL, collect_response,
+                        &collected, 10);
+    coap_request_wait_all((struct coap_request *[]){&hb, &img}, 2);
+
+    zassert_equal(hb.result, COAP_REQUEST_SUCCESS);
+    zassert_ok(decode_heartbeat_response(hb_collected.data, hb_collected.len, &resp));
+    zassert_equal(img.result, COAP_REQUEST_SUCCESS);
+    zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+    zassert_mem_equal(collected.data, server_image, SERVER_IMAGE_SIZE);
+
+    // Each keeps its own count.
+    zassert_equal(hb.stats.replies, 1);
+    zassert_equal(img.stats.bytes, SERVER_IMAGE_SIZE);
+    zassert_equal(session.requests, 2);
+}
+
+ZTEST(coap_request, test_concurrent_timeout_spares_other) {
+    struct coap_request slow;
+    struct coap_request img;
+
+    coap_request_submit(&slow, &session, "slow", COAP_METHOD_GET, NULL, 0, NULL, 0, NULL, NULL, NULL, 1);
+    coap_request_submit(&img, &session, "img", COAP_METHOD_GET, NULL, 0, NULL, 0, NULL, collect_response,
+                        &collected, 10);
+    coap_request_wait_all((struct coap_request *[]){&slow, &img}, 2);
+
+    zassert_equal(slow.result, COAP_REQUEST_TIMEOUT);
+    zassert_equal(img.result, COAP_REQUEST_SUCCESS, "cancelling one request shouldn't cancel the other");
+    zassert_equal(collected.len, SERVER_IMAGE_SIZE);
+}
+
+ZTEST(coap_request, test_concurrent_abort_spares_other) {
+    static struct collect_ctx hb_collected;
+    struct coap_request hb;
+    struct coap_request img;
+
+    hb_collected = (struct collect_ctx){0};
+    collected.abort_after = 2;
+    coap_request_submit(&img, &session, "img", COAP_METHOD_GET, NULL, 0, NULL, 0, NULL, collect_response,
+                        &collected, 10);
+    coap_request_submit(&hb, &session, "hb", COAP_METHOD_PUT, server_image, 64, NULL, 0, NULL, collect_response,
+                        &hb_collected, 5);
+    coap_request_wait_all((struct coap_request *[]){&img, &hb}, 2);
+
+    zassert_equal(img.result, COAP_REQUEST_CALLBACK_ABORT);
+    zassert_equal(hb.result, COAP_REQUEST_SUCCESS);
+    zassert_true(hb_collected.last_seen);
+}
+
+ZTEST(coap_request, test_closed_session) {
+    coap_session_close(&session);
+    zassert_equal(request("hb", COAP_METHOD_PUT, server_image, 64, NULL, 0, 5), COAP_REQUEST_NETWORK_ERROR);
+    coap_session_close(&session); // Closing twice is fine.
+}
+
+static void bench_heartbeat(void *arg) {
+    collected = (struct collect_ctx){0};
+    // Any 64 bytes will do as the request payload.
+    request("hb", COAP_METHOD_PUT, server_image, 64, NULL, 0, 5);
+}
+
+static void bench_image(void *arg) {
+    collected = (struct collect_ctx){0};
+    request("img", COAP_METHOD_GET, NULL, 0, NULL, 0, 10);
+}
+
+static void bench_image_1k(void *arg) {
+    struct coap_blockwise bw = {.preferred_szx = COAP_BLOCK_1024};
+
+    collected = (struct collect_ctx){0};
+    download(&bw, NULL, 0);
+}
+
+static void bench_image_valid(void *arg) {
+    struct coap_client_option etag = {
+        .code = COAP_OPTION_ETAG,
+        .len = sizeof(server_etag),
+    };
+
+    memcpy(etag.value, server_etag, sizeof(server_etag));
+    collected = (struct collect_ctx){0};
+    request("img", COAP_METHOD_GET, NULL, 0, &etag, 1, 5);
+}
+
+ZTEST(coap_request, test_benchmark_coap) {
+    struct bench_result res;
+
+    bench_run("do_coap_request hb", bench_heartbeat, NULL, 50, 64, &res);
+    bench_run("do_coap_request img block2", bench_image, NULL, 20, SERVER_IMAGE_SIZE, &res);
+    bench_run("do_coap_request img block2 1024", bench_image_1k, NULL, 20, SERVER_IMAGE_SIZE, &res);
+    bench_run("do_coap_request img 2.03", bench_image_valid, NULL, 50, 0, &res);
+    // The receive thread belongs to coap_client, and its high-water mark covers every request so far.
+    bench_report_thread_stack("coap_client recv thread", "coap_client_recv_thread");
+}
+
+static void *coap_setup(void) {
+    for (size_t i = 0; i < sizeof(server_image); i++) {
+        server_image[i] = (uint8_t)(i * 31 + (i >> 8));
+    }
+
+    k_thread_create(&server_thread, server_stack, K_THREAD_STACK_SIZEOF(server_stack), server_entry, NULL, NULL,
+                    NULL, K_PRIO_PREEMPT(1), 0, K_NO_WAIT);
+    k_thread_name_set(&server_thread, "coap_server");
+    zassert_ok(k_sem_take(&server_ready, K_SECONDS(5)), "stand-in server didn't start");
+    zassert_ok(coap_client_init(&client, NULL));
+    return NULL;
+}
+
+static void coap_before(void *fixture) {
+    // A fresh session per test, so round trip state doesn't carry between them.
+    zassert_ok(coap_session_open(&session, &client, (struct sockaddr *)&server_addr));
+    collected = (struct collect_ctx){0};
+    server_last_payload_len = 0;
+    server_first_block2 = -1;
+    server_follow_up_len = 0;
+    server_max_szx = COAP_BLOCK_1024;
+}
+
+static void coap_after(void *fixture) {
+    coap_session_close(&session);
+}
+
+ZTEST_SUITE(coap_request, NULL, coap_setup, coap_before, coap_after, NULL);
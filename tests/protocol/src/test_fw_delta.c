@@ -0,0 +1,130 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "fw_delta.h"
+#include "bench.h"
+
+// Applying the golden delta, which host/src/fw_delta.rs checks it makes from the same two images, fed in CoAP-sized
+// and awkward pieces.
+
+static const uint8_t source[] = {
+#include "golden/fw_delta_source.bin.inc"
+};
+
+static const uint8_t target[] = {
+#include "golden/fw_delta_target.bin.inc"
+};
+
+static const uint8_t delta[] = {
+#include "golden/fw_delta.delta.inc"
+};
+
+static uint8_t corrupted_source[sizeof(source)];
+static uint8_t out[sizeof(target) + 64];
+static size_t out_len;
+static struct fw_delta d;
+
+static int read_source(void *ctx, size_t offset, uint8_t *buf, size_t len) {
+    const uint8_t *image = ctx;
+
+    zassert_true(offset + len <= sizeof(source), "read %zu bytes at %zu, past the image", len, offset);
+    memcpy(buf, image + offset, len);
+    return 0;
+}
+
+static int write_target(void *ctx, const uint8_t *data, size_t len) {
+    if (out_len + len > sizeof(out)) {
+        return -ENOSPC;
+    }
+    memcpy(out + out_len, data, len);
+    out_len += len;
+    return 0;
+}
+
+static void start(const uint8_t *image, size_t source_limit) {
+    struct fw_delta_io io = {
+        .read_source = read_source,
+        .write_target = write_target,
+        .ctx = (void *)image,
+    };
+
+    fw_delta_init(&d, &io, source_limit);
+    out_len = 0;
+}
+
+static int apply(const uint8_t *in, size_t len, size_t block) {
+    for (size_t pos = 0; pos < len; pos += block) {
+        int ret = fw_delta_write(&d, in + pos, MIN(block, len - pos));
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return fw_delta_finish(&d);
+}
+
+ZTEST(fw_delta, test_golden_delta) {
+    static const size_t blocks[] = {1024, 1, 3, 20, 21, 64, sizeof(delta)};
+
+    for (size_t i = 0; i < ARRAY_SIZE(blocks); i++) {
+        start(source, sizeof(source));
+        zassert_ok(apply(delta, sizeof(delta), blocks[i]), "%zu byte blocks", blocks[i]);
+        zassert_equal(out_len, sizeof(target), "%zu byte blocks: got %zu bytes", blocks[i], out_len);
+        zassert_mem_equal(out, target, sizeof(target), "%zu byte blocks", blocks[i]);
+    }
+}
+
+ZTEST(fw_delta, test_rejects_other_source) {
+    memcpy(corrupted_source, source, sizeof(source));
+    corrupted_source[sizeof(source) / 2] ^= 1;
+
+    start(corrupted_source, sizeof(source));
+    zassert_equal(apply(delta, sizeof(delta), 1024), -EINVAL);
+    zassert_equal(out_len, 0, "wrote %zu bytes before noticing", out_len);
+}
+
+ZTEST(fw_delta, test_rejects_source_past_slot) {
+    start(source, sizeof(source) - 1);
+    zassert_equal(apply(delta, sizeof(delta), 1024), -EINVAL);
+}
+
+ZTEST(fw_delta, test_rejects_truncated) {
+    start(source, sizeof(source));
+    zassert_equal(apply(delta, sizeof(delta) - 1, 1024), -EINVAL);
+}
+
+ZTEST(fw_delta, test_rejects_trailing_bytes) {
+    static uint8_t longer[sizeof(delta) + 1];
+
+    memcpy(longer, delta, sizeof(delta));
+    longer[sizeof(delta)] = 2; // An INSERT after the image is complete.
+    start(source, sizeof(source));
+    zassert_equal(apply(longer, sizeof(longer), 1024), -EINVAL);
+}
+
+ZTEST(fw_delta, test_rejects_corrupt_ops) {
+    static uint8_t corrupt[sizeof(delta)];
+
+    // Anywhere past the header, a flipped bit either breaks an op or the target's CRC.
+    for (size_t at = FW_DELTA_HEADER_LEN; at < sizeof(delta); at += 37) {
+        memcpy(corrupt, delta, sizeof(delta));
+        corrupt[at] ^= 0x40;
+        start(source, sizeof(source));
+        zassert_true(apply(corrupt, sizeof(corrupt), 1024) < 0, "flipped byte %zu", at);
+    }
+}
+
+static void bench_apply(void *arg) {
+    start(source, sizeof(source));
+    apply(delta, sizeof(delta), 1024);
+}
+
+ZTEST(fw_delta, test_benchmark_fw_delta) {
+    struct bench_result res;
+
+    bench_run("fw_delta apply", bench_apply, NULL, 200, sizeof(target), &res);
+}
+
+ZTEST_SUITE(fw_delta, NULL, NULL, NULL, NULL, NULL);
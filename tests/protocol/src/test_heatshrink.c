@@ -0,0 +1,239 @@
+#include <stdio.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "heatshrink/heatshrink_decoder.h"
+#include "image_codec.h"
+#include "bench.h"
+
+// Whichever heatshrink decoder CONFIG_APP_HEATSHRINK_FAST_DECODER picks, decoding streams from a small greedy
+// encoder here, fed in CoAP-sized and awkward pieces. tests/heatshrink_bench checks the two decoders against each
+// other on the host; this checks the one that's built, through the same calls main.c makes.
+
+// One plane of a 2.9" panel at 2bpp.
+#define FRAME_ROW_BYTES 32
+#define FRAME_ROWS 296
+#define FRAME_SIZE (FRAME_ROW_BYTES * FRAME_ROWS)
+#define STREAM_MAX (FRAME_SIZE + FRAME_SIZE / 8 + 16)
+
+static uint8_t frame[FRAME_SIZE];
+static uint8_t stream[STREAM_MAX + 2];
+static size_t stream_len;
+static uint8_t decoded[FRAME_SIZE + 64];
+static struct image_decoder dec;
+
+// White, a few boxes, and some lines of "text".
+static void make_frame(void) {
+    uint32_t x = 12345;
+
+    memset(frame, 0x55, sizeof(frame));
+    for (int row = 20; row < 60; row++) {
+        memset(&frame[row * FRAME_ROW_BYTES + 4], 0x00, 10);
+    }
+    for (int row = 100; row < 200; row++) {
+        if (row % 12 < 8) {
+            for (int col = 2; col < 30; col++) {
+                x = x * 1103515245 + 12345;
+                frame[row * FRAME_ROW_BYTES + col] = (x >> 16) & 0x3 ? 0x55 : (uint8_t)(x >> 8);
+            }
+        }
+    }
+}
+
+struct bit_writer {
+    uint8_t *out;
+    size_t cap;
+    size_t len;
+    uint8_t byte;
+    int bits;
+};
+
+static void put_bits(struct bit_writer *bw, uint32_t value, int count) {
+    while (count-- > 0) {
+        bw->byte = (bw->byte << 1) | ((value >> count) & 1);
+        if (++bw->bits == 8) {
+            zassert_true(bw->len < bw->cap);
+            bw->out[bw->len++] = bw->byte;
+            bw->bits = 0;
+            bw->byte = 0;
+        }
+    }
+}
+
+// Greedy heatshrink encoder: the longest match in the window, or a literal when that's cheaper.
+static size_t encode(const uint8_t *in, size_t len, int window_bits, int lookahead_bits, uint8_t *out, size_t cap) {
+    struct bit_writer bw = {.out = out, .cap = cap};
+    const size_t window = 1u << window_bits;
+    const size_t max_len = 1u << lookahead_bits;
+    const size_t break_even = (1 + window_bits + lookahead_bits) / 9;
+
+    for (size_t i = 0; i < len;) {
+        size_t best_len = 0;
+        size_t best_off = 0;
+
+        for (size_t off = 1; off <= MIN(i, window); off++) {
+            size_t n = 0;
+            while (n < max_len && i + n < len && in[i + n] == in[i - off + n]) {
+                n++;
+            }
+            if (n > best_len) {
+                best_len = n;
+                best_off = off;
+            }
+        }
+
+        if (best_len > break_even) {
+            put_bits(&bw, 0, 1);
+            put_bits(&bw, best_off - 1, window_bits);
+            put_bits(&bw, best_len - 1, lookahead_bits);
+            i += best_len;
+        } else {
+            put_bits(&bw, 1, 1);
+            put_bits(&bw, in[i], 8);
+            i++;
+        }
+    }
+    if (bw.bits > 0) {
+        put_bits(&bw, 0, 8 - bw.bits);
+    }
+    return bw.len;
+}
+
+// Decode IN in blocks of BLOCK bytes into output buffers of SPACE bytes, the way img_drain_decoder does.
+static size_t decode(const uint8_t *in, size_t len, size_t block, size_t space) {
+    size_t out_len = 0;
+    HSD_poll_res pres;
+
+    size_t pos = 0;
+    do {
+        size_t block_len = MIN(block, len - pos);
+        size_t used = 0;
+
+        do {
+            size_t consumed;
+            size_t produced;
+            size_t room = MIN(space, sizeof(decoded) - out_len);
+
+            pres = image_decoder_decode(&dec, in + pos + used, block_len - used, &consumed, decoded + out_len, room,
+                                        &produced);
+            zassert_true(pres >= 0, "decode failed: %d", pres);
+            used += consumed;
+            out_len += produced;
+            zassert_true(out_len <= FRAME_SIZE, "decoded past the end of the frame");
+        } while (pres == HSDR_POLL_MORE || used < block_len);
+        pos += block_len;
+    } while (pos < len);
+
+    while (image_decoder_finish(&dec) == HSDR_FINISH_MORE) {
+        size_t consumed;
+        size_t produced;
+
+        pres = image_decoder_decode(&dec, NULL, 0, &consumed, decoded + out_len,
+                                    MIN(space, sizeof(decoded) - out_len), &produced);
+        zassert_true(pres >= 0, "decode failed: %d", pres);
+        out_len += produced;
+    }
+    return out_len;
+}
+
+// Encode the frame as codec 0 (plain 11/8) or codec 2 with the given parameters.
+static void make_stream(int codec, int window_bits, int lookahead_bits) {
+    size_t header = 1;
+
+    stream[0] = codec;
+    if (codec == IMAGE_CODEC_HEATSHRINK_PARAMS) {
+        stream[1] = window_bits << 4 | lookahead_bits;
+        header = 2;
+    }
+    stream_len = header + encode(frame, sizeof(frame), window_bits, lookahead_bits, stream + header, STREAM_MAX);
+}
+
+static void check_decode(size_t block, size_t space) {
+    image_decoder_reset(&dec);
+    size_t len = decode(stream, stream_len, block, space);
+    zassert_equal(len, FRAME_SIZE, "%zu byte blocks, %zu byte buffers: got %zu bytes", block, space, len);
+    zassert_mem_equal(decoded, frame, FRAME_SIZE, "%zu byte blocks, %zu byte buffers", block, space);
+}
+
+ZTEST(heatshrink, test_plain_stream) {
+    static const size_t blocks[] = {256, 1, 3, 300};
+    static const size_t spaces[] = {512, 1, 7, 256};
+
+    if (!(IMAGE_CODECS_SUPPORTED & BIT(IMAGE_CODEC_HEATSHRINK))) {
+        ztest_test_skip(); // Built too small for 11/8.
+    }
+    make_stream(IMAGE_CODEC_HEATSHRINK, 11, 8);
+    for (size_t b = 0; b < ARRAY_SIZE(blocks); b++) {
+        for (size_t s = 0; s < ARRAY_SIZE(spaces); s++) {
+            check_decode(blocks[b], spaces[s]);
+        }
+    }
+}
+
+ZTEST(heatshrink, test_negotiated_parameters) {
+    static const uint8_t params[][2] = {{8, 4}, {9, 7}, {10, 5}, {11, 4}, {11, 8}};
+
+    for (size_t i = 0; i < ARRAY_SIZE(params); i++) {
+        if (params[i][0] > HEATSHRINK_STATIC_WINDOW_BITS || params[i][1] > HEATSHRINK_STATIC_LOOKAHEAD_BITS) {
+            continue;
+        }
+        make_stream(IMAGE_CODEC_HEATSHRINK_PARAMS, params[i][0], params[i][1]);
+        check_decode(256, 512);
+        check_decode(1, 7);
+    }
+}
+
+ZTEST(heatshrink, test_rejects_parameters_over_the_maximum) {
+    heatshrink_decoder hsd;
+    uint8_t header[] = {IMAGE_CODEC_HEATSHRINK_PARAMS, (HEATSHRINK_STATIC_WINDOW_BITS + 1) << 4 | 4};
+    size_t consumed;
+    size_t produced;
+
+    zassert_ok(heatshrink_decoder_configure(&hsd, HEATSHRINK_STATIC_WINDOW_BITS, HEATSHRINK_STATIC_LOOKAHEAD_BITS));
+    zassert_equal(heatshrink_decoder_configure(&hsd, HEATSHRINK_STATIC_WINDOW_BITS + 1, 4), -1);
+    zassert_equal(heatshrink_decoder_configure(&hsd, 8, HEATSHRINK_STATIC_LOOKAHEAD_BITS + 1), -1);
+    zassert_equal(heatshrink_decoder_configure(&hsd, 8, 8), -1, "lookahead has to be below the window");
+
+    image_decoder_reset(&dec);
+    zassert_true(image_decoder_decode(&dec, header, sizeof(header), &consumed, decoded, sizeof(decoded),
+                                      &produced) < 0);
+}
+
+ZTEST(heatshrink, test_unknown_codec) {
+    uint8_t bad[] = {0x7f, 0, 0, 0};
+    size_t consumed;
+    size_t produced;
+
+    image_decoder_reset(&dec);
+    zassert_true(image_decoder_decode(&dec, bad, sizeof(bad), &consumed, decoded, sizeof(decoded), &produced) < 0);
+}
+
+static void bench_decode(void *arg) {
+    image_decoder_reset(&dec);
+    decode(stream, stream_len, 256, CONFIG_APP_IMAGE_BUFFER_SIZE);
+}
+
+ZTEST(heatshrink, test_benchmark_heatshrink) {
+    static char name[40];
+    struct bench_result res;
+
+    // The largest parameters this build takes, and the smallest the host will pick.
+    make_stream(IMAGE_CODEC_HEATSHRINK_PARAMS, HEATSHRINK_STATIC_WINDOW_BITS, HEATSHRINK_STATIC_LOOKAHEAD_BITS);
+    snprintf(name, sizeof(name), "heatshrink %d/%d (%s)", HEATSHRINK_STATIC_WINDOW_BITS,
+             HEATSHRINK_STATIC_LOOKAHEAD_BITS, IS_ENABLED(CONFIG_APP_HEATSHRINK_FAST_DECODER) ? "fast" : "upstream");
+    bench_run(name, bench_decode, NULL, 200, FRAME_SIZE, &res);
+
+    make_stream(IMAGE_CODEC_HEATSHRINK_PARAMS, 8, 4);
+    snprintf(name, sizeof(name), "heatshrink 8/4 (%s)",
+             IS_ENABLED(CONFIG_APP_HEATSHRINK_FAST_DECODER) ? "fast" : "upstream");
+    bench_run(name, bench_decode, NULL, 200, FRAME_SIZE, &res);
+}
+
+static void *heatshrink_setup(void) {
+    make_frame();
+    return NULL;
+}
+
+ZTEST_SUITE(heatshrink, NULL, heatshrink_setup, NULL, NULL, NULL);
@@ -0,0 +1,110 @@
+#include <errno.h>
+#include <string.h>
+
+#include <zephyr/kernel.h>
+#include <zephyr/ztest.h>
+
+#include "wrapped_settings.h"
+#include "bench.h"
+
+// wrapped_settings on ZMS over the flash simulator, the same backend the app uses on flash.
+
+ZTEST(wrapped_settings, test_set_then_get) {
+    uint8_t value[] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t read[16] = {0};
+    size_t len = 0;
+
+    zassert_ok(wrapped_settings_set_raw("test_key", value, sizeof(value)));
+    zassert_ok(wrapped_settings_get_raw("test_key", read, sizeof(read), &len));
+    zassert_equal(len, sizeof(value));
+    zassert_mem_equal(read, value, sizeof(value));
+}
+
+ZTEST(wrapped_settings, test_overwrite) {
+    uint8_t first[] = {0xaa, 0xbb, 0xcc};
+    uint8_t second[] = {0x11};
+    uint8_t read[16];
+    size_t len = 0;
+
+    zassert_ok(wrapped_settings_set_raw("overwrite", first, sizeof(first)));
+    zassert_ok(wrapped_settings_set_raw("overwrite", second, sizeof(second)));
+    zassert_ok(wrapped_settings_get_raw("overwrite", read, sizeof(read), &len));
+    zassert_equal(len, sizeof(second));
+    zassert_equal(read[0], 0x11);
+}
+
+ZTEST(wrapped_settings, test_empty_value_clears) {
+    // How main.c forgets the image ETag when it starts overwriting the panel.
+    uint8_t etag[8] = {1, 2, 3, 4, 5, 6, 7, 8};
+    uint8_t none = 0;
+    uint8_t read[8];
+    size_t len = 0;
+
+    zassert_ok(wrapped_settings_set_raw("cleared", etag, sizeof(etag)));
+    zassert_ok(wrapped_settings_set_raw("cleared", &none, 0));
+    int ret = wrapped_settings_get_raw("cleared", read, sizeof(read), &len);
+    zassert_true(ret == -ENOENT || (ret == 0 && len == 0), "got %d, %zu bytes", ret, len);
+}
+
+ZTEST(wrapped_settings, test_missing_key) {
+    uint8_t read[8];
+    size_t len = 0;
+
+    zassert_equal(wrapped_settings_get_raw("never_set", read, sizeof(read), &len), -ENOENT);
+}
+
+ZTEST(wrapped_settings, test_buffer_too_small) {
+    uint8_t value[32] = {0};
+    uint8_t read[8];
+    size_t len = 0;
+
+    zassert_ok(wrapped_settings_set_raw("big", value, sizeof(value)));
+    zassert_equal(wrapped_settings_get_raw("big", read, sizeof(read), &len), -ENOMEM);
+}
+
+ZTEST(wrapped_settings, test_size_is_optional) {
+    uint8_t value[] = {42};
+    uint8_t read[4] = {0};
+
+    zassert_ok(wrapped_settings_set_raw("no_size", value, sizeof(value)));
+    zassert_ok(wrapped_settings_get_raw("no_size", read, sizeof(read), NULL));
+    zassert_equal(read[0], 42);
+}
+
+ZTEST(wrapped_settings, test_key_too_long) {
+    char key[80];
+    uint8_t value = 1;
+
+    memset(key, 'k', sizeof(key) - 1);
+    key[sizeof(key) - 1] = '\0';
+    zassert_equal(wrapped_settings_set_raw(key, &value, 1), -ENOMEM);
+    zassert_equal(wrapped_settings_set_raw(NULL, &value, 1), -EINVAL);
+}
+
+static void bench_set(void *arg) {
+    static uint8_t counter[8];
+
+    counter[0]++; // A changed value, so every save writes.
+    wrapped_settings_set_raw("bench", counter, sizeof(counter));
+}
+
+static void bench_get(void *arg) {
+    uint8_t read[8];
+    size_t len;
+
+    wrapped_settings_get_raw("bench", read, sizeof(read), &len);
+}
+
+ZTEST(wrapped_settings, test_benchmark_settings) {
+    struct bench_result res;
+
+    bench_run("wrapped_settings_set_raw", bench_set, NULL, 100, 8, &res);
+    bench_run("wrapped_settings_get_raw", bench_get, NULL, 100, 8, &res);
+}
+
+static void *settings_setup(void) {
+    zassert_ok(wrapped_settings_init());
+    return NULL;
+}
+
+ZTEST_SUITE(wrapped_settings, NULL, settings_setup, NULL, NULL, NULL);